@@ -0,0 +1,98 @@
+/// Arena allocator module
+///
+/// Per-thread bump allocator for the temporaries of the MCU pipeline
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "Types.hpp"
+
+namespace cppeg
+{
+    /// Counters of an arena, used to check that the inner loop does not
+    /// allocate from the heap once the arena has grown to its working size
+    struct ArenaStats
+    {
+        /// number of buffers handed out by the arena
+        size_t allocations = 0;
+
+        /// number of blocks the arena allocated from the heap
+        size_t heapAllocations = 0;
+
+        /// highest number of bytes in use between two resets
+        size_t peakBytes = 0;
+
+        /// operator new calls of the thread so far (see threadHeapAllocations()),
+        /// the heap allocations made outside of the arena
+        size_t threadHeapAllocations = 0;
+    };
+
+    /// Arena hands out 64-byte aligned buffers from large blocks.
+    ///
+    /// Buffers are never freed individually: reset() releases all of them at once
+    /// (e.g., after every stripe of MCUs) and keeps the blocks for the next use.
+    class Arena
+    {
+    public:
+        /// alignment of every buffer (a cache line)
+        static const size_t ALIGNMENT = 64;
+
+        /// @param blockSize the size of the blocks allocated from the heap
+        explicit Arena(size_t blockSize = 64 * 1024);
+
+        ~Arena();
+
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        /// allocate an aligned buffer valid until the next reset()
+        void *allocate(size_t bytes);
+
+        /// allocate an aligned array of count elements valid until the next reset()
+        template <typename T>
+        T *allocate(size_t count)
+        {
+            return static_cast<T *>(allocate(count * sizeof(T)));
+        }
+
+        /// release every buffer, the blocks are kept for reuse
+        void reset();
+
+        /// the counters of the arena and of the calling thread
+        ArenaStats stats() const;
+
+    private:
+        struct Block
+        {
+            UInt8 *data;
+            size_t size;
+        };
+
+        size_t m_blockSize;
+
+        std::vector<Block> m_blocks;
+
+        /// the block buffers are currently taken from and the offset in it
+        size_t m_current = 0, m_offset = 0;
+
+        /// bytes handed out since the last reset
+        size_t m_bytesInUse = 0;
+
+        ArenaStats m_stats;
+    };
+
+    /// Get the arena of the calling thread
+    Arena &threadArena();
+
+    /// Get the number of operator new calls made by the calling thread.
+    ///
+    /// They are only counted in a build with CPPEG_COUNT_HEAP_ALLOCATIONS defined
+    /// (cmake -DCPPEG_COUNT_HEAP_ALLOCATIONS=ON), which replaces the global operator
+    /// new; otherwise it is always 0.
+    size_t threadHeapAllocations();
+}
+
+#endif // ARENA_HPP
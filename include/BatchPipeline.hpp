@@ -0,0 +1,70 @@
+/// Batch pipeline module
+///
+/// Encodes a list of images with reading, encoding and writing overlapped
+
+#ifndef BATCH_PIPELINE_HPP
+#define BATCH_PIPELINE_HPP
+
+#include <string>
+#include <vector>
+
+#include "Types.hpp"
+
+namespace cppeg
+{
+    /// BatchPipeline encodes many images with three kinds of stages running concurrently:
+    ///
+    /// - a reader thread that decodes the next inputs ahead of the encoders,
+    /// - encoder threads, each with its own Encoder whose tables are reused,
+    /// - the calling thread, which writes every finished file with a single write call.
+    ///
+    /// The stages are connected by bounded lock-free queues (SPSCQueue): every encoder has
+    /// one input and one output queue, the images are dealt to the encoders round-robin and
+    /// collected in the same order, so the files are written in the order of the jobs.
+    /// A full queue blocks the stage before it, which bounds the number of images in memory.
+    class BatchPipeline
+    {
+    public:
+        struct Job
+        {
+            std::string iFilename;
+            std::string oFilename;
+        };
+
+        struct Stats
+        {
+            size_t encoded = 0;
+
+            /// images that could not be read, encoded or written
+            size_t failed = 0;
+
+            size_t bytesWritten = 0;
+
+            /// wall time of the whole batch
+            double seconds = 0;
+
+            /// busy time of each stage, summed over its threads
+            double readSeconds = 0, encodeSeconds = 0, writeSeconds = 0;
+        };
+
+        /// @param encodeThreads number of encoder threads, 0 chooses one per core left
+        /// after the reader and writer threads
+        /// @param queueDepth number of images each queue holds
+        explicit BatchPipeline(unsigned encodeThreads = 0, size_t queueDepth = 4);
+
+        /// @param quality 1 (smallest file) to 100 (best quality) for every image
+        void setQuality(int quality);
+
+        /// encode all jobs, returns when every file is written
+        Stats run(const std::vector<Job> &jobs);
+
+    private:
+        unsigned m_encodeThreads;
+
+        size_t m_queueDepth;
+
+        int m_quality = 50;
+    };
+}
+
+#endif // BATCH_PIPELINE_HPP
@@ -0,0 +1,91 @@
+/// Block cache module
+///
+/// Content-addressed cache of entropy coded MCUs for images with repeated blocks
+
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "Types.hpp"
+
+namespace cppeg
+{
+    /// BlockCache maps the pixels of an MCU to its coded data.
+    ///
+    /// Only the DC terms depend on the neighbouring MCUs (through the DC prediction),
+    /// so an entry keeps the quantized DC values and the finished AC bits of each channel.
+    /// A repeated MCU then costs a hash, a compare and the DC codes.
+    ///
+    /// The cache is direct-mapped with a fixed number of entries: a new block replaces
+    /// the entry of its slot. It is not thread-safe, every encoder (thread) owns its cache.
+    class BlockCache
+    {
+    public:
+        /// number of bytes of an 8x8 MCU with 3 channels
+        static const size_t MCU_BYTES = 8 * 8 * 3;
+
+        struct Entry
+        {
+            bool valid = false;
+
+            UInt64 hash = 0;
+
+            /// the pixels of the MCU, compared on lookup to rule out hash collisions
+            UInt8 pixels[MCU_BYTES];
+
+            /// unquantized DC coefficients of Y, Cb, Cr
+            float DCCoefficients[3];
+
+            /// quantized DC coefficients of Y, Cb, Cr
+            int DCValues[3];
+
+            /// squared quantization errors of Y, Cb, Cr (see RLC::quantizeMCU())
+            double squaredErrors[3];
+
+            /// Huffman coded AC terms of Y, Cb and Cr (up to EOB), one after another
+            std::string ACBits;
+
+            /// end of each channel's AC bits in ACBits
+            size_t ACBitsEnd[3];
+        };
+
+        /// set the number of entries, 0 disables the cache
+        ///
+        /// The existing entries are dropped.
+        void setCapacity(size_t entries);
+
+        size_t capacity() const { return m_entries.size(); }
+
+        /// drop every entry (e.g., when the quantization tables change)
+        void clear();
+
+        /// compute the hash of an MCU
+        ///
+        /// @param MCU 8x8 MCU of type CV_8UC3
+        /// @param isYCrCb whether the MCU is already converted into YCrCb,
+        /// equal pixels in different color spaces do not share entries
+        static UInt64 hashBlock(const cv::Mat &MCU, bool isYCrCb);
+
+        /// look up an MCU
+        ///
+        /// @param MCU 8x8 MCU of type CV_8UC3
+        /// @param hash the hash of the MCU computed by hashBlock()
+        /// @return the entry of the MCU or nullptr if it is not cached
+        const Entry *find(const cv::Mat &MCU, UInt64 hash) const;
+
+        /// take the slot of an MCU, the caller fills in the coded data
+        ///
+        /// @param MCU 8x8 MCU of type CV_8UC3
+        /// @param hash the hash of the MCU computed by hashBlock()
+        /// @return the entry whose key is the MCU (ACBits is cleared)
+        Entry &insert(const cv::Mat &MCU, UInt64 hash);
+
+    private:
+        std::vector<Entry> m_entries;
+    };
+}
+
+#endif // BLOCKCACHE_HPP
@@ -0,0 +1,90 @@
+/// Coefficient file module
+///
+/// Memory-mappable file of the quantized DCT coefficients of an image, the input of entropy-only encodes
+
+#ifndef COEFFICIENT_FILE_HPP
+#define COEFFICIENT_FILE_HPP
+
+#include <string>
+#include <vector>
+
+#include "Types.hpp"
+
+namespace cppeg
+{
+    /// CoefficientFile holds everything the entropy coder needs to write a JPEG
+    /// stream again: the frame size, the quantization tables and the quantized
+    /// coefficients, so re-packaging an image skips imread, color conversion, DCT
+    /// and quantization.
+    ///
+    /// Layout of the file (host byte order):
+    ///
+    /// - a 320-byte header: magic, version, frame size, block grid, component count,
+    ///   quality, the two quantization tables in zig-zag order and the data location,
+    /// - the coefficients as Int16, 3 x 64 (Y, Cb, Cr) in zig-zag order per MCU with the
+    ///   MCUs in raster order; the DC terms are not predicted.
+    ///
+    /// The file is read through a read-only memory mapping, the coefficients are never copied.
+    class CoefficientFile
+    {
+    public:
+        struct Header
+        {
+            UInt32 magic;
+            UInt32 version;
+            UInt32 width, height;
+            UInt32 blocksPerLine, blocksPerColumn;
+            UInt32 componentCount;
+            UInt32 quality;
+
+            /// luminance (0) and chrominance (1) tables in zig-zag order
+            UInt16 QTables[2][64];
+
+            /// offset of the coefficients from the start of the file and their size in bytes
+            UInt64 dataOffset, dataSize;
+        };
+
+        CoefficientFile() = default;
+
+        ~CoefficientFile();
+
+        CoefficientFile(const CoefficientFile &) = delete;
+        CoefficientFile &operator=(const CoefficientFile &) = delete;
+
+        /// write a coefficient file
+        ///
+        /// @param QTables luminance and chrominance tables in zig-zag order
+        /// @param coefficients 3 x 64 coefficients per MCU, see Encoder::quantizedCoefficients()
+        static bool write(const std::string &filename, int width, int height, int quality,
+                          const std::vector<std::vector<UInt16>> &QTables, const std::vector<Int16> &coefficients);
+
+        /// map a coefficient file, the previous file is closed first
+        bool open(const std::string &filename);
+
+        void close();
+
+        bool isOpen() const { return m_mapping != nullptr; }
+
+        const Header &header() const { return *m_header; }
+
+        /// the coefficients of the MCU in row blockY and column blockX, 3 x 64 values
+        const Int16 *MCU(int blockX, int blockY) const
+        {
+            return m_coefficients + ((size_t)blockY * m_header->blocksPerLine + blockX) * 3 * 64;
+        }
+
+        /// the coefficients of every MCU
+        const Int16 *coefficients() const { return m_coefficients; }
+
+    private:
+        UInt8 *m_mapping = nullptr;
+
+        size_t m_mappingSize = 0;
+
+        const Header *m_header = nullptr;
+
+        const Int16 *m_coefficients = nullptr;
+    };
+}
+
+#endif // COEFFICIENT_FILE_HPP
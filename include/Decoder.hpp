@@ -0,0 +1,185 @@
+/// Decoder module
+///
+/// Baseline and progressive JPEG decoder with table-driven Huffman decoding, used to verify
+/// encoded files and to read the coefficients of transcoded files
+
+#ifndef DECODER_HPP
+#define DECODER_HPP
+
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "Types.hpp"
+
+namespace cppeg
+{
+    /// Decoder parses a Huffman-coded JPEG stream into its quantized coefficients: baseline
+    /// (SOF0), extended sequential (SOF1, 8-bit samples) or progressive (SOF2).
+    ///
+    /// The Huffman codes are decoded with a lookahead table indexed by the next
+    /// LOOKAHEAD_BITS bits of the stream, which resolves most codes with one lookup;
+    /// longer codes fall back to the canonical code ranges of ITU-T.81 Annex F.
+    /// Stuffed zero bytes are removed while the bits are read and the restart markers
+    /// (DRI, RSTn) reset the DC predictions. Interleaved and single-component scans
+    /// are both supported, with any sampling factors. The scans of a progressive frame
+    /// (spectral selection and successive approximation, ITU-T.81 Annex G) are
+    /// accumulated into the same coefficients, which are complete after the last scan.
+    ///
+    /// The coefficients can then be turned into pixels by an inverse DCT.
+    class Decoder
+    {
+    public:
+        static const int LOOKAHEAD_BITS = 9;
+
+        /// a component of the frame and its decoded coefficients
+        struct Component
+        {
+            UInt8 id = 0;
+
+            UInt8 hSampFactor = 1, vSampFactor = 1;
+
+            UInt8 QTableNo = 0;
+
+            /// number of blocks in a row and in a column, padded to whole MCUs
+            int blocksPerLine = 0, blocksPerColumn = 0;
+
+            /// 64 quantized coefficients in zig-zag order per block, blocks in raster order
+            std::vector<Int16> coefficients;
+
+            const Int16 *block(int blockX, int blockY) const
+            {
+                return &coefficients[((size_t)blockY * blocksPerLine + blockX) * 64];
+            }
+
+            Int16 *block(int blockX, int blockY)
+            {
+                return &coefficients[((size_t)blockY * blocksPerLine + blockX) * 64];
+            }
+        };
+
+        /// decode a whole JPEG stream
+        ///
+        /// @return false if the stream is not a valid JPEG stream of a supported frame type (see error())
+        bool decode(const char *data, size_t size);
+
+        /// turn the coefficients into an 8-bit BGR image
+        ///
+        /// The coefficients are dequantized and inverse transformed, subsampled
+        /// components are upsampled by replication and YCbCr is converted to BGR.
+        cv::Mat toImage() const;
+
+        int width() const { return m_width; }
+
+        int height() const { return m_height; }
+
+        const std::vector<Component> &components() const { return m_components; }
+
+        /// whether the frame is progressive (SOF2)
+        bool progressive() const { return m_progressive; }
+
+        /// quantization table in zig-zag order
+        const UInt16 *QTable(int tableNo) const { return m_QTables[tableNo & 3]; }
+
+        /// the reason of the last failure
+        const std::string &error() const { return m_error; }
+
+    private:
+        /// a Huffman table with its lookahead table
+        struct HuffmanDecodingTable
+        {
+            bool defined = false;
+
+            /// (code length << 8 | symbol) of the codes of at most LOOKAHEAD_BITS bits,
+            /// indexed by the next LOOKAHEAD_BITS bits, 0 for longer codes
+            UInt16 lookahead[1 << LOOKAHEAD_BITS];
+
+            /// the largest code of each length (-1 if none), and the index
+            /// in symbols and the value of the first code of each length
+            Int32 maxCode[18];
+            Int32 firstIndex[17], firstCode[17];
+
+            UInt8 symbols[256];
+        };
+
+        int m_width = 0, m_height = 0;
+
+        bool m_progressive = false;
+
+        std::vector<Component> m_components;
+
+        UInt16 m_QTables[4][64];
+
+        HuffmanDecodingTable m_huffmanTables[2][4];
+
+        /// MCUs between two restart markers, 0 without restart markers
+        int m_restartInterval = 0;
+
+        /// spectral selection (Ss, Se) and successive approximation (Ah, Al) of the current scan
+        int m_spectralStart = 0, m_spectralEnd = 63, m_approximationHigh = 0, m_approximationLow = 0;
+
+        /// blocks left in the current end-of-band run of a progressive AC scan
+        int m_EOBRun = 0;
+
+        std::string m_error;
+
+        /// the stream being decoded
+        const UInt8 *m_data = nullptr;
+        size_t m_size = 0, m_pos = 0;
+
+        /// bit reader state: the next bits left-aligned in a 64-bit register
+        UInt64 m_bitBuffer = 0;
+        int m_bitCount = 0;
+
+        bool fail(const std::string &message);
+
+        bool readDQT(const UInt8 *segment, size_t length);
+
+        bool readDHT(const UInt8 *segment, size_t length);
+
+        /// read the frame header of an SOF0, SOF1 or SOF2 segment
+        bool readSOF(const UInt8 *segment, size_t length);
+
+        /// decode the scan following an SOS segment
+        bool readScan(const UInt8 *segment, size_t length);
+
+        /// refill the bit register, stopping at a marker (the missing bits read as zeros)
+        void fillBits();
+
+        /// drop the bits of the current byte and step over the RSTn marker
+        bool readRestartMarker(int expected);
+
+        int decodeHuffman(const HuffmanDecodingTable &table);
+
+        /// read the next bits of the stream as an unsigned value (at most 16 bits)
+        int readBits(int count);
+
+        /// read the additional bits of a value of the given category and extend its sign
+        int receiveExtend(int category);
+
+        /// decode the 64 coefficients of a block
+        ///
+        /// @param DCPrediction the DC value of the previous block of the component, updated
+        bool decodeBlock(const HuffmanDecodingTable &DCTable, const HuffmanDecodingTable &ACTable,
+                         int &DCPrediction, Int16 *block);
+
+        /// decode the DC term of a block in the first scan of a progressive frame
+        bool decodeDCFirst(const HuffmanDecodingTable &DCTable, const HuffmanDecodingTable &ACTable,
+                           int &DCPrediction, Int16 *block);
+
+        /// decode the next bit of the DC term of a block
+        bool decodeDCRefine(const HuffmanDecodingTable &DCTable, const HuffmanDecodingTable &ACTable,
+                            int &DCPrediction, Int16 *block);
+
+        /// decode the band Ss..Se of a block in its first AC scan
+        bool decodeACFirst(const HuffmanDecodingTable &DCTable, const HuffmanDecodingTable &ACTable,
+                           int &DCPrediction, Int16 *block);
+
+        /// decode the next bit of the band Ss..Se of a block: the new coefficients of
+        /// magnitude 1 and a correction bit for each coefficient that is already nonzero
+        bool decodeACRefine(const HuffmanDecodingTable &DCTable, const HuffmanDecodingTable &ACTable,
+                            int &DCPrediction, Int16 *block);
+    };
+}
+
+#endif // DECODER_HPP
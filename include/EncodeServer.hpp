@@ -0,0 +1,171 @@
+/// Encode server module
+///
+/// Long-running encoder serving requests over a Unix domain socket, and its client
+
+#ifndef ENCODE_SERVER_HPP
+#define ENCODE_SERVER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "Types.hpp"
+
+namespace cppeg
+{
+    class Encoder;
+    class MemorySink;
+
+    /// Socket protocol
+    ///
+    /// A connection carries any number of requests, each answered by one response.
+    /// The integers are in host byte order (both ends run on the same machine).
+
+    /// first field of every request
+    const UInt32 SERVER_MAGIC = 0x47455043; // "CPEG"
+
+    enum RequestType : UInt8
+    {
+        RAW_PIXELS = 0,  // payload: height rows of width x 3 bytes of BGR pixels
+        FILE_PATH = 1,   // payload: path of an image file readable by the server
+        SERVER_STATS = 2 // no payload, the response is the statistics as text
+    };
+
+    /// flags of a request
+    const UInt8 REQUEST_THUMBNAIL = 0x01;
+
+    struct RequestHeader
+    {
+        UInt32 magic = SERVER_MAGIC;
+        UInt8 type = RAW_PIXELS;
+        UInt8 quality = 50;
+        UInt8 flags = 0;
+        UInt8 reserved = 0;
+        UInt32 width = 0;
+        UInt32 height = 0;
+        UInt32 payloadSize = 0;
+    };
+
+    struct ResponseHeader
+    {
+        /// 0 on success, the payload is then the JPEG file (or the statistics),
+        /// otherwise the payload is an error message
+        UInt32 status = 0;
+        UInt32 payloadSize = 0;
+    };
+
+    /// EncodeServer keeps encoders warm and serves encode requests over a Unix domain socket.
+    ///
+    /// Every worker thread owns an Encoder built once at startup (Huffman tables,
+    /// quantization tables and buffers), and serves one connection at a time.
+    /// Accepted connections wait in a queue until a worker is free.
+    class EncodeServer
+    {
+    public:
+        struct Stats
+        {
+            size_t requests = 0;
+
+            size_t failedRequests = 0;
+
+            size_t bytesSent = 0;
+
+            /// connections waiting for a worker, now and at most
+            size_t queueDepth = 0, maxQueueDepth = 0;
+
+            /// time from receiving a request to sending its response
+            double totalLatency = 0, maxLatency = 0;
+
+            double uptime = 0;
+        };
+
+        /// @param threads number of worker threads, 0 chooses one per core
+        explicit EncodeServer(unsigned threads = 0);
+
+        ~EncodeServer();
+
+        /// create and listen on the socket, an existing file at the path is replaced
+        bool open(const std::string &socketPath);
+
+        /// serve until stop becomes true, then close every connection and the socket
+        void serve(const std::atomic<bool> &stop);
+
+        Stats stats() const;
+
+        /// the statistics as text: requests, latency, queue depth and throughput
+        std::string statsString() const;
+
+    private:
+        unsigned m_threads;
+
+        std::string m_socketPath;
+
+        int m_listenFd = -1;
+
+        std::vector<std::unique_ptr<Encoder>> m_encoders;
+
+        /// accepted connections waiting for a worker
+        std::deque<int> m_connections;
+
+        /// connections being served, shut down when the server stops
+        std::set<int> m_activeConnections;
+
+        bool m_stopping = false;
+
+        std::mutex m_mutex;
+
+        std::condition_variable m_connectionCond;
+
+        mutable std::mutex m_statsMutex;
+
+        Stats m_stats;
+
+        std::chrono::steady_clock::time_point m_startTime;
+
+        /// serve the queued connections with the given encoder
+        void worker(Encoder &encoder);
+
+        /// read one request from a connection and answer it
+        ///
+        /// @return false if the connection is closed or broken
+        bool handleRequest(int fd, Encoder &encoder, MemorySink &output);
+
+        void recordRequest(bool succeeded, size_t bytesSent, double latency);
+    };
+
+    /// EncodeClient sends requests to an EncodeServer
+    class EncodeClient
+    {
+    public:
+        ~EncodeClient();
+
+        bool connect(const std::string &socketPath);
+
+        /// encode an 8-bit BGR image
+        ///
+        /// @param jpeg the JPEG file on success, the error message otherwise
+        bool encodeImage(const cv::Mat &image, int quality, bool embedThumbnail, std::vector<char> &jpeg);
+
+        /// encode an image file read by the server
+        ///
+        /// @param jpeg the JPEG file on success, the error message otherwise
+        bool encodeFile(const std::string &path, int quality, bool embedThumbnail, std::vector<char> &jpeg);
+
+        /// get the statistics of the server as text
+        bool stats(std::string &text);
+
+    private:
+        int m_fd = -1;
+
+        bool request(const RequestHeader &header, const char *payload, std::vector<char> &response);
+    };
+}
+
+#endif // ENCODE_SERVER_HPP
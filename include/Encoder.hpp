@@ -11,13 +11,24 @@
 #include "Markers.hpp"
 #include "Types.hpp"
 #include "HuffmanTree.hpp"
+#include "HuffmanLibrary.hpp"
 #include "RLC.hpp"
+#include "Arena.hpp"
+#include "BlockCache.hpp"
+#include "OutputSink.hpp"
+#include "CoefficientFile.hpp"
+#include "Decoder.hpp"
+#include "Transform.hpp"
 
 namespace cppeg
 {
     class Encoder
     {
     public:
+        /// rows of MCUs and distance between the MCUs sampled by the Huffman table selection
+        static const int HUFFMAN_SAMPLE_STRIPES = 16;
+        static const int HUFFMAN_SAMPLE_STEP = 16;
+
         enum ResultCode
         {
             SUCCESS,
@@ -27,6 +38,63 @@ namespace cppeg
             ENCODE_DONE
         };
 
+        /// output configuration of a variant encoded by encodeImageVariants()
+        struct Variant
+        {
+            std::string filename;
+            int quality = 50;
+        };
+
+        /// output of a resolution level encoded by encodeImageLadder()
+        struct LadderLevel
+        {
+            std::string filename;
+            int scaleDenom = 1; // 1, 2, 4 or 8: the level is 1 / scaleDenom of the image
+        };
+
+        /// counters of the last encode
+        struct EncodeStats
+        {
+            size_t MCUCount = 0;
+
+            /// single channel blocks that were uniform, coded as DC + EOB without a DCT
+            size_t flatBlocks = 0;
+
+            /// MCUs transformed by the last incremental encode
+            size_t changedMCUs = 0;
+
+            /// lookups of the duplicate block cache
+            size_t blockCacheHits = 0, blockCacheMisses = 0;
+
+            /// buffers taken from the per-thread arenas by the MCU pipeline
+            size_t arenaAllocations = 0;
+
+            /// heap blocks allocated by those arenas, stays 0 once they have grown to
+            /// their working size; the other allocations of the loop are not seen here
+            size_t arenaHeapAllocations = 0;
+
+            size_t arenaPeakBytes = 0;
+
+            /// operator new calls on the threads of the MCU pipeline during the encode
+            /// (scan and run-length buffers growing, ...), the arena blocks excluded;
+            /// only counted in a CPPEG_COUNT_HEAP_ALLOCATIONS build (see threadHeapAllocations())
+            size_t heapAllocations = 0;
+
+            /// squared quantization errors of Y, Cb and Cr summed over the samples of
+            /// the scan, measured in the DCT domain while quantizing (the replicated
+            /// samples of the border MCUs included, the color conversion excluded)
+            double squaredErrors[3] = {0.0, 0.0, 0.0};
+
+            /// mean squared error of a component (0: Y, 1: Cb, 2: Cr), or of the whole image with -1
+            double MSE(int component = -1) const;
+
+            /// peak signal-to-noise ratio in dB for 8-bit samples, infinite for an exact scan
+            double PSNR(int component = -1) const;
+
+            /// name of the Huffman table set of the scan (see setHuffmanTableSelection())
+            const char *huffmanTableSet = "default";
+        };
+
         Encoder();
 
         Encoder(const std::string &filename);
@@ -39,36 +107,487 @@ namespace cppeg
         /// @param oFilename the path of the output compressed file name
         bool open(const std::string &iFilename, std::string oFilename = "");
 
+        /// open only the input image file (for encodeImageVariants())
+        ///
+        /// @param iFilename the path of the input image file name
+        bool openImage(const std::string &iFilename);
+
         ResultCode encodeImageFile();
 
+        /// encode the image file with the highest quality whose output does
+        /// not exceed the given size
+        ///
+        /// The DCT coefficients are computed once, then each search step only
+        /// re-quantizes them and measures the exact size without writing any byte.
+        ///
+        /// @param targetBytes the maximum size of the output file in bytes
+        /// @return ENCODE_INCOMPLETE if even the lowest quality exceeds the target
+        ResultCode encodeImageFileToSize(size_t targetBytes);
+
+        /// encode the opened image into several files with different settings
+        ///
+        /// The color conversion and the DCT are computed once, in one traversal
+        /// of the image, and the coefficients are fanned out to one quantization
+        /// and entropy coding worker thread per variant.
+        ///
+        /// @param variants the output configurations
+        /// @return the result of every variant
+        std::vector<ResultCode> encodeImageVariants(const std::vector<Variant> &variants);
+
+        /// encode the opened image at several resolutions (1, 1/2, 1/4 and 1/8)
+        ///
+        /// The image is traversed once: the full resolution scan is encoded from
+        /// the DCT coefficients and the smaller levels are derived from their
+        /// low-frequency 4x4, 2x2 and 1x1 corners by scaled inverse DCTs, without
+        /// any color conversion or resize of the source pixels.
+        ///
+        /// @param levels the outputs to write
+        /// @return the result of every level
+        std::vector<ResultCode> encodeImageLadder(const std::vector<LadderLevel> &levels);
+
+        /// embed a thumbnail in the APP0 segment
+        ///
+        /// The thumbnail is built from the DC coefficients of the MCUs, which
+        /// form a 1/8 scale image, so no extra pass over the pixels is needed.
+        void setThumbnailEnabled(bool enabled);
+
+        /// set the number of entries of the duplicate block cache, 0 (default) disables it
+        ///
+        /// MCUs whose pixels were already seen reuse their coded AC terms, which skips
+        /// color conversion, DCT, quantization and Huffman coding except for the DC.
+        /// The cache is kept between the frames of a stream.
+        void setBlockCacheSize(size_t entries);
+
+        /// encode each component in its own non-interleaved scan
+        ///
+        /// The image is converted into YCrCb once, then the DCT, quantization and
+        /// Huffman coding of Y, Cb and Cr run on a thread each, into their own
+        /// buffers. The three scans follow each other, each with its own SOS segment.
+        /// Applies to encodeImageFile() and encodeFrame(); the block cache is not used.
+        void setComponentScans(bool enabled);
+
+        /// compute only the DCT coefficients that can survive quantization (see PrunedDCT)
+        ///
+        /// The bound on the AC coefficients of each block is checked against the active
+        /// quantization table, the blocks with more energy take the full DCT, so the
+        /// output is the same as with the full DCT. Low qualities and the chrominance
+        /// benefit most. Applies to the MCU encode loop of encodeImageFile(), encodeFrame()
+        /// and the component scans, but not to the cached or the incremental encodes.
+        void setPrunedDCT(bool enabled);
+
+        /// choose the Huffman tables of each encode from the pretrained sets of the library
+        ///
+        /// The symbols of a sparse sample of MCUs (every HUFFMAN_SAMPLE_STEP-th MCU and its
+        /// left neighbour, for the DC prediction) of the first HUFFMAN_SAMPLE_STRIPES rows of
+        /// MCUs are counted, and the set coding them with the fewest bits is written into
+        /// the DHT segment; only the top of the image is needed before the scan starts.
+        /// The chosen set is reported in the stats. Disabled by default: the suggested
+        /// tables of ITU-T.81 Annex K are always used.
+        void setHuffmanTableSelection(bool enabled);
+
+        /// count the Huffman symbols of every MCU of a frame with the current quality
+        ///
+        /// Used to train the table sets of the library (see huffmanTableFromCounts()).
+        ///
+        /// @param frame 8-bit BGR image, only referenced during the call
+        /// @param statistics the counts are added to it
+        void addHuffmanStatistics(const cv::Mat &frame, HuffmanStatistics &statistics);
+
+        /// keep the quantized coefficients of the next encodes (see quantizedCoefficients())
+        ///
+        /// The duplicate block cache is bypassed while they are kept.
+        void setKeepQuantizedCoefficients(bool enabled);
+
+        /// @return the quantized coefficients of the last encode, 3 x 64 (Y, Cb, Cr) in
+        /// zig-zag order per MCU in scan order, the DC terms are not predicted; empty
+        /// unless setKeepQuantizedCoefficients() was enabled
+        const std::vector<Int16> &quantizedCoefficients() const;
+
+        /// save the quantized coefficients of the last encode into a coefficient file
+        ///
+        /// The file also holds the frame size and the quantization tables, see
+        /// encodeCoefficientFile(). Needs setKeepQuantizedCoefficients() before the encode.
+        bool saveQuantizedCoefficients(const std::string &filename);
+
+        /// write a JPEG stream from the coefficients of a coefficient file
+        ///
+        /// Only the Huffman coding and the bit packing run: no image is read, converted
+        /// or transformed. The encoder takes the quantization tables of the file. The
+        /// thumbnail and the component scans (setComponentScans()) are supported; the
+        /// quantization errors are unknown, so the MSE of the stats stays 0.
+        ResultCode encodeCoefficientFile(const CoefficientFile &file, OutputSink &output);
+
+        /// write a JPEG stream from the coefficients of another JPEG stream, without going through the pixels
+        ///
+        /// The coefficients of every block are dequantized with the tables of the source
+        /// and quantized again with the tables of setQuality(); the components whose
+        /// source table equals the target table are passed through as they are. With
+        /// keepSourceTables, the encoder takes the tables of the source (limited to 8 bits)
+        /// and no coefficient changes, so the image stays exactly the same. The frame keeps
+        /// the size and the sampling factors of the source, grayscale sources get flat
+        /// chrominance. The coefficients are Huffman coded with the tables of the encoder
+        /// (see setHuffmanTableSelection(), which counts the symbols of the whole frame)
+        /// into one interleaved scan, with the thumbnail if enabled. The MSE of the stats
+        /// is the error the requantization adds to the source.
+        ///
+        /// @param source a decoder holding the coefficients of a stream of 1 or 3 components
+        ResultCode transcode(const Decoder &source, OutputSink &output, bool keepSourceTables = false);
+
+        /// set the stream log messages are written into
+        ///
+        /// @param log the stream, or nullptr (default) for logFile of the thread the encoder runs on
+        void setLogStream(std::ostream *log);
+
+        /// scale the suggested quantization tables (ITU-T.81, page 143)
+        ///
+        /// @param quality 1 (smallest file) to 100 (best quality), 50 keeps the suggested tables
+        void setQuality(int quality);
+
+        /// encode a single frame into the given stream
+        ///
+        /// The tables and the internal buffers of the encoder are reused between
+        /// calls, which makes it suitable for encoding a sequence of frames.
+        ///
+        /// @param frame 8-bit BGR image, only referenced during the call
+        /// @param output the stream to which the JPEG bytes are written
+        ResultCode encodeFrame(const cv::Mat &frame, std::ostream &output);
+
+        /// encode a single frame into the given sink
+        ///
+        /// The bytes are only appended to the sink, which is flushed at the end.
+        ResultCode encodeFrame(const cv::Mat &frame, OutputSink &output);
+
+        /// encode a frame, recomputing only the MCUs that changed since the previous call
+        ///
+        /// The quantized coefficients and the pixel hash of every MCU are kept between
+        /// calls. The color conversion, DCT and quantization run only for the changed MCUs,
+        /// then the whole scan is entropy coded from the kept coefficients. The first call,
+        /// or a call after the size or the quality changed, transforms every MCU.
+        ///
+        /// @param frame 8-bit BGR image, only referenced during the call
+        /// @param output the stream to which the JPEG bytes are written
+        /// @param dirtyRects the changed regions of the frame; if empty, the changed MCUs are
+        /// found by comparing the pixel hashes, otherwise the MCUs outside of them are reused as is
+        ResultCode encodeFrameIncremental(const cv::Mat &frame,
+                                          std::ostream &output,
+                                          const std::vector<cv::Rect> &dirtyRects = std::vector<cv::Rect>());
+
+        ResultCode encodeFrameIncremental(const cv::Mat &frame,
+                                          OutputSink &output,
+                                          const std::vector<cv::Rect> &dirtyRects = std::vector<cv::Rect>());
+
+        /// compute the exact size of the JPEG file encodeFrame() would write
+        ///
+        /// The frame goes through the same color conversion, DCT, quantization and
+        /// run-length coding, but the Huffman codes and the additional bits are only
+        /// counted, along with the 0xFF bytes that get a stuffed zero byte: no bit
+        /// string is built and no byte of the scan is written.
+        ///
+        /// @param frame 8-bit BGR image, only referenced during the call
+        /// @return the size in bytes, 0 if the frame is not an 8-bit BGR image
+        size_t measureFrame(const cv::Mat &frame);
+
         void close();
 
+        /// @return the counters of the last encode
+        const EncodeStats &stats() const;
+
     private:
         std::string m_filename;
 
-        std::ofstream m_imageFile;
+        FileSink m_imageFile;
+
+        /// the sink all segments are written into (the image file or a frame sink)
+        OutputSink *m_output = nullptr;
+
+        /// the data of the segment being written, kept to reuse its storage
+        MemorySink m_segment;
+
+        /// the segments that only depend on the tables, rendered once and copied into every
+        /// stream until the quality or the Huffman tables change (not used with a thumbnail)
+        struct HeaderCache
+        {
+            bool valid = false;
+
+            /// SOI, APP0, COM and DQT
+            MemorySink leadingSegments;
+
+            MemorySink DHTSegment;
+        } m_headerCache;
+
+        /// the stream log messages are written into, nullptr for the log of the calling thread
+        std::ostream *m_log = nullptr;
+
+        /// the stream log messages are written into
+        std::ostream &log();
 
         cv::Mat m_image;
 
+        /// number of MCUs in a row and in a column of the image
+        int m_hBlockNum = 0, m_vBlockNum = 0;
+
+        /// size of the frame written in the SOF0 segment, set with the MCU grid
+        int m_frameWidth = 0, m_frameHeight = 0;
+
+        /// run-length codes of the current MCU, kept to reuse their storage
+        RLCContainer m_runLengthCode;
+
+        EncodeStats m_stats;
+
+        /// cache of the coded MCUs, dropped when the quality changes
+        BlockCache m_blockCache;
+
+        /// quantized coefficients of the previous frame, used by encodeFrameIncremental()
+        struct CoefficientStore
+        {
+            bool valid = false;
+
+            int width = 0, height = 0;
+
+            /// pixel hash of each MCU (see BlockCache::hashBlock())
+            std::vector<UInt64> blockHashes;
+
+            /// 3 x 64 quantized coefficients in zig-zag order per MCU
+            std::vector<Int16> coefficients;
+
+            /// 3 nonzero AC masks per MCU
+            std::vector<UInt64> nonzeroMasks;
+
+            /// squared quantization errors of Y, Cb, Cr per MCU
+            std::vector<double> squaredErrors;
+
+            /// unquantized DC coefficients of Y, Cb, Cr per MCU, the pixels of the thumbnail
+            std::vector<float> DCCoefficients;
+        } m_coefficientStore;
+
+        /// bit string of the compressed scan data
+        std::string m_scanData;
+
+        /// the packed and byte-stuffed scan data, kept to reuse its storage
+        std::string m_scanBytes;
+
+        bool m_componentScans = false;
+
+        bool m_prunedDCT = false;
+
+        /// bit strings and packed scan data of the Y, Cb and Cr scans (see setComponentScans())
+        std::string m_componentScanData[3], m_componentScanBytes[3];
+
+        /// the YCrCb image encoded by the component threads, kept to reuse its storage
+        cv::Mat m_YCrCbImage;
+
+        /// the component of the scan whose SOS segment is written, -1 for the interleaved scan
+        int m_scanComponent = -1;
+
+        bool m_keepQuantizedCoefficients = false;
+
+        /// quantized coefficients of the last encode, see quantizedCoefficients()
+        std::vector<Int16> m_quantizedCoefficients;
+
+        /// the coefficients of Y, Cb and Cr of a transcoded frame (see transcode())
+        struct TranscodeFrame
+        {
+            /// 64 quantized coefficients in zig-zag order per block, the blocks of a component in raster order
+            const Int16 *coefficients[3];
+
+            int blocksPerLine[3];
+        };
+
+        /// requantized coefficients of the components of the last transcode, kept to reuse their storage
+        std::vector<Int16> m_transcodedCoefficients[3];
+
+        /// cached unquantized DCT coefficients of every MCU (3 x 64 floats per MCU),
+        /// empty unless the coefficients are reused by several quantization passes
+        std::vector<float> m_DCTCoefficients;
+
+        /// flat channel masks of the cached MCUs (see RLC::MCUToDCTCoefficients())
+        std::vector<UInt8> m_flatChannels;
+
+        int m_quality = 50;
+
+        bool m_embedThumbnail = false;
+
+        /// true if m_image holds YCrCb pixels instead of BGR pixels
+        bool m_imageIsYCrCb = false;
+
+        /// mean Y, Cb and Cr of every MCU, derived from the DC coefficients
+        cv::Mat m_DCImage;
+
+        /// DC values of the current and previous MCU of the scan
+        std::vector<int> m_prevDCValues, m_curDCValues;
+
+        RLC m_rlc;
+
         std::vector<std::vector<UInt16>> m_QTables;
 
-        HuffmanCodeMapper m_huffmanCodeMapper[2][2];
+        /// the tables of the set in use, shared by every encoder (see huffmanCodingTables())
+        const HuffmanCodingTables *m_huffmanCoding = nullptr;
+
+        bool m_selectHuffmanTables = false;
+
+        /// index of the table set in use in huffmanTableSets()
+        int m_huffmanTableSet = 0;
+
+        /// take the tables of a set of the library, if it is not in use yet
+        void useHuffmanTableSet(int tableSet);
+
+        /// sample the MCUs of m_image and take the table set that codes them best
+        ///
+        /// Does nothing unless setHuffmanTableSelection() was enabled.
+        void selectHuffmanTables();
+
+        /// count the Huffman symbols of the MCUs of the first rows of m_image
+        ///
+        /// The cached DCT coefficients are used if there are any.
+        ///
+        /// @param stripeCount number of rows of MCUs to sample
+        /// @param step every step-th MCU of a row is counted, along with the MCU before it for the DC
+        void sampleHuffmanStatistics(HuffmanStatistics &statistics, int stripeCount, int step);
+
+        /// write the whole JPEG stream (SOI to EOI) of m_image into m_output
+        void writeJPEGStream();
+
+        /// write every segment from SOI to SOS (the part preceding the scan data)
+        ///
+        /// @param writeSOS false to stop before the SOS segment
+        void writeHeaderSegments(bool writeSOS = true);
+
+        /// write SOI, APP0, COM and DQT
+        void writeLeadingSegments();
 
-        HuffmanTable m_huffmanTable[2][2];
+        /// render the segments of m_headerCache
+        void cacheHeaderSegments();
 
-        void constructDefaultHuffmanCodeMapper();
+        /// compute the number of MCUs of m_image (the image is padded to a multiple of the MCU size)
+        void prepareMCUGrid();
 
-        void constructDefaultHuffmanTables();
+        /// take the frame size and the MCU grid of a frame, and create the DC image if a thumbnail is built
+        ///
+        /// @param MCUWidth, MCUHeight size of an MCU in pixels, larger than a block for subsampled frames
+        void setFrameSize(int width, int height, int MCUWidth = 8, int MCUHeight = 8);
+
+        /// get an MCU of m_image
+        ///
+        /// Inner MCUs reference the image, MCUs crossing the border are padded
+        /// by replication into a buffer of the thread arena.
+        ///
+        /// @param blockX horizontal index of the MCU
+        /// @param blockY vertical index of the MCU
+        cv::Mat MCUBlock(int blockX, int blockY);
+
+        /// add the arena counters of the calling thread since the given snapshot to the stats
+        void addArenaStats(const ArenaStats &before);
+
+        /// fill m_DCTCoefficients with the DCT coefficients of every MCU
+        void computeDCTCoefficients();
+
+        /// reset the scan data and the DC predictions
+        void beginScan();
+
+        /// quantize the DCT coefficients of an MCU and append its codes to the scan data
+        ///
+        /// @param coefficients 3 x 64 DCT coefficients (see RLC::MCUToDCTCoefficients())
+        void encodeMCUCoefficients(const float *coefficients, UInt8 flatChannels = 0);
+
+        /// append the codes of an MCU to the scan data through the block cache
+        ///
+        /// @param blockX horizontal index of the MCU
+        /// @param blockY vertical index of the MCU
+        /// @param MCU the pixels of the MCU
+        void encodeMCUCached(int blockX, int blockY, const cv::Mat &MCU);
+
+        /// the MCU encode loop of a scan, see encodeBlocks()
+        typedef void (Encoder::*BlockEncoder)(std::string &scanData, EncodeStats &stats);
+
+        /// choose the instantiation of encodeBlocks() for the current configuration
+        ///
+        /// Called once when a scan starts, so the loop itself has no configuration branch.
+        ///
+        /// @param component the component of a single component scan, -1 for the interleaved scan
+        BlockEncoder selectBlockEncoder(int component) const;
+
+        /// choose among the instantiations of encodeBlocks() for a layout and a DCT
+        template <typename Layout, typename DCTEngine>
+        BlockEncoder selectLayoutBlockEncoder() const;
+
+        /// transform, quantize and entropy code every MCU of m_image for the components of a layout
+        ///
+        /// The component count, the Huffman tables, the color conversion, the
+        /// retention of the quantized coefficients, the thumbnail and the DCT are
+        /// resolved at compile time (see selectBlockEncoder()).
+        ///
+        /// @tparam Layout a ScanLayout (see RLC.hpp)
+        /// @tparam KeepCoefficients store the quantized coefficients into m_quantizedCoefficients,
+        /// which must hold 3 x 64 coefficients per MCU
+        /// @tparam Thumbnail store the DC terms into m_DCImage, which must be allocated
+        /// @tparam DCTEngine the forward DCT (see OpenCVDCT)
+        /// @param scanData the bit string the codes are appended to
+        /// @param stats the flat blocks and squared errors are added to it
+        template <typename Layout, bool KeepCoefficients, bool Thumbnail, typename DCTEngine>
+        void encodeBlocks(std::string &scanData, EncodeStats &stats);
+
+        /// encode Y, Cb and Cr of m_image into m_componentScanBytes, one thread per component
+        void encodeComponentScans();
+
+        /// encode a component of the YCrCb image m_image into its own scan
+        ///
+        /// Runs on a thread of its own, the counters go into stats.
+        ///
+        /// @param component 0 (Y), 1 (Cb) or 2 (Cr)
+        void encodeComponentScan(int component, EncodeStats &stats);
+
+        /// entropy code the stored coefficients of a coefficient file
+        ///
+        /// @param component the component of a single component scan, -1 for the interleaved scan
+        /// @param scanData the bit string the codes are appended to
+        /// @return false if a block is out of the range of a baseline scan (see RLC::isBaselineBlock())
+        bool encodeStoredCoefficients(const CoefficientFile &file, int component, std::string &scanData);
+
+        /// quantize the coefficients of a decoded component again with a target table
+        ///
+        /// @param sourceTable, targetTable quantization tables in zig-zag order
+        /// @param requantized the coefficients in the same layout
+        /// @return the sum of the squared errors added to the coefficients
+        static double requantizeCoefficients(const std::vector<Int16> &coefficients, const UInt16 *sourceTable,
+                                             const UInt16 *targetTable, std::vector<Int16> &requantized);
+
+        /// entropy code the MCUs of a transcoded frame into m_scanData
+        ///
+        /// Every MCU holds hSampFactors[c] x vSampFactors[c] blocks of each component c.
+        ///
+        /// @param statistics if not null, nothing is coded: the symbols of every
+        /// HUFFMAN_SAMPLE_STEP-th MCU are counted instead
+        /// @return false if a table has no code for a value of the frame
+        bool encodeTranscodedMCUs(const TranscodeFrame &frame, HuffmanStatistics *statistics);
+
+        /// write the SOS segment and the scan data of each component, then the EOI marker
+        void writeComponentScans();
+
+        /// byte-align and byte-stuff the scan data, then write it and the EOI marker
+        void writeScanBits();
+
+        /// byte-align a bit string with 1 bits, then pack it into bytes with a zero byte stuffed after each 0xFF
+        static void packScanBits(std::string &scanData, std::string &scanBytes);
+
+        /// log the counters of the last encode
+        void logStats();
+
+        /// measure the bytes of the scan data (byte stuffing included) produced
+        /// by the cached coefficients with the current quantization tables
+        size_t countScanBytes();
+
+        /// pass the Huffman codes and additional bits of the run-length codes of an MCU to a meter
+        void RLCToMeter(const RLCContainer &RLC, ScanMeter &meter);
 
         /// convert each channel's run-length code into bit string
         /// and merge them together
         ///
         /// @param RLC array of run-length code for each channel
-        /// @return the bit string corresponding to the run-length code
-        std::string RLCToBitString(const RLCContainer &RLC);
+        /// @param bitString the bit string the codes are appended to
+        void RLCToBitString(const RLCContainer &RLC, std::string &bitString);
 
-        /// write the segment marker ,write segment data, and then calculate payload
-        /// of segment and write it into the file
+        /// write the segment data into the segment buffer, then write the segment
+        /// marker, its length and its data into the output
         ///
         /// @param marker the marker of segment
         /// @param dataWriter the class member function that write the content of segment
@@ -90,17 +609,40 @@ namespace cppeg
 
         void writeSOSSegment();
 
-        void writeScanData();
+        /// encode the scan data of m_image into m_scanData
+        void encodeScan();
+
+        /// write m_scanData and the headers into the given file
+        bool writeJPEGFile(const std::string &filename);
+
+        /// store the DC terms of an MCU into the DC image (if a thumbnail is built)
+        ///
+        /// @param blockX horizontal index of the MCU
+        /// @param blockY vertical index of the MCU
+        /// @param coefficients 3 x 64 DCT coefficients of the MCU
+        /// @param stride distance between the DC terms of the channels in coefficients
+        void collectDCTerm(int blockX, int blockY, const float *coefficients, int stride = 64);
+
+        /// store the DC term of a single component of an MCU into the DC image
+        ///
+        /// @param component 0 (Y), 1 (Cb) or 2 (Cr)
+        void collectDCTerm(int blockX, int blockY, int component, float DCCoefficient);
+
+        /// the pixel of the DC image of a DC coefficient: the mean of the block
+        static float DCTermToSample(float DCCoefficient) { return DCCoefficient / 8.0f + 128.0f; }
+
+        /// convert the DC image into an RGB thumbnail fitting the APP0 segment
+        cv::Mat DCImageToThumbnail();
 
         /// write the 2 bytes marker into the file
         void writeMarker(UInt8 markerType);
 
-        /// write the payload of the segment based on the passed start point of segment
-        /// and current end point of file
+        /// write a whole segment: the marker, the length and the data
         ///
-        /// @param segmentBeg start point of the segment
-        /// @param includeMarker indicate if the marker itself is counted into the payload
-        void writePayloadLength(std::streampos segmentBeg, bool includeMarker = false);
+        /// @param marker the marker of the segment
+        /// @param data the segment data following the length field
+        /// @param size the number of bytes of data
+        void writeSegment(UInt8 marker, const char *data, size_t size);
 
         // some default parameters
         UInt8 luminQTableId = 0;
@@ -0,0 +1,90 @@
+/// Huffman library module
+///
+/// Pretrained Huffman table sets for classes of content, and their selection from sampled symbol statistics
+
+#ifndef HUFFMAN_LIBRARY_HPP
+#define HUFFMAN_LIBRARY_HPP
+
+#include <vector>
+
+#include "Transform.hpp"
+#include "Types.hpp"
+
+namespace cppeg
+{
+    /// A set of the four Huffman tables of a baseline scan
+    ///
+    /// The tables are given as the BITS and HUFFVAL arrays of a DHT segment
+    /// (ITU-T.81, page 40), indexed by [HT_DC / HT_AC][HT_Y / HT_CbCr]; the
+    /// bits arrays have 17 entries, the first one is unused.
+    struct HuffmanTableSet
+    {
+        const char *name;
+
+        const UInt16 *bits[2][2];
+
+        const UInt16 *values[2][2];
+    };
+
+    /// Occurrences of the symbols of the four Huffman tables
+    struct HuffmanStatistics
+    {
+        /// counts[HT_DC / HT_AC][HT_Y / HT_CbCr][symbol]
+        UInt32 counts[2][2][256] = {};
+
+        /// count the symbols of the run-length code of a block (see RLC::zzorderDataToRLC())
+        ///
+        /// @param tableNo HT_Y or HT_CbCr
+        void addRLC(const ChannelRLC &runLengthCode, int tableNo);
+
+        /// count only the DC symbol of a block
+        void addDCDifference(int difference, int tableNo);
+
+        /// number of blocks counted (the DC symbols of the luminance and chrominance tables)
+        UInt64 blockCount() const;
+    };
+
+    /// @return the table sets of the library, the first one is the suggested set of ITU-T.81 Annex K
+    const std::vector<HuffmanTableSet> &huffmanTableSets();
+
+    /// The four tables of a set in the forms the encoder codes with, indexed like HuffmanTableSet
+    struct HuffmanCodingTables
+    {
+        /// the tables of the DHT segment
+        HuffmanTable tables[2][2];
+
+        /// the codes as bit strings, for building the scan
+        HuffmanCodeMapper codeMappers[2][2];
+
+        /// the codes as integers, for measuring the scan size
+        HuffmanCodeTable codeTables[2][2];
+    };
+
+    /// @return the coding tables of every set of huffmanTableSets(), in the same order
+    ///
+    /// They are built on the first call and never change, so encoders switch sets by
+    /// pointing at another entry.
+    const std::vector<HuffmanCodingTables> &huffmanCodingTables();
+
+    /// number of bits of the Huffman codes of the counted symbols with a table set
+    ///
+    /// The additional bits do not depend on the tables, so they are left out.
+    UInt64 huffmanCodeBits(const HuffmanStatistics &statistics, int tableSet);
+
+    /// @return the index of the table set coding the counted symbols with the fewest bits
+    int chooseHuffmanTableSet(const HuffmanStatistics &statistics);
+
+    /// generate the table of the given symbol counts (ITU-T.81, Annex K.2)
+    ///
+    /// Every symbol a baseline scan may use (see the valid symbols of the table
+    /// class) gets a code, even if it was not counted, so the table codes any
+    /// image. The codes are at most 16 bits long and no code is all 1 bits.
+    ///
+    /// @param counts occurrences of each symbol
+    /// @param tableType HT_DC or HT_AC
+    /// @param bits number of codes of each length, index 0 unused
+    /// @param values the symbols ordered by code length
+    void huffmanTableFromCounts(const UInt32 counts[256], int tableType, UInt16 bits[17], std::vector<UInt16> &values);
+}
+
+#endif // HUFFMAN_LIBRARY_HPP
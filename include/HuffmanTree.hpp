@@ -19,8 +19,7 @@ namespace cppeg
                  code{""},
                  value{0x00},
                  lChild{nullptr},
-                 rChild{nullptr},
-                 parent{nullptr}
+                 rChild{nullptr}
         {
         }
 
@@ -29,8 +28,7 @@ namespace cppeg
                                                            code{_code},
                                                            value{_val},
                                                            lChild{nullptr},
-                                                           rChild{nullptr},
-                                                           parent{nullptr}
+                                                           rChild{nullptr}
         {
         }
 
@@ -49,8 +47,9 @@ namespace cppeg
         // The left & right children of the node
         std::shared_ptr<Node> lChild, rChild;
 
-        // Parent of the node, makes it easier to traverse backwards in the tree
-        std::shared_ptr<Node> parent;
+        // Parent of the node, makes it easier to traverse backwards in the tree;
+        // not owned, so the tree is freed with its root
+        std::weak_ptr<Node> parent;
     };
 
     // Alias for a node
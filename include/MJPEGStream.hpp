@@ -0,0 +1,103 @@
+/// Motion-JPEG stream encoder module
+
+#ifndef MJPEG_STREAM_HPP
+#define MJPEG_STREAM_HPP
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Types.hpp"
+#include "Encoder.hpp"
+#include "OutputSink.hpp"
+
+namespace cppeg
+{
+    /// MJPEGStreamEncoder encodes a sequence of equally sized frames.
+    ///
+    /// It is created once per stream: the encoder with its quantization and
+    /// Huffman tables, the padded image buffer and the frame buffer are all
+    /// kept alive and reused from one frame to the next.
+    ///
+    /// An AVI stream is split into files of at most 1 GiB (the limit of the
+    /// AVI 1.0 RIFF chunk many readers stop at): "out.avi" is continued in
+    /// "out_1.avi", "out_2.avi"... each a complete AVI file with its own index.
+    class MJPEGStreamEncoder
+    {
+    public:
+        enum OutputMode
+        {
+            FRAME_FILES,  // every frame is written as an individual JPEG file
+            AVI_CONTAINER // all frames are written into a single AVI/MJPEG file
+        };
+
+        MJPEGStreamEncoder();
+
+        ~MJPEGStreamEncoder();
+
+        /// open the output of the stream
+        ///
+        /// @param oPath the AVI file path, or the path prefix of the frame files
+        /// @param mode the output mode of the stream
+        /// @param width width of every frame in pixels
+        /// @param height height of every frame in pixels
+        /// @param fps frame rate stored in the AVI headers
+        bool open(const std::string &oPath, OutputMode mode, int width, int height, int fps = 30);
+
+        /// encode a frame given by pointer, the pixels are not copied
+        ///
+        /// @param pixels the first pixel of an 8-bit BGR frame
+        /// @param stride the number of bytes between two consecutive rows
+        bool encodeFrame(const UInt8 *pixels, size_t stride);
+
+        /// encode a frame stored in a matrix of the stream size
+        bool encodeFrame(const cv::Mat &frame);
+
+        /// finalize the AVI index and headers (if any) and close the output
+        void close();
+
+        /// set the size at which an AVI stream continues in a new file (at most 4 GiB)
+        void setMaxAVIFileSize(UInt64 bytes) { m_maxAVIFileSize = bytes < 0xFFFFFFFFu ? bytes : 0xFFFFFFFFu; }
+
+        /// @return the number of AVI files the stream was written into
+        size_t AVIFileCount() const { return m_AVIFileCount; }
+
+        /// @return the number of frames encoded so far
+        size_t frameCount() const { return m_frameCount; }
+
+    private:
+        Encoder m_encoder;
+
+        /// the JPEG bytes of the current frame
+        MemorySink m_frameBuffer;
+
+        OutputMode m_mode = FRAME_FILES;
+        std::string m_path;
+        std::ofstream m_aviFile;
+        int m_width = 0, m_height = 0, m_fps = 30;
+        size_t m_frameCount = 0;
+        UInt32 m_maxFrameSize = 0;
+
+        UInt64 m_maxAVIFileSize = 1 << 30;
+        size_t m_AVIFileCount = 0;
+
+        /// file positions of the AVI fields patched when the stream is closed
+        std::streampos m_moviListBeg;
+
+        /// (offset, size) of every frame chunk, relative to the 'movi' list
+        std::vector<std::pair<UInt32, UInt32>> m_aviIndex;
+
+        /// open the next file of the AVI stream and write its headers
+        bool openAVIFile();
+
+        void writeAVIHeaders();
+
+        /// @return false if the frame could not be written
+        bool writeAVIFrame(const char *jpeg, size_t size);
+
+        /// @return false if the index or the headers could not be written
+        bool finalizeAVI();
+    };
+}
+
+#endif // MJPEG_STREAM_HPP
@@ -30,10 +30,12 @@ namespace cppeg
     const Marker JFIF_SOF13      = 0xCD; // Differential Sequential DCT, Arithmetic Coding          
     const Marker JFIF_SOF14      = 0xCE; // Differential Progressive DCT, Arithmetic Coding         
     const Marker JFIF_SOF15      = 0xCF; // Differential Lossless (Sequential), Arithmetic Coding   
+    const Marker JFIF_RST0       = 0xD0; // Restart with modulo 8 count 0 (up to RST7 = 0xD7)
     const Marker JFIF_SOI        = 0xD8; // Start of Image                                          
     const Marker JFIF_EOI        = 0xD9; // End of Image                                            
     const Marker JFIF_SOS        = 0xDA; // Start of Scan                                           
     const Marker JFIF_DQT        = 0xDB; // Define Quantization Table
+    const Marker JFIF_DRI        = 0xDD; // Define Restart Interval
     const Marker JFIF_APP0       = 0xE0; // Application Segment 0, JPEG-JFIF Image
     const Marker JFIF_COM        = 0xFE; // Comment
 }
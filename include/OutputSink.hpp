@@ -0,0 +1,192 @@
+/// Output sink module
+///
+/// Destinations of the encoded bytes: memory, buffered files, memory-mapped files and file descriptors
+
+#ifndef OUTPUT_SINK_HPP
+#define OUTPUT_SINK_HPP
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Types.hpp"
+
+namespace cppeg
+{
+    /// OutputSink receives the bytes of a JPEG stream in order.
+    ///
+    /// The encoder only appends to a sink, it never seeks back: a segment is
+    /// assembled in memory before it is written, so its length is known up front.
+    class OutputSink
+    {
+    public:
+        virtual ~OutputSink() = default;
+
+        /// append bytes to the sink
+        ///
+        /// @return false if the sink failed, later writes are ignored
+        virtual bool write(const void *data, size_t size) = 0;
+
+        bool put(UInt8 byte) { return write(&byte, 1); }
+
+        /// pass the buffered bytes to the destination
+        virtual bool flush() { return m_good; }
+
+        bool good() const { return m_good; }
+
+        /// number of bytes written into the sink
+        size_t size() const { return m_size; }
+
+    protected:
+        bool m_good = true;
+
+        size_t m_size = 0;
+    };
+
+    /// Growable memory buffer whose storage survives a reset
+    class MemorySink : public OutputSink
+    {
+    public:
+        bool write(const void *data, size_t size) override;
+
+        /// discard the content but keep the allocated storage
+        void reset();
+
+        const char *data() const { return m_data.data(); }
+
+    private:
+        std::vector<char> m_data;
+    };
+
+    /// Sink writing into a fixed memory region given by the caller
+    ///
+    /// Writing past the end of the region fails.
+    class FixedMemorySink : public OutputSink
+    {
+    public:
+        FixedMemorySink(char *data, size_t capacity);
+
+        bool write(const void *data, size_t size) override;
+
+    private:
+        char *m_data;
+
+        size_t m_capacity;
+    };
+
+    /// Sink writing into a file descriptor (a file, a pipe, a socket or stdout)
+    ///
+    /// The bytes are gathered in a page-aligned buffer of BUFFER_SIZE bytes, so a
+    /// write system call is issued for every BUFFER_SIZE bytes, and writes larger
+    /// than the buffer bypass it.
+    class FdSink : public OutputSink
+    {
+    public:
+        static const size_t BUFFER_SIZE = 256 * 1024;
+
+        /// @param fd the descriptor, or -1 for a sink opened later
+        /// @param ownsFd close the descriptor when the sink is closed
+        explicit FdSink(int fd = -1, bool ownsFd = false);
+
+        ~FdSink() override;
+
+        FdSink(const FdSink &) = delete;
+        FdSink &operator=(const FdSink &) = delete;
+
+        bool write(const void *data, size_t size) override;
+
+        bool flush() override;
+
+        /// flush the buffer and close the descriptor if the sink owns it
+        ///
+        /// @return false if any write failed
+        bool close();
+
+        bool isOpen() const { return m_fd >= 0; }
+
+        /// number of write system calls issued so far
+        size_t writeCalls() const { return m_writeCalls; }
+
+    protected:
+        int m_fd = -1;
+
+        bool m_ownsFd = false;
+
+        /// take a new descriptor and reset the counters
+        void reset(int fd, bool ownsFd);
+
+    private:
+        char *m_buffer = nullptr;
+
+        /// bytes waiting in the buffer
+        size_t m_buffered = 0;
+
+        size_t m_writeCalls = 0;
+
+        bool writeFully(const char *data, size_t size);
+    };
+
+    /// Sink writing a file through a buffered descriptor
+    class FileSink : public FdSink
+    {
+    public:
+        /// create or truncate the file, the previous file is closed first
+        bool open(const std::string &filename);
+    };
+
+    /// Sink writing a file through a shared memory mapping
+    ///
+    /// The file is pre-sized to the expected output size and mapped, the bytes are
+    /// copied into the mapping (the file and the mapping grow if the estimate was
+    /// too small), and the file is truncated to the written size when closed.
+    class MmapFileSink : public OutputSink
+    {
+    public:
+        MmapFileSink() = default;
+
+        ~MmapFileSink() override;
+
+        MmapFileSink(const MmapFileSink &) = delete;
+        MmapFileSink &operator=(const MmapFileSink &) = delete;
+
+        /// create or truncate the file and map its first capacity bytes
+        ///
+        /// @param capacity the expected size of the output in bytes
+        bool open(const std::string &filename, size_t capacity);
+
+        bool write(const void *data, size_t size) override;
+
+        /// unmap the file and truncate it to the written size
+        ///
+        /// @return false if any write failed
+        bool close();
+
+        bool isOpen() const { return m_fd >= 0; }
+
+    private:
+        int m_fd = -1;
+
+        char *m_mapping = nullptr;
+
+        size_t m_capacity = 0;
+
+        /// grow the file and its mapping to at least the given size
+        bool reserve(size_t capacity);
+    };
+
+    /// Sink forwarding the bytes to a std::ostream
+    class StreamSink : public OutputSink
+    {
+    public:
+        explicit StreamSink(std::ostream &stream);
+
+        bool write(const void *data, size_t size) override;
+
+        bool flush() override;
+
+    private:
+        std::ostream &m_stream;
+    };
+}
+
+#endif // OUTPUT_SINK_HPP
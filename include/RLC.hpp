@@ -10,16 +10,29 @@
 
 namespace cppeg
 {
+    /// compile-time description of the components coded by a scan
+    ///
+    /// @tparam FirstComponent the first component (0: Y, 1: Cb, 2: Cr)
+    /// @tparam ComponentCount 3 for the interleaved scan, 1 for a single component scan
+    /// @tparam ConvertColor true if the MCUs hold BGR pixels, false if they are YCrCb already
+    template <int FirstComponent, int ComponentCount, bool ConvertColor>
+    struct ScanLayout
+    {
+        static const int firstComponent = FirstComponent;
+        static const int componentCount = ComponentCount;
+        static const bool convertColor = ConvertColor;
+    };
+
+    /// the layouts the encoder uses
+    typedef ScanLayout<0, 3, true> InterleavedBGRLayout;
+    typedef ScanLayout<0, 3, false> InterleavedYCrCbLayout;
+    template <int Component>
+    using ComponentLayout = ScanLayout<Component, 1, false>;
+
     /// the class used to convert the MCU block to a raw run-length code
     class RLC
     {
     public:
-        /// The total number of MCUs in the image
-        static int m_MCUCount;
-
-        /// The quantization table used for quantization
-        static std::vector<std::vector<UInt16>> m_QTables;
-
         /// Default constructor
         RLC();
 
@@ -36,7 +49,9 @@ namespace cppeg
         /// Set the vertical sample factors
         void setHSampFactors(int sampFactorY, int sampFactorCb, int sampFactorCr);
 
-        /// Set the Quantization table (to be implemented)
+        /// Set the Quantization tables
+        ///
+        /// @param QTables luminance (id 0) and chrominance (id 1) tables in zig-zag order
         void setQTables(const std::vector<std::vector<UInt16>> &QTables);
 
         /// convert the MCU into run-length code
@@ -49,6 +64,121 @@ namespace cppeg
                               std::vector<int> &curDCValues,
                               const std::vector<int> &prevDCValues = std::vector<int>());
 
+        /// perform RGBtoYCbCr, shifting and forward DCT on every channel of the MCU
+        ///
+        /// The DCT is skipped for a channel whose 64 samples are all equal:
+        /// only its DC coefficient is computed and the AC coefficients are zero.
+        ///
+        /// @param MCU MCU to be transformed
+        /// @param coefficients output array of 3 x 64 unquantized DCT coefficients
+        /// (Y, Cb, Cr; each block in raster order)
+        /// @param isYCrCb true if the MCU is already converted into YCrCb
+        /// @return mask of the flat channels (bit c is set if channel c is uniform)
+        UInt8 MCUToDCTCoefficients(const cv::Mat &MCU, float *coefficients, bool isYCrCb = false);
+
+        /// perform shifting and forward DCT on a single channel of a YCrCb MCU
+        ///
+        /// @param YCrCbMCU MCU already converted into YCrCb
+        /// @param channel 0 (Y), 1 (Cb) or 2 (Cr)
+        /// @param coefficients output 64 unquantized DCT coefficients in raster order
+        /// @return true if the channel is uniform (see MCUToDCTCoefficients())
+        bool channelToDCTCoefficients(const cv::Mat &YCrCbMCU, int channel, float *coefficients);
+
+        /// perform the color conversion (if the layout needs one), shifting and forward
+        /// DCT on the components of a scan layout, resolved at compile time
+        ///
+        /// Explicitly instantiated for the layouts of RLC.hpp and the DCT engines of Transform.hpp.
+        ///
+        /// @tparam Layout a ScanLayout
+        /// @tparam DCTEngine the forward DCT, e.g. OpenCVDCT or PrunedDCT
+        /// @param coefficients output Layout::componentCount x 64 unquantized DCT coefficients
+        /// @param prunedEnergies if not null, output Layout::componentCount energies of the coefficients
+        /// a pruned DCT left out and set to zero, to be added to the squared quantization errors
+        /// @return mask of the flat components (bit k is set if component firstComponent + k is uniform)
+        template <typename Layout, typename DCTEngine>
+        UInt8 layoutToDCTCoefficients(const cv::Mat &MCU, float *coefficients, float *prunedEnergies = nullptr);
+
+        /// quantize the DCT coefficients of an MCU and convert them into run-length code
+        ///
+        /// The temporaries are taken from the arena of the calling thread and
+        /// outputRLC keeps its capacity, so no heap allocation happens once the
+        /// containers have grown to their working size.
+        ///
+        /// @param coefficients 3 x 64 DCT coefficients computed by MCUToDCTCoefficients()
+        /// @param outputRLC output run-length codes (one per channel)
+        /// @param curDCValues see MCUtoRLC()
+        /// @param prevDCValues see MCUtoRLC()
+        /// @param flatChannels mask returned by MCUToDCTCoefficients(), the flat channels are
+        /// coded as DC + EOB without quantizing and scanning their AC coefficients
+        /// @param squaredErrors see quantizeMCU()
+        void DCTCoefficientsToRLC(const float *coefficients,
+                                  RLCContainer &outputRLC,
+                                  std::vector<int> &curDCValues,
+                                  const std::vector<int> &prevDCValues = std::vector<int>(),
+                                  UInt8 flatChannels = 0,
+                                  double *squaredErrors = nullptr);
+
+        /// quantize the DCT coefficients of an MCU into zig-zag order
+        ///
+        /// @param coefficients 3 x 64 DCT coefficients computed by MCUToDCTCoefficients()
+        /// @param zzorderData output 3 x 64 quantized coefficients (Y, Cb, Cr) in zig-zag order,
+        /// the DC terms are not predicted
+        /// @param nonzeroMasks output masks of the nonzero AC coefficients of each channel
+        /// @param flatChannels see DCTCoefficientsToRLC()
+        /// @param squaredErrors if not null, the squared quantization errors of Y, Cb and Cr
+        /// are added to its 3 values. The DCT is orthonormal, so the error of a block summed
+        /// over its coefficients equals the error summed over its 64 samples.
+        void quantizeMCU(const float *coefficients, Int16 *zzorderData, UInt64 *nonzeroMasks, UInt8 flatChannels = 0,
+                         double *squaredErrors = nullptr);
+
+        /// quantize the DCT coefficients of a single channel into zig-zag order
+        ///
+        /// @param channel 0 (Y), 1 (Cb) or 2 (Cr), selects the quantization table
+        /// @param coefficients 64 DCT coefficients in raster order
+        /// @param zzorderData output 64 quantized coefficients in zig-zag order
+        /// @param flat true if the channel is uniform, only its DC term is quantized
+        /// @param squaredError if not null, the squared quantization error is added to it
+        /// @return mask of the nonzero AC coefficients of zzorderData
+        UInt64 quantizeBlock(int channel, const float *coefficients, Int16 *zzorderData, bool flat,
+                             double *squaredError = nullptr);
+
+        /// convert the quantized coefficients of an MCU into run-length code
+        ///
+        /// @param zzorderData 3 x 64 quantized coefficients computed by quantizeMCU()
+        /// @param nonzeroMasks the masks computed by quantizeMCU()
+        /// @param outputRLC output run-length codes (one per channel)
+        /// @param curDCValues see MCUtoRLC()
+        /// @param prevDCValues see MCUtoRLC()
+        void quantizedMCUToRLC(const Int16 *zzorderData,
+                               const UInt64 *nonzeroMasks,
+                               RLCContainer &outputRLC,
+                               std::vector<int> &curDCValues,
+                               const std::vector<int> &prevDCValues = std::vector<int>());
+
+        /// convert zig-zag order MCU data to run-length code
+        ///
+        /// Only the coefficients flagged in nonzeroMask are visited.
+        ///
+        /// @param DCValue the DC term to code (the difference to the previous block)
+        /// @param zzorderData MCU elements array in zig-zag order
+        /// @param nonzeroMask mask of the nonzero AC coefficients of zzorderData
+        /// @param outputRLC the corresponding run-length code of zzorderData
+        void zzorderDataToRLC(int DCValue, const Int16 *zzorderData, UInt64 nonzeroMask, ChannelRLC &outputRLC);
+
+        /// compute the mask of the nonzero AC coefficients of a block
+        ///
+        /// @param zzorderData 64 quantized coefficients in zig-zag order
+        /// @return the mask (bit k is set if zzorderData[k] != 0, bit 0 is never set)
+        static UInt64 nonzeroACMask(const Int16 *zzorderData);
+
+        /// check that a block fits the Huffman tables of a baseline scan
+        ///
+        /// The DC term must be within [-1024, 1023], so a DC difference is at most of
+        /// category 11, and the AC terms within [-1023, 1023] (category 10 at most).
+        ///
+        /// @param zzorderData 64 quantized coefficients in zig-zag order
+        static bool isBaselineBlock(const Int16 *zzorderData);
+
     private:
         /// horizontal sample factors for Y, Cb, Cr
         int hSampleFactors[3] = {1, 1, 1};
@@ -56,28 +186,51 @@ namespace cppeg
         /// verticals sample factors for Y, Cb, Cr
         int vSampFactors[3] = {1, 1, 1};
 
-        /// quantization tables for Y, Cb, Cr
-        static cv::Mat QTables;
-
-        /// perform RGBtoYCbCr, shifting, forward DCT and
-        /// quantization to obtained the final MCU to be encoded
+        /// reciprocals of the quantization tables for Y, Cb, Cr in zig-zag order
         ///
-        /// @param MCU single channel of MCU after RGB to YCbCr transform
-        /// @param QTable quantization table used to quantize MCU elements
-        /// @return the MCU after the transform described above
-        cv::Mat MCUTransform(const cv::Mat &MCU, const cv::Mat &QTable);
+        /// Every RLC owns its tables, so that encoders with different
+        /// qualities do not overwrite each other's tables.
+        float zzQReciprocals[3][64];
 
-        /// convert McU block into vector in zig-zag order
-        ///
-        /// @param MCU input MCU in matrix form
-        /// @return MCU elements array in zig-zag order
-        std::vector<int> MCUToZzorder(cv::Mat MCU);
+        /// squares of the quantization steps for Y, Cb, Cr in zig-zag order,
+        /// used to scale the rounding errors back to the coefficient domain
+        float zzQSquares[3][64];
 
-        /// convert zig-zag order MCU data to run-length code
+        /// limits of the corners computed by PrunedDCT for Y, Cb, Cr (see PrunedDCT::computeCornerLimits())
+        float prunedCornerLimits[3][3];
+
+        /// fill zzQReciprocals of a channel from a quantization table in zig-zag order
+        template <typename T>
+        void setZzQReciprocals(int channel, const T &zzQTable);
+
+        /// perform shifting and forward DCT
         ///
-        /// @param zzorderData MCU elements array in zig-zag order
-        /// @return the corresponding run-length code of zzorderData
-        ChannelRLC zzorderDataToRLC(std::vector<int> zzorderData);
+        /// @param samples 8x8 samples of a single channel after RGB to YCbCr transform
+        /// @param coefficients output 8x8 unquantized DCT coefficients
+        /// @param channel 0 (Y), 1 (Cb) or 2 (Cr), selects the corner limits of a pruned DCT
+        /// @return the energy of the coefficients a pruned DCT set to zero (see PrunedDCT::forward())
+        template <typename DCTEngine>
+        float MCUTransform(float *samples, float *coefficients, int channel);
+
+        /// perform shifting and forward DCT on a single channel, skipping the DCT of a uniform one
+        ///
+        /// @param samples 8x8 samples of the channel, overwritten
+        /// @param coefficients output 8x8 unquantized DCT coefficients
+        /// @param channel see MCUTransform()
+        /// @param prunedEnergy output energy returned by MCUTransform(), 0 for a uniform channel
+        /// @return true if the 64 samples are all equal
+        template <typename DCTEngine>
+        bool blockToDCTCoefficients(float *samples, float *coefficients, int channel, float &prunedEnergy);
+
+        /// quantize the DCT coefficients of a single channel straight into zig-zag order
+        ///
+        /// @param DCTBlock the 8x8 DCT coefficients in raster order
+        /// @param zzReciprocals reciprocals of the quantization table in zig-zag order
+        /// @param zzorderData output 64 quantized coefficients in zig-zag order
+        /// @param squaredError if not null, the squared quantization error of the block is added to it
+        /// @return mask of the nonzero coefficients (bit k is set if zzorderData[k] != 0)
+        UInt64 quantizeToZzorder(const float *DCTBlock, const float *zzReciprocals, Int16 *zzorderData,
+                                 const float *zzQSquares = nullptr, double *squaredError = nullptr);
     };
 }
 
@@ -0,0 +1,89 @@
+/// Single-producer single-consumer queue module
+
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace cppeg
+{
+    /// Bounded lock-free queue between exactly one producer and one consumer thread.
+    ///
+    /// push() blocks while the queue is full, which throttles a fast producer
+    /// (backpressure); pop() blocks while it is empty. Waiting spins shortly and
+    /// then yields, the queue never takes a lock.
+    template <typename T>
+    class SPSCQueue
+    {
+    public:
+        /// @param capacity the maximum number of queued items
+        explicit SPSCQueue(size_t capacity) : m_slots(capacity + 1)
+        {
+        }
+
+        SPSCQueue(const SPSCQueue &) = delete;
+        SPSCQueue &operator=(const SPSCQueue &) = delete;
+
+        /// queue an item, waits while the queue is full (producer only)
+        void push(T item)
+        {
+            size_t tail = m_tail.load(std::memory_order_relaxed);
+            size_t next = (tail + 1) % m_slots.size();
+            for (int spins = 0; next == m_head.load(std::memory_order_acquire); ++spins)
+                wait(spins);
+            m_slots[tail] = std::move(item);
+            m_tail.store(next, std::memory_order_release);
+        }
+
+        /// take the oldest item, waits while the queue is empty (consumer only)
+        ///
+        /// @return false if the queue is empty and closed
+        bool pop(T &item)
+        {
+            size_t head = m_head.load(std::memory_order_relaxed);
+            for (int spins = 0; head == m_tail.load(std::memory_order_acquire); ++spins)
+            {
+                if (m_closed.load(std::memory_order_acquire))
+                {
+                    // an item may have been pushed right before closing
+                    if (head == m_tail.load(std::memory_order_acquire))
+                        return false;
+                    break;
+                }
+                wait(spins);
+            }
+            item = std::move(m_slots[head]);
+            m_head.store((head + 1) % m_slots.size(), std::memory_order_release);
+            return true;
+        }
+
+        /// signal that no more items will be pushed (producer only)
+        void close()
+        {
+            m_closed.store(true, std::memory_order_release);
+        }
+
+    private:
+        /// spin first, then yield, then sleep when the other side stalls for long
+        static void wait(int spins)
+        {
+            if (spins > 1024)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            else if (spins > 64)
+                std::this_thread::yield();
+        }
+
+        std::vector<T> m_slots;
+
+        /// the indices are written by different threads, keep them on separate cache lines
+        alignas(64) std::atomic<size_t> m_head{0};
+        alignas(64) std::atomic<size_t> m_tail{0};
+        alignas(64) std::atomic<bool> m_closed{false};
+    };
+}
+
+#endif // SPSC_QUEUE_HPP
@@ -0,0 +1,131 @@
+/// Shared frame ring module
+///
+/// Ring buffer of frames in POSIX shared memory, shared by a producer and a consumer process
+
+#ifndef SHARED_FRAME_RING_HPP
+#define SHARED_FRAME_RING_HPP
+
+#include <string>
+
+#include "Types.hpp"
+
+namespace cppeg
+{
+    /// SharedFrameRing is a single-producer single-consumer ring of frames in a
+    /// POSIX shared memory object (shm_open), usable from two processes.
+    ///
+    /// Layout of the object (every part starts on a 4 KiB page):
+    ///
+    /// - the ring header: magic, slot count, slot payload size, the counters of published
+    ///   and released slots (31 bits), the top bit of the published counter being the
+    ///   end-of-stream flag,
+    /// - slotCount slots, each made of a 64-byte frame header (sequence number, format,
+    ///   width, height, stride, payload size) followed by the payload.
+    ///
+    /// The producer writes a frame straight into the payload of a free slot and publishes it,
+    /// the consumer reads it in place and releases the slot: the frame is never copied.
+    /// A waiting side sleeps on the counters with a futex shared between the processes.
+    class SharedFrameRing
+    {
+    public:
+        enum Format : UInt32
+        {
+            BGR24 = 0, // 8-bit BGR pixels, stride bytes per row
+            JPEG = 1   // a JPEG file of size bytes
+        };
+
+        /// a frame in a slot of the ring
+        struct Frame
+        {
+            /// frame number given by the producer
+            UInt64 sequence = 0;
+
+            Format format = BGR24;
+
+            UInt32 width = 0, height = 0;
+
+            /// bytes between two rows of a BGR24 frame
+            UInt32 stride = 0;
+
+            /// bytes of payload used by the frame
+            UInt64 size = 0;
+
+            /// the payload in the shared memory
+            UInt8 *data = nullptr;
+        };
+
+        SharedFrameRing() = default;
+
+        ~SharedFrameRing();
+
+        SharedFrameRing(const SharedFrameRing &) = delete;
+        SharedFrameRing &operator=(const SharedFrameRing &) = delete;
+
+        /// create the shared memory object, an existing object of the same name is replaced
+        ///
+        /// @param name name of the object (e.g., "/cppeg-frames")
+        /// @param slotCount number of frames the ring holds, a power of two
+        /// @param slotSize maximum payload size of a frame in bytes
+        bool create(const std::string &name, UInt32 slotCount, UInt64 slotSize);
+
+        /// map an object created by another process
+        bool attach(const std::string &name);
+
+        /// unmap the object, and remove its name if this process created it
+        void close();
+
+        UInt64 slotSize() const;
+
+        /// Consumer side
+
+        /// wait for the oldest published frame
+        ///
+        /// @param frame the frame, its data stays valid until releaseRead()
+        /// @param timeoutMs give up after this many milliseconds, -1 waits forever
+        /// @return false on timeout, or if the stream ended and every frame was read
+        bool acquireRead(Frame &frame, int timeoutMs = -1);
+
+        /// release the frame returned by acquireRead() to the producer
+        void releaseRead();
+
+        /// whether the producer ended the stream
+        bool ended() const;
+
+        /// Producer side
+
+        /// wait for a free slot
+        ///
+        /// @param timeoutMs give up after this many milliseconds, -1 waits forever
+        /// @return the payload of the slot (slotSize() bytes), nullptr on timeout
+        UInt8 *acquireWrite(int timeoutMs = -1);
+
+        /// publish the slot returned by acquireWrite()
+        ///
+        /// @param frame the description of the frame, its data member is ignored
+        void publish(const Frame &frame);
+
+        /// signal the consumer that no more frames will be published
+        void endStream();
+
+    private:
+        struct RingHeader;
+        struct SlotHeader;
+
+        RingHeader *m_header = nullptr;
+
+        UInt8 *m_mapping = nullptr;
+
+        size_t m_mappingSize = 0;
+
+        /// distance between two slots
+        size_t m_slotStride = 0;
+
+        std::string m_name;
+
+        bool m_owner = false;
+
+        SlotHeader *slot(UInt32 counter) const;
+    };
+}
+
+#endif // SHARED_FRAME_RING_HPP
@@ -0,0 +1,245 @@
+/// Tile pyramid module
+///
+/// Deep Zoom tile pyramids of large images, written as a tile directory or as a packed archive
+
+#ifndef TILE_PYRAMID_HPP
+#define TILE_PYRAMID_HPP
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+#include "Types.hpp"
+#include "OutputSink.hpp"
+
+namespace cppeg
+{
+    /// Geometry of a Deep Zoom pyramid
+    ///
+    /// The top level holds the image at full size, every level below it is half
+    /// the size of the next one (rounded up) and level 0 is a single pixel. A level
+    /// is cut into tiles of tileSize pixels, each tile grows by overlap pixels on
+    /// every side it shares with another tile.
+    struct TileLayout
+    {
+        int width = 0, height = 0;
+
+        int tileSize = 254;
+
+        int overlap = 1;
+
+        /// number of levels, the top level is levelCount - 1
+        int levelCount = 0;
+
+        TileLayout() = default;
+
+        TileLayout(int width, int height, int tileSize, int overlap);
+
+        cv::Size levelSize(int level) const;
+
+        int columns(int level) const;
+
+        int rows(int level) const;
+
+        /// number of tiles of every level
+        size_t tileCount() const;
+
+        /// the pixels of a tile in its level image
+        cv::Rect tileRect(int level, int column, int row) const;
+    };
+
+    /// TileSink receives the encoded tiles of a pyramid
+    ///
+    /// writeTile() is called concurrently by the encoder threads, in no particular order.
+    class TileSink
+    {
+    public:
+        virtual ~TileSink() = default;
+
+        /// called once before the first tile
+        virtual bool begin(const TileLayout &layout) = 0;
+
+        virtual bool writeTile(int level, int column, int row, const char *data, size_t size) = 0;
+
+        /// called once after the last tile
+        virtual bool finish() = 0;
+    };
+
+    /// Sink writing a Deep Zoom image: the descriptor <base>.dzi and one file
+    /// <base>_files/<level>/<column>_<row>.jpg per tile
+    class TileDirectorySink : public TileSink
+    {
+    public:
+        explicit TileDirectorySink(const std::string &baseName);
+
+        bool begin(const TileLayout &layout) override;
+
+        bool writeTile(int level, int column, int row, const char *data, size_t size) override;
+
+        bool finish() override;
+
+    private:
+        std::string m_baseName;
+
+        TileLayout m_layout;
+    };
+
+    /// Sink packing every tile into a single file with an index
+    ///
+    /// Layout of the file (host byte order), written from the start to the end:
+    ///
+    /// - a header: magic "CPTA", version, image size, tile size, overlap, level count, tile count,
+    /// - the JPEG files of the tiles, in the order they were encoded,
+    /// - the index: one IndexEntry per tile, sorted by level, row and column,
+    /// - a trailer: the offset of the index, the number of entries and the magic again.
+    ///
+    /// A reader finds the index from the trailer at the end of the file (see TileArchive).
+    class TileArchiveSink : public TileSink
+    {
+    public:
+        struct Header
+        {
+            UInt32 magic;
+            UInt32 version;
+            UInt32 width, height;
+            UInt32 tileSize, overlap;
+            UInt32 levelCount;
+            UInt32 tileCount;
+        };
+
+        struct IndexEntry
+        {
+            UInt32 level, column, row;
+
+            /// size of the JPEG file of the tile
+            UInt32 size;
+
+            /// offset of the JPEG file from the start of the archive
+            UInt64 offset;
+        };
+
+        struct Trailer
+        {
+            UInt64 indexOffset;
+            UInt32 entryCount;
+            UInt32 magic;
+        };
+
+        explicit TileArchiveSink(const std::string &filename);
+
+        bool begin(const TileLayout &layout) override;
+
+        bool writeTile(int level, int column, int row, const char *data, size_t size) override;
+
+        bool finish() override;
+
+    private:
+        std::string m_filename;
+
+        /// the file is appended to by one encoder thread at a time
+        std::mutex m_mutex;
+
+        FileSink m_file;
+
+        std::vector<IndexEntry> m_index;
+    };
+
+    /// Read-only memory mapping of a tile archive written by TileArchiveSink
+    class TileArchive
+    {
+    public:
+        TileArchive() = default;
+
+        ~TileArchive();
+
+        TileArchive(const TileArchive &) = delete;
+        TileArchive &operator=(const TileArchive &) = delete;
+
+        /// map an archive, the previous one is closed first
+        bool open(const std::string &filename);
+
+        void close();
+
+        bool isOpen() const { return m_mapping != nullptr; }
+
+        const TileArchiveSink::Header &header() const { return *m_header; }
+
+        /// the index entries, sorted by level, row and column
+        const TileArchiveSink::IndexEntry *entries() const { return m_entries; }
+
+        size_t entryCount() const { return m_entryCount; }
+
+        /// the JPEG file of a tile
+        ///
+        /// @return a pointer into the mapping, nullptr if the archive has no such tile
+        const char *tile(int level, int column, int row, size_t &size) const;
+
+    private:
+        UInt8 *m_mapping = nullptr;
+
+        size_t m_mappingSize = 0;
+
+        const TileArchiveSink::Header *m_header = nullptr;
+
+        const TileArchiveSink::IndexEntry *m_entries = nullptr;
+
+        size_t m_entryCount = 0;
+    };
+
+    /// TilePyramid encodes all the tiles of the Deep Zoom pyramid of an image.
+    ///
+    /// Every level is downsampled once, from the level above it (area interpolation),
+    /// on the calling thread, while the encoder threads already take the tiles of the
+    /// levels that are ready, from the top level down. Every encoder thread owns one
+    /// Encoder for all its tiles, so the tables, buffers and the cached header segments
+    /// are built once per thread; only the SOF0 and SOS segments and the scan are written
+    /// for a tile. The tiles are referenced in their level image, never copied.
+    class TilePyramid
+    {
+    public:
+        struct Stats
+        {
+            size_t levels = 0;
+
+            size_t tiles = 0;
+
+            /// tiles that could not be encoded or written
+            size_t failed = 0;
+
+            size_t bytesWritten = 0;
+
+            /// wall time of the whole pyramid
+            double seconds = 0;
+
+            /// time spent downsampling the levels
+            double downsampleSeconds = 0;
+
+            /// busy time of the encoder threads, summed over the threads
+            double encodeSeconds = 0;
+        };
+
+        /// @param tileSize width and height of a tile without the overlap
+        /// @param overlap pixels shared by neighbouring tiles
+        /// @param encodeThreads number of encoder threads, 0 chooses one per core
+        explicit TilePyramid(int tileSize = 254, int overlap = 1, unsigned encodeThreads = 0);
+
+        /// @param quality 1 (smallest file) to 100 (best quality) for every tile
+        void setQuality(int quality);
+
+        /// encode every tile of the pyramid of an 8-bit BGR image into a sink
+        Stats encode(const cv::Mat &image, TileSink &sink);
+
+    private:
+        int m_tileSize;
+
+        int m_overlap;
+
+        unsigned m_encodeThreads;
+
+        int m_quality = 50;
+    };
+}
+
+#endif // TILE_PYRAMID_HPP
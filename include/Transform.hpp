@@ -22,6 +22,63 @@ namespace cppeg
     /// @return the zig-zag index corresponding to the matrix indices
     const int matIndicesToZZOrder(const int row, const int column);
 
+    /// Compute a downscaled block from the low-frequency DCT coefficients of an 8x8 block
+    ///
+    /// The top-left size x size coefficients are rescaled and transformed by an
+    /// orthonormal inverse DCT of that size, which yields the block downscaled by 8 / size.
+    ///
+    /// @param coefficients the 8x8 DCT coefficients in raster order
+    /// @param size the size of the downscaled block (1, 2 or 4)
+    /// @param samples output array of size x size samples in raster order
+    void scaledInverseDCT(const float *coefficients, const int size, float *samples);
+
+    /// Forward DCT engine computing the full orthonormal 8x8 DCT with cv::dct
+    ///
+    /// A DCT engine is a compile-time parameter of the encode loop (see ScanLayout
+    /// in RLC.hpp), its forward() transforms the 64 level-shifted samples of a block.
+    struct OpenCVDCT
+    {
+        /// the engine does not need the quantization table (see PrunedDCT)
+        static const bool usesCornerLimits = false;
+
+        /// @param samples 8x8 samples shifted by -128 in raster order
+        /// @param coefficients output 8x8 DCT coefficients in raster order
+        static void forward(const float *samples, float *coefficients);
+    };
+
+    /// Forward DCT engine computing only the low-frequency corner of a block that
+    /// can survive quantization, the full DCT being the fallback
+    ///
+    /// The basis functions of an AC coefficient sum to zero and none of their products
+    /// exceeds 1/4, so every AC coefficient is bounded by
+    ///
+    ///     B = min(1/4 * sum |x - mean|, sqrt(sum (x - mean)^2))
+    ///
+    /// (the second bound by Parseval's theorem). If B is below half the smallest
+    /// quantization step outside the top-left 1x1, 2x2 or 4x4 corner, every
+    /// coefficient outside that corner quantizes to zero: only the corner is computed,
+    /// by direct products with the DCT basis. Blocks with more energy take the full DCT.
+    ///
+    /// The coefficients outside the corner are set to zero and their energy (the AC
+    /// energy left after the corner) is returned, the squared error of zeroing them.
+    struct PrunedDCT
+    {
+        static const bool usesCornerLimits = true;
+
+        /// the corner limits of a quantization table (see forward())
+        ///
+        /// @param zzQTable the quantization table in zig-zag order
+        /// @param cornerLimits output limits of the 1x1, 2x2 and 4x4 corners: half the
+        /// smallest step outside the corner, with a margin for the rounding of the float DCT
+        static void computeCornerLimits(const float *zzQTable, float *cornerLimits);
+
+        /// @param samples 8x8 samples shifted by -128 in raster order
+        /// @param coefficients output 8x8 DCT coefficients in raster order
+        /// @param cornerLimits the limits computed by computeCornerLimits()
+        /// @return the energy of the coefficients outside the corner, 0 for the full DCT
+        static float forward(const float *samples, float *coefficients, const float *cornerLimits);
+    };
+
     /// Convert a value to it's corresponding bit string
     ///
     /// @param value value of the number
@@ -34,16 +91,73 @@ namespace cppeg
     /// @return the category of the specified value
     const Int16 getValueCategory(const Int16 value);
 
+    /// Append the Huffman code and the additional bits of a DC difference to a bit string
+    ///
+    /// @param amplitude the difference to the DC value of the previous block
+    /// @param DCMapper huffman code mapper of DC coefficient
+    /// @param bitString the bit string the codes are appended to
+    /// @return false if the table has no code for the category of the difference, nothing is appended
+    bool DCValueToBitString(const int amplitude, const HuffmanCodeMapper &DCMapper, std::string &bitString);
+
+    /// Append the codes of the AC part (all but the first code) of a single channel
+    /// run-length code to a bit string
+    ///
+    /// @param runLengthCode run-length code of single channel
+    /// @param ACMapper huffman code mapper of AC coefficient
+    /// @param bitString the bit string the codes are appended to
+    /// @return false if the table has no code for a symbol, the codes after it are not appended
+    bool ACRLCToBitString(const ChannelRLC &runLengthCode, const HuffmanCodeMapper &ACMapper, std::string &bitString);
+
     /// Convert a single channel run-length code into bit string
     /// (based on passed Huffman table of DC and AC coefficient)
     ///
     /// @param runLengthCode run-length code of single channel
     /// @param DCMapper huffman code mapper of DC coefficient
     /// @param ACMapper huffman code mapper of AC coefficient
-    /// @return the bit string corresponding to the run-length code
-    std::string singleRLCToBitString(const ChannelRLC &runLengthCode,
-                                     const HuffmanCodeMapper &DCMapper,
-                                     const HuffmanCodeMapper &ACMapper);
+    /// @param bitString the bit string the codes of the run-length code are appended to
+    /// @return false if a table has no code for a symbol (see DCValueToBitString() and ACRLCToBitString());
+    /// the coefficients of an encoded image always have one, those read from a file may not
+    bool singleRLCToBitString(const ChannelRLC &runLengthCode,
+                              const HuffmanCodeMapper &DCMapper,
+                              const HuffmanCodeMapper &ACMapper,
+                              std::string &bitString);
+
+    /// Huffman codes of a table as integers, indexed by symbol
+    struct HuffmanCodeTable
+    {
+        UInt16 codes[256] = {};
+        UInt8 lengths[256] = {};
+    };
+
+    /// Convert the bit string codes of a Huffman code mapper into a code table
+    HuffmanCodeTable huffmanMapperToCodeTable(const HuffmanCodeMapper &mapper);
+
+    /// ScanMeter measures the size of an entropy-coded segment without building it.
+    ///
+    /// The codes are shifted through a small register and only the completed bytes
+    /// are kept, to count the 0xFF bytes followed by a stuffed zero byte.
+    class ScanMeter
+    {
+    public:
+        /// append the low length bits of bits (length <= 16)
+        void putBits(UInt32 bits, int length);
+
+        /// append the codes and the additional bits of a single channel run-length code
+        void putRLC(const ChannelRLC &runLengthCode, const HuffmanCodeTable &DCTable, const HuffmanCodeTable &ACTable);
+
+        /// pad the last byte with 1-bits like the encoder
+        ///
+        /// @return the number of bytes of the segment, stuffed bytes included
+        size_t finish();
+
+    private:
+        UInt32 m_register = 0;
+
+        /// bits in the register that do not form a complete byte yet
+        int m_pendingBits = 0;
+
+        size_t m_bytes = 0, m_stuffedBytes = 0;
+    };
 
 }
 
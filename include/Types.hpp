@@ -22,10 +22,13 @@ namespace cppeg
     /// Standard unsigned integral types
     typedef unsigned char UInt8;
     typedef unsigned short UInt16;
+    typedef unsigned int UInt32;
+    typedef unsigned long long UInt64;
 
     /// Standard signed integral types
     typedef char Int8;
     typedef short Int16;
+    typedef int Int32;
 
     /// Aliases for commonly used types
 
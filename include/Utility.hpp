@@ -5,12 +5,12 @@
 
 #include <string>
 #include <cctype>
-#include <fstream>
+#include <ostream>
 
-// Output log file, ugly solution global for logging
-// into files! This approach is not recommended, I
-// used here to focus on JPEG, not logging! :p
-extern std::ofstream logFile;
+// Output log of the calling thread. Every thread has its own stream (and
+// formatting state); a flush, e.g. std::endl, appends the buffered text to
+// the log file shared by all threads as a whole, under a lock.
+extern thread_local std::ostream logFile;
 
 namespace cppeg
 {
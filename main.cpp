@@ -1,8 +1,31 @@
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "opencv2/highgui.hpp"
 
 #include "Utility.hpp"
 #include "Encoder.hpp"
+#include "MJPEGStream.hpp"
+#include "BatchPipeline.hpp"
+#include "EncodeServer.hpp"
+#include "SharedFrameRing.hpp"
+#include "OutputSink.hpp"
+#include "Decoder.hpp"
+#include "SPSCQueue.hpp"
+#include "TilePyramid.hpp"
 
 void printHelp()
 {
@@ -13,29 +36,676 @@ void printHelp()
     std::cout << "cppeg -h                              : Print this help message and exit" << std::endl;
     std::cout << "cppeg <iFile> [<oFile>]               : Compress a image denoted by <iFile> to a jpeg image."
                                                           "The name of the compressed image is determined by <oFile> if denoted." << std::endl;
+    std::cout << "cppeg <iFile> -                       : Compress a image and write the jpeg image to the standard output." << std::endl;
+    std::cout << "cppeg --mmap <iFile> <oFile>          : Compress a image and write it through a memory mapping of <oFile>." << std::endl;
+    std::cout << "cppeg -t <iFile> [<oFile>]            : Compress a image and embed a thumbnail built from"
+                                                          " the DC coefficients." << std::endl;
+    std::cout << "cppeg -d <iFile> [<oFile>]            : Compress a image, coding repeated 8x8 blocks (e.g., screen"
+                                                          " content) only once." << std::endl;
+    std::cout << "cppeg -c <iFile> [<oFile>]            : Compress a image into one scan per component, the components"
+                                                          " being encoded concurrently." << std::endl;
+    std::cout << "cppeg --save-coefficients <iFile> <oFile> <cFile> : Compress a image and save its quantized"
+                                                          " coefficients into <cFile>." << std::endl;
+    std::cout << "cppeg --from-coefficients <cFile> <oFile> [-c] : Write the jpeg image of the coefficients saved in"
+                                                          " <cFile> with the Huffman pass only, -c for one scan per component." << std::endl;
+    std::cout << "cppeg -p <iFile> [<oFile>]            : Compress a image with the Huffman tables of the built-in library"
+                                                          " that best fit a sample of its blocks." << std::endl;
+    std::cout << "cppeg --pruned-dct <q> <iFile> [<oFile>] : Compress a image at quality <q>, computing only the DCT"
+                                                          " coefficients that can survive quantization." << std::endl;
+    std::cout << "cppeg --train-tables <q> <iFile> [<iFile>...] : Print the Huffman tables fitting the blocks of"
+                                                          " every <iFile> at quality <q>." << std::endl;
+    std::cout << "cppeg -s <bytes> <iFile> [<oFile>]    : Compress a image with the highest quality whose"
+                                                          " output does not exceed <bytes> bytes." << std::endl;
+    std::cout << "cppeg --measure <iFile> [<q>]         : Print the exact size of the jpeg image of quality <q> without"
+                                                          " writing it." << std::endl;
+    std::cout << "cppeg -v <iFile> <q>:<oFile> [...]    : Compress a image into several files <oFile> of quality <q>"
+                                                          " (1-100) with a single DCT pass." << std::endl;
+    std::cout << "cppeg -l <iFile> <oPrefix>            : Compress a image at the scales 1, 1/2, 1/4 and 1/8 into"
+                                                          " <oPrefix>_1.jpg, <oPrefix>_2.jpg, ... in one pass." << std::endl;
+    std::cout << "cppeg -m <oFile> <iFile> [<iFile>...] : Encode the images denoted by <iFile> as the frames of a"
+                                                          " Motion-JPEG AVI file <oFile>." << std::endl;
+    std::cout << "cppeg -b <oDir> <iFile> [<iFile>...]  : Compress every <iFile> into <oDir>/<name>.jpg, reading,"
+                                                          " encoding and writing the images concurrently." << std::endl;
+    std::cout << "cppeg --verify <oDir> <iFile> [<iFile>...] : Compress every <iFile> into <oDir>/<name>.jpg and decode"
+                                                          " every output on a second thread to check its coefficients." << std::endl;
+    std::cout << "cppeg --stress <n> <iFile>            : Compress a image with <n> encoders of different qualities at once"
+                                                          " and compare their output with single-threaded runs." << std::endl;
+    std::cout << "cppeg --serve <socket> [<threads>]    : Run an encode server on the Unix domain socket <socket>"
+                                                          " until interrupted." << std::endl;
+    std::cout << "cppeg --client <socket> <iFile> <oFile> [<q>] : Compress a image with the server listening on"
+                                                          " <socket>." << std::endl;
+    std::cout << "cppeg --stats <socket>                : Print the statistics of the server listening on"
+                                                          " <socket>." << std::endl;
+    std::cout << "cppeg --shm <iRing> <oRing> [<q>]     : Encode the frames of the shared memory ring <iRing> into"
+                                                          " the ring <oRing> until the input ends." << std::endl;
+    std::cout << "cppeg --transcode <iFile> <oFile> [<q>] : Re-encode the jpeg image <iFile> from its coefficients, requantized"
+                                                          " to quality <q> if denoted." << std::endl;
+    std::cout << "cppeg --tiles <iFile> <oBase> [<size> <overlap> <q>] : Compress the Deep Zoom tile pyramid of"
+                                                          " a image into <oBase>.dzi and <oBase>_files/." << std::endl;
+    std::cout << "cppeg --tile-archive <iFile> <oFile> [<size> <overlap> <q>] : Compress the Deep Zoom tile pyramid of"
+                                                          " a image into a single archive <oFile> with an index." << std::endl;
 }
 
-void encodeJPEG(std::string iFilename, std::string oFilename="")
+void encodeJPEG(std::string iFilename, std::string oFilename="", bool embedThumbnail=false, size_t blockCacheSize=0,
+                bool componentScans=false, bool selectHuffmanTables=false, int quality=50, bool prunedDCT=false)
 {
     
     std::cout << "Encoding..." << std::endl;
     
     // test for encdoer
     cppeg::Encoder encoder;
+    encoder.setThumbnailEnabled(embedThumbnail);
+    encoder.setBlockCacheSize(blockCacheSize);
+    encoder.setComponentScans(componentScans);
+    encoder.setHuffmanTableSelection(selectHuffmanTables);
+    encoder.setQuality(quality);
+    encoder.setPrunedDCT(prunedDCT);
 
     if( encoder.open( iFilename, oFilename ))
     {
         if ( encoder.encodeImageFile() == cppeg::Encoder::ResultCode::ENCODE_DONE )
         {
             encoder.close();
+            if (selectHuffmanTables)
+                std::cout << "Huffman tables: " << encoder.stats().huffmanTableSet << std::endl;
+            std::cout << "Complete! PSNR: " << encoder.stats().PSNR() << " dB. Check log file \'cppeg.log\' for details." << std::endl;
+        }
+    }
+    else{
+        std::cout << "Fail to open the files, unable to encode." << std::endl;
+    }
+}
+
+void encodeJPEGToStdout(std::string iFilename)
+{
+    // only the JPEG bytes go to the standard output, the messages go to the log file
+    cv::Mat image = cv::imread(iFilename, cv::IMREAD_COLOR);
+    cppeg::Encoder encoder;
+    cppeg::FdSink sink(STDOUT_FILENO);
+    if (image.empty() || encoder.encodeFrame(image, sink) != cppeg::Encoder::ResultCode::ENCODE_DONE)
+        std::cerr << "Fail to encode '" << iFilename << "'." << std::endl;
+}
+
+void encodeJPEGMapped(std::string iFilename, std::string oFilename)
+{
+    cv::Mat image = cv::imread(iFilename, cv::IMREAD_COLOR);
+    if (image.empty())
+    {
+        std::cout << "Fail to open the input file, unable to encode." << std::endl;
+        return;
+    }
+
+    // the file is pre-sized to a quarter of the raw image, it grows if needed and
+    // is truncated to the size of the JPEG stream when closed
+    cppeg::Encoder encoder;
+    cppeg::MmapFileSink sink;
+    if (!sink.open(oFilename, image.total() * 3 / 4 + 65536) ||
+        encoder.encodeFrame(image, sink) != cppeg::Encoder::ResultCode::ENCODE_DONE || !sink.close())
+    {
+        std::cout << "Fail to write '" << oFilename << "'." << std::endl;
+        return;
+    }
+    std::cout << "Complete! " << sink.size() << " bytes written to '" << oFilename << "'." << std::endl;
+}
+
+void encodeJPEGToSize(size_t targetBytes, std::string iFilename, std::string oFilename="")
+{
+    std::cout << "Encoding to at most " << targetBytes << " bytes..." << std::endl;
+
+    cppeg::Encoder encoder;
+
+    if( encoder.open( iFilename, oFilename ))
+    {
+        cppeg::Encoder::ResultCode result = encoder.encodeImageFileToSize( targetBytes );
+        if ( result == cppeg::Encoder::ResultCode::ENCODE_DONE )
+        {
             std::cout << "Complete! Check log file \'cppeg.log\' for details." << std::endl;
         }
+        else if ( result == cppeg::Encoder::ResultCode::ENCODE_INCOMPLETE )
+        {
+            std::cout << "The target size is too small, the image was encoded with the lowest quality." << std::endl;
+        }
     }
     else{
         std::cout << "Fail to open the files, unable to encode." << std::endl;
     }
 }
 
+void encodeJPEGSavingCoefficients(std::string iFilename, std::string oFilename, std::string cFilename)
+{
+    cppeg::Encoder encoder;
+    encoder.setKeepQuantizedCoefficients(true);
+    if (!encoder.open(iFilename, oFilename))
+    {
+        std::cout << "Fail to open the files, unable to encode." << std::endl;
+        return;
+    }
+    if (encoder.encodeImageFile() != cppeg::Encoder::ResultCode::ENCODE_DONE || !encoder.saveQuantizedCoefficients(cFilename))
+    {
+        std::cout << "Fail to encode the image or to save its coefficients." << std::endl;
+        return;
+    }
+    encoder.close();
+    std::cout << "Complete! The coefficients are saved in \'" << cFilename << "\'." << std::endl;
+}
+
+void encodeJPEGFromCoefficients(std::string cFilename, std::string oFilename, bool componentScans)
+{
+    cppeg::CoefficientFile coefficientFile;
+    cppeg::FileSink oFile;
+    if (!coefficientFile.open(cFilename) || !oFile.open(oFilename))
+    {
+        std::cout << "Fail to open the files, unable to encode." << std::endl;
+        return;
+    }
+
+    cppeg::Encoder encoder;
+    encoder.setComponentScans(componentScans);
+    if (encoder.encodeCoefficientFile(coefficientFile, oFile) != cppeg::Encoder::ResultCode::ENCODE_DONE || !oFile.close())
+        std::cout << "Fail to encode the coefficients of \'" << cFilename << "\'." << std::endl;
+    else
+        std::cout << "Complete! Check log file \'cppeg.log\' for details." << std::endl;
+}
+
+void measureJPEG(std::string iFilename, int quality)
+{
+    cv::Mat image = cv::imread(iFilename, cv::IMREAD_COLOR);
+    if (image.empty())
+    {
+        std::cout << "Fail to open the input file, unable to measure." << std::endl;
+        return;
+    }
+
+    cppeg::Encoder encoder;
+    encoder.setQuality(quality);
+    size_t bytes = encoder.measureFrame(image);
+    const cppeg::Encoder::EncodeStats &stats = encoder.stats();
+    std::cout << bytes << " bytes at quality " << quality << ", PSNR " << stats.PSNR() << " dB (Y " << stats.PSNR(0)
+              << " dB, Cb " << stats.PSNR(1) << " dB, Cr " << stats.PSNR(2) << " dB)" << std::endl;
+}
+
+void printHuffmanArray(const std::string &name, const std::vector<cppeg::UInt16> &array, bool hex)
+{
+    // the layout of the arrays of the table library, the symbols in hexadecimal
+    std::cout << "        const UInt16 " << name << "[" << (hex ? "" : "17") << "] = {";
+    for (size_t i = 0; i < array.size(); ++i)
+    {
+        std::cout << (hex && i % 8 == 0 ? "\n            " : (i == 0 ? "" : " "));
+        if (hex)
+            std::cout << "0x" << std::hex << std::setw(2) << std::setfill('0') << array[i] << std::dec;
+        else
+            std::cout << array[i];
+        std::cout << (i + 1 < array.size() ? "," : "");
+    }
+    std::cout << "};" << std::endl;
+}
+
+void trainHuffmanTables(int quality, const std::vector<std::string> &iFilenames)
+{
+    // the symbols of every image are counted with the same quality, then one
+    // table per class is generated, printed as the arrays of the table library
+    cppeg::Encoder encoder;
+    encoder.setQuality(quality);
+    cppeg::HuffmanStatistics statistics;
+    for (const std::string &iFilename : iFilenames)
+    {
+        cv::Mat image = cv::imread(iFilename, cv::IMREAD_COLOR);
+        if (image.empty())
+        {
+            std::cout << "Fail to open '" << iFilename << "', unable to train." << std::endl;
+            return;
+        }
+        encoder.addHuffmanStatistics(image, statistics);
+    }
+
+    const char *tableNames[2][2] = {{"DCLuminance", "DCChrominance"}, {"ACLuminance", "ACChrominance"}};
+    for (int type = cppeg::HT_DC; type <= cppeg::HT_AC; ++type)
+        for (int tableNo = cppeg::HT_Y; tableNo <= cppeg::HT_CbCr; ++tableNo)
+        {
+            cppeg::UInt16 bits[17];
+            std::vector<cppeg::UInt16> values;
+            cppeg::huffmanTableFromCounts(statistics.counts[type][tableNo], type, bits, values);
+            printHuffmanArray(std::string("bits") + tableNames[type][tableNo], std::vector<cppeg::UInt16>(bits, bits + 17), false);
+            printHuffmanArray(std::string("values") + tableNames[type][tableNo], values, true);
+        }
+    std::cout << statistics.blockCount() << " blocks counted at quality " << quality << std::endl;
+}
+
+void encodeJPEGVariants(std::string iFilename, const std::vector<std::string> &variantArgs)
+{
+    std::vector<cppeg::Encoder::Variant> variants;
+    for (const std::string &arg : variantArgs)
+    {
+        size_t sep = arg.find(':');
+        if (sep == std::string::npos)
+        {
+            std::cout << "Invalid variant \'" << arg << "\', expected <quality>:<oFile>." << std::endl;
+            return;
+        }
+        cppeg::Encoder::Variant variant;
+        variant.quality = std::stoi(arg.substr(0, sep));
+        variant.filename = arg.substr(sep + 1);
+        variants.push_back(variant);
+    }
+
+    std::cout << "Encoding " << variants.size() << " variants..." << std::endl;
+
+    cppeg::Encoder encoder;
+    if (!encoder.openImage(iFilename))
+    {
+        std::cout << "Fail to open the input file, unable to encode." << std::endl;
+        return;
+    }
+
+    std::vector<cppeg::Encoder::ResultCode> results = encoder.encodeImageVariants(variants);
+    for (size_t i = 0; i < variants.size(); ++i)
+    {
+        bool done = results[i] == cppeg::Encoder::ResultCode::ENCODE_DONE;
+        std::cout << (done ? "Written " : "Failed ") << "\'" << variants[i].filename << "\'" << std::endl;
+    }
+}
+
+void encodeJPEGLadder(std::string iFilename, std::string oPrefix)
+{
+    std::vector<cppeg::Encoder::LadderLevel> levels;
+    for (int denom = 1; denom <= 8; denom *= 2)
+    {
+        cppeg::Encoder::LadderLevel level;
+        level.filename = oPrefix + "_" + std::to_string(denom) + ".jpg";
+        level.scaleDenom = denom;
+        levels.push_back(level);
+    }
+
+    std::cout << "Encoding a resolution ladder..." << std::endl;
+
+    cppeg::Encoder encoder;
+    if (!encoder.openImage(iFilename))
+    {
+        std::cout << "Fail to open the input file, unable to encode." << std::endl;
+        return;
+    }
+
+    std::vector<cppeg::Encoder::ResultCode> results = encoder.encodeImageLadder(levels);
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        bool done = results[i] == cppeg::Encoder::ResultCode::ENCODE_DONE;
+        std::cout << (done ? "Written " : "Failed ") << "\'" << levels[i].filename << "\'" << std::endl;
+    }
+}
+
+void encodeMJPEG(std::string oFilename, const std::vector<std::string> &iFilenames)
+{
+    std::cout << "Encoding " << iFilenames.size() << " frames..." << std::endl;
+
+    cppeg::MJPEGStreamEncoder stream;
+    for (size_t i = 0; i < iFilenames.size(); ++i)
+    {
+        cv::Mat frame = cv::imread(iFilenames[i], cv::IMREAD_COLOR);
+        if (frame.empty())
+        {
+            std::cout << "Cannot read the frame \'" << iFilenames[i] << "\', stop encoding." << std::endl;
+            break;
+        }
+
+        // the first frame determines the size of the stream
+        if (i == 0 && !stream.open(oFilename, cppeg::MJPEGStreamEncoder::AVI_CONTAINER, frame.cols, frame.rows))
+        {
+            std::cout << "Fail to open the output file, unable to encode." << std::endl;
+            return;
+        }
+
+        if (!stream.encodeFrame(frame))
+        {
+            std::cout << "Fail to encode the frame \'" << iFilenames[i] << "\', stop encoding." << std::endl;
+            break;
+        }
+    }
+    stream.close();
+
+    std::cout << "Complete! " << stream.frameCount() << " frames written to \'" << oFilename << "\'";
+    if (stream.AVIFileCount() > 1)
+        std::cout << " and " << stream.AVIFileCount() - 1 << " continuation files";
+    std::cout << "." << std::endl;
+}
+
+void encodeJPEGBatch(std::string oDirectory, const std::vector<std::string> &iFilenames)
+{
+    std::cout << "Encoding " << iFilenames.size() << " images..." << std::endl;
+
+    // <oDirectory>/<input name without extension>.jpg
+    std::vector<cppeg::BatchPipeline::Job> jobs;
+    for (const std::string &iFilename : iFilenames)
+    {
+        size_t nameBeg = iFilename.find_last_of('/');
+        std::string name = iFilename.substr(nameBeg == std::string::npos ? 0 : nameBeg + 1);
+        name = name.substr(0, name.find_last_of('.'));
+        jobs.push_back({iFilename, oDirectory + "/" + name + ".jpg"});
+    }
+
+    cppeg::BatchPipeline pipeline;
+    cppeg::BatchPipeline::Stats stats = pipeline.run(jobs);
+
+    std::cout << "Complete! " << stats.encoded << " images encoded, " << stats.failed << " failed in "
+              << stats.seconds << " s. Check log file \'cppeg.log\' for details." << std::endl;
+}
+
+void transcodeJPEG(std::string iFilename, std::string oFilename, int quality)
+{
+    std::ifstream iFile(iFilename, std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(iFile)), std::istreambuf_iterator<char>());
+    cppeg::Decoder decoder;
+    cppeg::FileSink oFile;
+    if (data.empty() || !decoder.decode(data.data(), data.size()) || !oFile.open(oFilename))
+    {
+        std::cout << "Fail to read the input jpeg file or to open the output file, unable to transcode." << std::endl;
+        return;
+    }
+
+    // without a quality, the tables of the source are kept and the image does not change
+    cppeg::Encoder encoder;
+    if (quality > 0)
+        encoder.setQuality(quality);
+    if (encoder.transcode(decoder, oFile, quality <= 0) != cppeg::Encoder::ResultCode::ENCODE_DONE || !oFile.close())
+        std::cout << "Fail to transcode \'" << iFilename << "\'." << std::endl;
+    else
+        std::cout << "Complete! PSNR against the source: " << encoder.stats().PSNR()
+                  << " dB. Check log file \'cppeg.log\' for details." << std::endl;
+}
+
+void encodeJPEGTiles(std::string iFilename, std::string oFilename, bool archive, int tileSize, int overlap, int quality)
+{
+    cv::Mat image = cv::imread(iFilename, cv::IMREAD_COLOR);
+    if (image.empty())
+    {
+        std::cout << "Fail to open the input file, unable to encode." << std::endl;
+        return;
+    }
+
+    cppeg::TilePyramid pyramid(tileSize, overlap);
+    pyramid.setQuality(quality);
+    std::unique_ptr<cppeg::TileSink> sink;
+    if (archive)
+        sink.reset(new cppeg::TileArchiveSink(oFilename));
+    else
+        sink.reset(new cppeg::TileDirectorySink(oFilename));
+    cppeg::TilePyramid::Stats stats = pyramid.encode(image, *sink);
+
+    std::cout << "Complete! " << stats.tiles << " tiles of " << stats.levels << " levels encoded, " << stats.failed
+              << " failed in " << stats.seconds << " s. Check log file \'cppeg.log\' for details." << std::endl;
+}
+
+/// whether the decoded coefficients of a file are the quantized coefficients kept by the encoder
+bool sameCoefficients(const cppeg::Decoder &decoder, const std::vector<cppeg::Int16> &coefficients)
+{
+    const std::vector<cppeg::Decoder::Component> &components = decoder.components();
+    if (components.size() != 3 || coefficients.size() != components[0].coefficients.size() * 3)
+        return false;
+
+    // the encoder keeps 3 blocks per MCU, the decoder a plane of blocks per component
+    size_t MCUCount = coefficients.size() / (3 * 64);
+    int blocksPerLine = components[0].blocksPerLine;
+    for (size_t n = 0; n < MCUCount; ++n)
+        for (int c = 0; c < 3; ++c)
+            if (std::memcmp(components[c].block(n % blocksPerLine, n / blocksPerLine),
+                            &coefficients[(n * 3 + c) * 64], 64 * sizeof(cppeg::Int16)) != 0)
+                return false;
+    return true;
+}
+
+void encodeJPEGVerified(std::string oDirectory, const std::vector<std::string> &iFilenames)
+{
+    std::cout << "Encoding and verifying " << iFilenames.size() << " images..." << std::endl;
+
+    struct EncodedFile
+    {
+        std::string filename;
+        std::vector<char> jpeg;
+        std::vector<cppeg::Int16> coefficients;
+    };
+
+    // the verifier decodes a file while the next image is encoded
+    cppeg::SPSCQueue<EncodedFile> queue(2);
+    std::vector<std::string> mismatches;
+    size_t verified = 0;
+    double decodeSeconds = 0;
+    std::thread verifier([&] {
+        cppeg::Decoder decoder;
+        EncodedFile file;
+        while (queue.pop(file))
+        {
+            auto start = std::chrono::steady_clock::now();
+            bool same = decoder.decode(file.jpeg.data(), file.jpeg.size()) && sameCoefficients(decoder, file.coefficients);
+            decodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (!same)
+                mismatches.push_back(file.filename);
+            verified++;
+        }
+    });
+
+    cppeg::Encoder encoder;
+    encoder.setKeepQuantizedCoefficients(true);
+    cppeg::MemorySink jpeg;
+    double encodeSeconds = 0;
+    for (const std::string &iFilename : iFilenames)
+    {
+        size_t nameBeg = iFilename.find_last_of('/');
+        std::string name = iFilename.substr(nameBeg == std::string::npos ? 0 : nameBeg + 1);
+        EncodedFile file;
+        file.filename = oDirectory + "/" + name.substr(0, name.find_last_of('.')) + ".jpg";
+
+        cv::Mat image = cv::imread(iFilename, cv::IMREAD_COLOR);
+        auto start = std::chrono::steady_clock::now();
+        jpeg.reset();
+        if (image.empty() || encoder.encodeFrame(image, jpeg) != cppeg::Encoder::ResultCode::ENCODE_DONE)
+        {
+            std::cout << "Fail to encode '" << iFilename << "'." << std::endl;
+            continue;
+        }
+        encodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        cppeg::FileSink oFile;
+        if (!oFile.open(file.filename) || !oFile.write(jpeg.data(), jpeg.size()) || !oFile.close())
+            std::cout << "Fail to write '" << file.filename << "'." << std::endl;
+        file.jpeg.assign(jpeg.data(), jpeg.data() + jpeg.size());
+        file.coefficients = encoder.quantizedCoefficients();
+        queue.push(std::move(file));
+    }
+    queue.close();
+    verifier.join();
+
+    for (const std::string &filename : mismatches)
+        std::cout << "Mismatch: the coefficients decoded from '" << filename << "' differ from the encoder's." << std::endl;
+    std::cout << "Complete! " << verified << " images verified, " << mismatches.size() << " mismatches. Encoding took "
+              << encodeSeconds << " s, decoding " << decodeSeconds << " s." << std::endl;
+}
+
+void stressEncoders(unsigned threads, std::string iFilename)
+{
+    cv::Mat image = cv::imread(iFilename, cv::IMREAD_COLOR);
+    if (image.empty() || threads == 0)
+    {
+        std::cout << "Fail to open the input file, unable to encode." << std::endl;
+        return;
+    }
+
+    // every encoder gets its own quantization tables and options, so that a state shared by
+    // mistake between them shows in the output
+    auto configure = [threads](cppeg::Encoder &encoder, unsigned i) {
+        encoder.setQuality(10 + (int)(90 * i / std::max(threads - 1, 1u)));
+        encoder.setThumbnailEnabled(i % 2 == 1);
+        encoder.setBlockCacheSize(i % 3 == 1 ? 256 : 0);
+    };
+
+    std::cout << "Encoding '" << iFilename << "' on one thread, then on " << threads << " threads at once..." << std::endl;
+    std::vector<std::string> references(threads);
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        cppeg::Encoder encoder;
+        configure(encoder, i);
+        std::ostringstream jpeg;
+        if (encoder.encodeFrame(image, jpeg) != cppeg::Encoder::ResultCode::ENCODE_DONE)
+        {
+            std::cout << "Fail to encode '" << iFilename << "'." << std::endl;
+            return;
+        }
+        references[i] = jpeg.str();
+    }
+
+    // each thread encodes several times with the same encoder, its buffers and tables being reused
+    const int rounds = 4;
+    std::vector<int> mismatches(threads, 0);
+    std::atomic<unsigned> waiting(threads);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers.emplace_back([&, i] {
+            cppeg::Encoder encoder;
+            configure(encoder, i);
+            // start together, so that the encodes overlap
+            waiting--;
+            while (waiting.load() != 0)
+                std::this_thread::yield();
+            for (int round = 0; round < rounds; ++round)
+            {
+                std::ostringstream jpeg;
+                if (encoder.encodeFrame(image, jpeg) != cppeg::Encoder::ResultCode::ENCODE_DONE ||
+                    jpeg.str() != references[i])
+                    mismatches[i]++;
+            }
+        });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int total = 0;
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        if (mismatches[i] != 0)
+            std::cout << "Mismatch: encoder " << i << " differs from its single-threaded output in " << mismatches[i]
+                      << " of " << rounds << " encodes." << std::endl;
+        total += mismatches[i];
+    }
+    std::cout << "Complete! " << threads * rounds << " concurrent encodes, " << total << " mismatches in " << seconds
+              << " s." << std::endl;
+}
+
+// set by SIGINT / SIGTERM to stop the server or the shared memory encoder
+std::atomic<bool> stopRequested(false);
+
+void serveEncoder(std::string socketPath, unsigned threads)
+{
+    cppeg::EncodeServer server(threads);
+    if (!server.open(socketPath))
+    {
+        std::cout << "Fail to listen on \'" << socketPath << "\'." << std::endl;
+        return;
+    }
+
+    std::signal(SIGINT, [](int) { stopRequested = true; });
+    std::signal(SIGTERM, [](int) { stopRequested = true; });
+    std::cout << "Serving on \'" << socketPath << "\', press Ctrl+C to stop." << std::endl;
+    server.serve(stopRequested);
+    std::cout << server.statsString() << std::endl;
+}
+
+void encodeWithServer(std::string socketPath, std::string iFilename, std::string oFilename, int quality)
+{
+    cppeg::EncodeClient client;
+    if (!client.connect(socketPath))
+    {
+        std::cout << "Fail to connect to \'" << socketPath << "\'." << std::endl;
+        return;
+    }
+
+    // the client decodes the image and sends its pixels
+    cv::Mat image = cv::imread(iFilename, cv::IMREAD_COLOR);
+    std::vector<char> jpeg;
+    if (image.empty() || !client.encodeImage(image, quality, false, jpeg))
+    {
+        std::cout << "Fail to encode \'" << iFilename << "\': " << std::string(jpeg.begin(), jpeg.end()) << std::endl;
+        return;
+    }
+
+    std::ofstream oFile(oFilename, std::ios::out | std::ios::binary);
+    oFile.write(jpeg.data(), jpeg.size());
+    std::cout << "Complete! " << jpeg.size() << " bytes written to \'" << oFilename << "\'." << std::endl;
+}
+
+void printServerStats(std::string socketPath)
+{
+    cppeg::EncodeClient client;
+    std::string text;
+    if (!client.connect(socketPath) || !client.stats(text))
+    {
+        std::cout << "Fail to get the statistics from \'" << socketPath << "\'." << std::endl;
+        return;
+    }
+    std::cout << text << std::endl;
+}
+
+void encodeSharedFrames(std::string iRingName, std::string oRingName, int quality)
+{
+    // the output ring holds a few JPEG files, each at most as large as a raw input frame plus the headers
+    cppeg::SharedFrameRing input, output;
+    if (!input.attach(iRingName) || !output.create(oRingName, 4, input.slotSize() + 65536))
+    {
+        std::cout << "Fail to open the shared memory rings, unable to encode." << std::endl;
+        return;
+    }
+
+    std::signal(SIGINT, [](int) { stopRequested = true; });
+    std::signal(SIGTERM, [](int) { stopRequested = true; });
+    std::cout << "Encoding the frames of \'" << iRingName << "\' into \'" << oRingName << "\'..." << std::endl;
+
+    cppeg::Encoder encoder;
+    encoder.setQuality(quality);
+    size_t frameCount = 0;
+    cppeg::SharedFrameRing::Frame frame;
+    while (!stopRequested)
+    {
+        if (!input.acquireRead(frame, 200))
+        {
+            if (input.ended())
+                break;
+            continue;
+        }
+        if (frame.format != cppeg::SharedFrameRing::BGR24)
+        {
+            input.releaseRead();
+            continue;
+        }
+
+        cppeg::UInt8 *slot = nullptr;
+        while (!stopRequested && (slot = output.acquireWrite(200)) == nullptr)
+            ;
+        if (slot == nullptr)
+            break;
+
+        // the encoder reads the pixels in the input ring and writes the JPEG file into the output ring
+        cv::Mat image(frame.height, frame.width, CV_8UC3, frame.data, frame.stride);
+        cppeg::FixedMemorySink sink(reinterpret_cast<char *>(slot), output.slotSize());
+        bool encoded = encoder.encodeFrame(image, sink) == cppeg::Encoder::ResultCode::ENCODE_DONE;
+        input.releaseRead();
+
+        if (encoded)
+        {
+            cppeg::SharedFrameRing::Frame jpeg;
+            jpeg.sequence = frame.sequence;
+            jpeg.format = cppeg::SharedFrameRing::JPEG;
+            jpeg.width = frame.width;
+            jpeg.height = frame.height;
+            jpeg.size = sink.size();
+            output.publish(jpeg);
+            frameCount++;
+        }
+    }
+    output.endStream();
+
+    std::cout << "Complete! " << frameCount << " frames encoded." << std::endl;
+}
+
 int handleInput(int argc, char** argv)
 {
     if ( argc < 2 )
@@ -49,11 +719,134 @@ int handleInput(int argc, char** argv)
         printHelp();
         return EXIT_SUCCESS;
     }
+    else if ( ( argc == 3 || argc == 4 ) && (std::string)argv[1] == "-t" )
+    {
+        encodeJPEG( argv[2], argc == 4 ? argv[3] : "", true );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 3 || argc == 4 ) && (std::string)argv[1] == "-d" )
+    {
+        encodeJPEG( argv[2], argc == 4 ? argv[3] : "", false, 4096 );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 3 || argc == 4 ) && (std::string)argv[1] == "-c" )
+    {
+        encodeJPEG( argv[2], argc == 4 ? argv[3] : "", false, 0, true );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 3 || argc == 4 ) && (std::string)argv[1] == "-p" )
+    {
+        encodeJPEG( argv[2], argc == 4 ? argv[3] : "", false, 0, false, true );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 4 || argc == 5 ) && (std::string)argv[1] == "--pruned-dct" )
+    {
+        encodeJPEG( argv[3], argc == 5 ? argv[4] : "", false, 0, false, false, std::stoi( argv[2] ), true );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc >= 4 && (std::string)argv[1] == "--train-tables" )
+    {
+        trainHuffmanTables( std::stoi( argv[2] ), std::vector<std::string>( argv + 3, argv + argc ) );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc == 5 && (std::string)argv[1] == "--save-coefficients" )
+    {
+        encodeJPEGSavingCoefficients( argv[2], argv[3], argv[4] );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 4 || ( argc == 5 && (std::string)argv[4] == "-c" ) ) && (std::string)argv[1] == "--from-coefficients" )
+    {
+        encodeJPEGFromCoefficients( argv[2], argv[3], argc == 5 );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 4 || argc == 5 ) && (std::string)argv[1] == "-s" )
+    {
+        size_t targetBytes = std::stoul( argv[2] );
+        encodeJPEGToSize( targetBytes, argv[3], argc == 5 ? argv[4] : "" );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 3 || argc == 4 ) && (std::string)argv[1] == "--measure" )
+    {
+        measureJPEG( argv[2], argc == 4 ? std::stoi( argv[3] ) : 50 );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc >= 4 && (std::string)argv[1] == "-v" )
+    {
+        encodeJPEGVariants( argv[2], std::vector<std::string>( argv + 3, argv + argc ) );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc == 4 && (std::string)argv[1] == "-l" )
+    {
+        encodeJPEGLadder( argv[2], argv[3] );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc >= 4 && (std::string)argv[1] == "-m" )
+    {
+        encodeMJPEG( argv[2], std::vector<std::string>( argv + 3, argv + argc ) );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 3 || argc == 4 ) && (std::string)argv[1] == "--serve" )
+    {
+        serveEncoder( argv[2], argc == 4 ? std::stoul( argv[3] ) : 0 );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 5 || argc == 6 ) && (std::string)argv[1] == "--client" )
+    {
+        encodeWithServer( argv[2], argv[3], argv[4], argc == 6 ? std::stoi( argv[5] ) : 50 );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc == 3 && (std::string)argv[1] == "--stats" )
+    {
+        printServerStats( argv[2] );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 4 || argc == 5 ) && (std::string)argv[1] == "--shm" )
+    {
+        encodeSharedFrames( argv[2], argv[3], argc == 5 ? std::stoi( argv[4] ) : 50 );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc == 4 && (std::string)argv[1] == "--mmap" )
+    {
+        encodeJPEGMapped( argv[2], argv[3] );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc >= 4 && (std::string)argv[1] == "--verify" )
+    {
+        encodeJPEGVerified( argv[2], std::vector<std::string>( argv + 3, argv + argc ) );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 4 || argc == 5 ) && (std::string)argv[1] == "--transcode" )
+    {
+        transcodeJPEG( argv[2], argv[3], argc == 5 ? std::stoi( argv[4] ) : 0 );
+        return EXIT_SUCCESS;
+    }
+    else if ( ( argc == 4 || argc == 7 ) && ( (std::string)argv[1] == "--tiles" || (std::string)argv[1] == "--tile-archive" ) )
+    {
+        bool options = argc == 7;
+        encodeJPEGTiles( argv[2], argv[3], (std::string)argv[1] == "--tile-archive", options ? std::stoi( argv[4] ) : 254,
+                         options ? std::stoi( argv[5] ) : 1, options ? std::stoi( argv[6] ) : 50 );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc == 4 && (std::string)argv[1] == "--stress" )
+    {
+        stressEncoders( std::stoi( argv[2] ), argv[3] );
+        return EXIT_SUCCESS;
+    }
+    else if ( argc >= 4 && (std::string)argv[1] == "-b" )
+    {
+        encodeJPEGBatch( argv[2], std::vector<std::string>( argv + 3, argv + argc ) );
+        return EXIT_SUCCESS;
+    }
     else if ( argc == 2 )
     {
         encodeJPEG( argv[1] );
         return EXIT_SUCCESS;
     }
+    else if ( argc == 3 && (std::string)argv[2] == "-" )
+    {
+        encodeJPEGToStdout( argv[1] );
+        return EXIT_SUCCESS;
+    }
     else if ( argc == 3 )
     {
         encodeJPEG( argv[1], argv[2] );
@@ -0,0 +1,112 @@
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+
+#include "Arena.hpp"
+
+#ifdef CPPEG_COUNT_HEAP_ALLOCATIONS
+namespace
+{
+    thread_local size_t heapAllocationCount = 0;
+
+    void *countedAllocate(std::size_t size, std::size_t alignment)
+    {
+        heapAllocationCount++;
+        size = std::max<std::size_t>(size, 1);
+        void *data = alignment <= alignof(std::max_align_t)
+                         ? std::malloc(size)
+                         : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+        if (data == nullptr)
+            throw std::bad_alloc();
+        return data;
+    }
+}
+
+// the nothrow forms of the standard library call these
+void *operator new(std::size_t size) { return countedAllocate(size, 0); }
+void *operator new[](std::size_t size) { return countedAllocate(size, 0); }
+void *operator new(std::size_t size, std::align_val_t alignment) { return countedAllocate(size, (std::size_t)alignment); }
+void *operator new[](std::size_t size, std::align_val_t alignment) { return countedAllocate(size, (std::size_t)alignment); }
+void operator delete(void *data) noexcept { std::free(data); }
+void operator delete[](void *data) noexcept { std::free(data); }
+void operator delete(void *data, std::size_t) noexcept { std::free(data); }
+void operator delete[](void *data, std::size_t) noexcept { std::free(data); }
+void operator delete(void *data, std::align_val_t) noexcept { std::free(data); }
+void operator delete[](void *data, std::align_val_t) noexcept { std::free(data); }
+void operator delete(void *data, std::size_t, std::align_val_t) noexcept { std::free(data); }
+void operator delete[](void *data, std::size_t, std::align_val_t) noexcept { std::free(data); }
+#endif
+
+namespace cppeg
+{
+    Arena::Arena(size_t blockSize) : m_blockSize(blockSize)
+    {
+    }
+
+    Arena::~Arena()
+    {
+        for (Block &block : m_blocks)
+            std::free(block.data);
+    }
+
+    void *Arena::allocate(size_t bytes)
+    {
+        // keep every buffer aligned to a cache line
+        bytes = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+        // move on to the next block that is large enough
+        while (m_current < m_blocks.size() && m_offset + bytes > m_blocks[m_current].size)
+        {
+            m_current++;
+            m_offset = 0;
+        }
+
+        if (m_current == m_blocks.size())
+        {
+            size_t size = std::max(m_blockSize, bytes);
+            void *data = std::aligned_alloc(ALIGNMENT, size);
+            if (data == nullptr)
+                throw std::bad_alloc();
+            m_blocks.push_back({static_cast<UInt8 *>(data), size});
+            m_offset = 0;
+            m_stats.heapAllocations++;
+        }
+
+        void *buffer = m_blocks[m_current].data + m_offset;
+        m_offset += bytes;
+        m_bytesInUse += bytes;
+        m_stats.allocations++;
+        m_stats.peakBytes = std::max(m_stats.peakBytes, m_bytesInUse);
+        return buffer;
+    }
+
+    ArenaStats Arena::stats() const
+    {
+        ArenaStats stats = m_stats;
+        stats.threadHeapAllocations = threadHeapAllocations();
+        return stats;
+    }
+
+    void Arena::reset()
+    {
+        m_current = 0;
+        m_offset = 0;
+        m_bytesInUse = 0;
+    }
+
+    Arena &threadArena()
+    {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    size_t threadHeapAllocations()
+    {
+#ifdef CPPEG_COUNT_HEAP_ALLOCATIONS
+        return heapAllocationCount;
+#else
+        return 0;
+#endif
+    }
+}
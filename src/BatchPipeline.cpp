@@ -0,0 +1,172 @@
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+#include "opencv2/imgcodecs.hpp"
+#include "BatchPipeline.hpp"
+#include "SPSCQueue.hpp"
+#include "Encoder.hpp"
+#include "OutputSink.hpp"
+#include "Utility.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        /// an input image on its way from the reader to an encoder
+        struct DecodedImage
+        {
+            size_t index = 0;
+            cv::Mat image;
+        };
+
+        /// an encoded image on its way from an encoder to the writer
+        struct EncodedImage
+        {
+            size_t index = 0;
+            bool encoded = false;
+            std::vector<char> data;
+
+            /// the log messages of the encoder, appended to the log file by the writer
+            std::string log;
+        };
+
+        double secondsSince(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    BatchPipeline::BatchPipeline(unsigned encodeThreads, size_t queueDepth)
+        : m_encodeThreads(encodeThreads), m_queueDepth(queueDepth)
+    {
+        if (m_encodeThreads == 0)
+        {
+            unsigned cores = std::thread::hardware_concurrency();
+            m_encodeThreads = cores > 3 ? cores - 2 : 1;
+        }
+        if (m_queueDepth == 0)
+            m_queueDepth = 1;
+    }
+
+    void BatchPipeline::setQuality(int quality)
+    {
+        m_quality = quality;
+    }
+
+    BatchPipeline::Stats BatchPipeline::run(const std::vector<Job> &jobs)
+    {
+        Stats stats;
+        auto batchStart = std::chrono::steady_clock::now();
+        size_t workerCount = std::max<size_t>(1, std::min<size_t>(m_encodeThreads, jobs.size()));
+
+        // the encoders are created here, they log their construction into the log file
+        std::vector<std::unique_ptr<Encoder>> encoders;
+        std::vector<std::unique_ptr<SPSCQueue<DecodedImage>>> inputQueues;
+        std::vector<std::unique_ptr<SPSCQueue<EncodedImage>>> outputQueues;
+        for (size_t k = 0; k < workerCount; ++k)
+        {
+            encoders.emplace_back(new Encoder());
+            encoders.back()->setQuality(m_quality);
+            inputQueues.emplace_back(new SPSCQueue<DecodedImage>(m_queueDepth));
+            outputQueues.emplace_back(new SPSCQueue<EncodedImage>(m_queueDepth));
+        }
+
+        double readSeconds = 0;
+        std::thread reader([&] {
+            for (size_t i = 0; i < jobs.size(); ++i)
+            {
+                auto start = std::chrono::steady_clock::now();
+                DecodedImage decoded;
+                decoded.index = i;
+                decoded.image = cv::imread(jobs[i].iFilename, cv::IMREAD_COLOR);
+                readSeconds += secondsSince(start);
+                inputQueues[i % workerCount]->push(std::move(decoded));
+            }
+            for (auto &queue : inputQueues)
+                queue->close();
+        });
+
+        std::vector<double> encodeSeconds(workerCount, 0);
+        std::vector<std::thread> workers;
+        for (size_t k = 0; k < workerCount; ++k)
+        {
+            workers.emplace_back([&, k] {
+                Encoder &encoder = *encoders[k];
+                MemorySink output;
+                // every encoder logs into its own stream, the writer appends the logs in job order
+                std::ostringstream log;
+                encoder.setLogStream(&log);
+
+                DecodedImage decoded;
+                while (inputQueues[k]->pop(decoded))
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    EncodedImage encoded;
+                    encoded.index = decoded.index;
+                    if (!decoded.image.empty())
+                    {
+                        output.reset();
+                        log.str("");
+                        if (encoder.encodeFrame(decoded.image, output) == Encoder::ResultCode::ENCODE_DONE)
+                        {
+                            encoded.data.assign(output.data(), output.data() + output.size());
+                            encoded.encoded = true;
+                        }
+                        encoded.log = log.str();
+                    }
+                    decoded.image.release();
+                    encodeSeconds[k] += secondsSince(start);
+                    outputQueues[k]->push(std::move(encoded));
+                }
+                outputQueues[k]->close();
+                encoder.setLogStream(nullptr);
+            });
+        }
+
+        // the writer stage runs on the calling thread and takes the images in job order
+        FileSink file;
+        for (size_t i = 0; i < jobs.size(); ++i)
+        {
+            EncodedImage encoded;
+            outputQueues[i % workerCount]->pop(encoded);
+
+            auto start = std::chrono::steady_clock::now();
+            logFile << encoded.log;
+            if (!encoded.encoded)
+            {
+                logFile << "Unable to read or encode: \'" + jobs[i].iFilename + "\'" << std::endl;
+                stats.failed++;
+            }
+            else if (!file.open(jobs[i].oFilename) || !file.write(encoded.data.data(), encoded.data.size()) ||
+                     !file.close())
+            {
+                logFile << "Unable to write: \'" + jobs[i].oFilename + "\'" << std::endl;
+                stats.failed++;
+            }
+            else
+            {
+                stats.encoded++;
+                stats.bytesWritten += encoded.data.size();
+            }
+            stats.writeSeconds += secondsSince(start);
+        }
+
+        reader.join();
+        for (std::thread &worker : workers)
+            worker.join();
+
+        stats.readSeconds = readSeconds;
+        for (double seconds : encodeSeconds)
+            stats.encodeSeconds += seconds;
+        stats.seconds = secondsSince(batchStart);
+
+        logFile << "Batch of " << jobs.size() << " images with " << workerCount << " encoder threads: "
+                << stats.encoded << " encoded, " << stats.failed << " failed, "
+                << stats.bytesWritten << " bytes in " << stats.seconds << " s (read "
+                << stats.readSeconds << " s, encode " << stats.encodeSeconds << " s, write "
+                << stats.writeSeconds << " s)" << std::endl;
+        return stats;
+    }
+}
@@ -0,0 +1,64 @@
+#include <cstring>
+
+#include "BlockCache.hpp"
+
+namespace cppeg
+{
+    void BlockCache::setCapacity(size_t entries)
+    {
+        m_entries.clear();
+        m_entries.resize(entries);
+    }
+
+    void BlockCache::clear()
+    {
+        for (Entry &entry : m_entries)
+            entry.valid = false;
+    }
+
+    UInt64 BlockCache::hashBlock(const cv::Mat &MCU, bool isYCrCb)
+    {
+        // multiply-xorshift over 8 bytes at a time, a row of an MCU is 24 bytes
+        const UInt64 multiplier = 0x9E3779B97F4A7C15ULL;
+        UInt64 hash = isYCrCb ? 0x5851F42D4C957F2DULL : 0x14057B7EF767814FULL;
+        for (int i = 0; i < 8; ++i)
+        {
+            const UInt8 *row = MCU.ptr<UInt8>(i);
+            for (int k = 0; k < 3; ++k)
+            {
+                UInt64 word;
+                std::memcpy(&word, row + k * 8, 8);
+                hash = (hash ^ word) * multiplier;
+                hash ^= hash >> 29;
+            }
+        }
+        return hash;
+    }
+
+    const BlockCache::Entry *BlockCache::find(const cv::Mat &MCU, UInt64 hash) const
+    {
+        if (m_entries.empty())
+            return nullptr;
+
+        const Entry &entry = m_entries[hash % m_entries.size()];
+        if (!entry.valid || entry.hash != hash)
+            return nullptr;
+        for (int i = 0; i < 8; ++i)
+        {
+            if (std::memcmp(entry.pixels + i * 24, MCU.ptr<UInt8>(i), 24) != 0)
+                return nullptr;
+        }
+        return &entry;
+    }
+
+    BlockCache::Entry &BlockCache::insert(const cv::Mat &MCU, UInt64 hash)
+    {
+        Entry &entry = m_entries[hash % m_entries.size()];
+        entry.valid = true;
+        entry.hash = hash;
+        for (int i = 0; i < 8; ++i)
+            std::memcpy(entry.pixels + i * 24, MCU.ptr<UInt8>(i), 24);
+        entry.ACBits.clear();
+        return entry;
+    }
+}
@@ -0,0 +1,128 @@
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CoefficientFile.hpp"
+#include "OutputSink.hpp"
+#include "Utility.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        const UInt32 COEFFICIENT_MAGIC = 0x46515043; // "CPQF"
+
+        const UInt32 COEFFICIENT_VERSION = 1;
+
+        /// the coefficients start on a cache line after the header
+        const size_t DATA_OFFSET = (sizeof(CoefficientFile::Header) + 63) / 64 * 64;
+
+        /// the tables are written to the DQT segment as they are, so each entry must be a valid 8-bit step
+        bool validQTables(const CoefficientFile::Header &header)
+        {
+            for (int t = 0; t < 2; ++t)
+                for (int i = 0; i < 64; ++i)
+                    if (header.QTables[t][i] == 0 || header.QTables[t][i] > 255)
+                        return false;
+            return true;
+        }
+    }
+
+    CoefficientFile::~CoefficientFile()
+    {
+        close();
+    }
+
+    bool CoefficientFile::write(const std::string &filename, int width, int height, int quality,
+                                const std::vector<std::vector<UInt16>> &QTables, const std::vector<Int16> &coefficients)
+    {
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = COEFFICIENT_MAGIC;
+        header.version = COEFFICIENT_VERSION;
+        header.width = width;
+        header.height = height;
+        header.blocksPerLine = (width + 7) / 8;
+        header.blocksPerColumn = (height + 7) / 8;
+        header.componentCount = 3;
+        header.quality = quality;
+        for (int t = 0; t < 2; ++t)
+            std::copy(QTables[t].begin(), QTables[t].begin() + 64, header.QTables[t]);
+        header.dataOffset = DATA_OFFSET;
+        header.dataSize = coefficients.size() * sizeof(Int16);
+
+        if (coefficients.size() != (size_t)header.blocksPerLine * header.blocksPerColumn * 3 * 64)
+        {
+            logFile << "Unable to write coefficient file: \'" + filename + "\', the coefficients do not match the frame size" << std::endl;
+            return false;
+        }
+
+        FileSink file;
+        char padding[DATA_OFFSET - sizeof(Header)] = {};
+        if (!file.open(filename) || !file.write(&header, sizeof(header)) || !file.write(padding, sizeof(padding)) ||
+            !file.write(coefficients.data(), header.dataSize) || !file.close())
+        {
+            logFile << "Unable to write coefficient file: \'" + filename + "\'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool CoefficientFile::open(const std::string &filename)
+    {
+        close();
+
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat status;
+        if (fd < 0 || ::fstat(fd, &status) != 0 || (size_t)status.st_size < DATA_OFFSET)
+        {
+            logFile << "Unable to open coefficient file: \'" + filename + "\'" << std::endl;
+            if (fd >= 0)
+                ::close(fd);
+            return false;
+        }
+
+        void *mapping = ::mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            logFile << "Unable to map coefficient file: \'" + filename + "\'" << std::endl;
+            return false;
+        }
+        m_mapping = static_cast<UInt8 *>(mapping);
+        m_mappingSize = status.st_size;
+        m_header = reinterpret_cast<const Header *>(m_mapping);
+
+        const Header &header = *m_header;
+        size_t expectedSize = (size_t)header.blocksPerLine * header.blocksPerColumn * 3 * 64 * sizeof(Int16);
+        if (header.magic != COEFFICIENT_MAGIC || header.version != COEFFICIENT_VERSION || header.componentCount != 3 ||
+            header.width == 0 || header.height == 0 || header.width > 65535 || header.height > 65535 ||
+            header.blocksPerLine != (header.width + 7) / 8 || header.blocksPerColumn != (header.height + 7) / 8 ||
+            header.dataSize != expectedSize || header.dataOffset % sizeof(Int16) != 0 ||
+            header.dataOffset < sizeof(Header) || header.dataOffset > m_mappingSize ||
+            header.dataSize > m_mappingSize - header.dataOffset || !validQTables(header))
+        {
+            logFile << "Invalid coefficient file: \'" + filename + "\'" << std::endl;
+            close();
+            return false;
+        }
+        m_coefficients = reinterpret_cast<const Int16 *>(m_mapping + header.dataOffset);
+
+        // the coefficients are read once, in order
+        ::madvise(m_mapping, m_mappingSize, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    void CoefficientFile::close()
+    {
+        if (m_mapping != nullptr)
+            ::munmap(m_mapping, m_mappingSize);
+        m_mapping = nullptr;
+        m_mappingSize = 0;
+        m_header = nullptr;
+        m_coefficients = nullptr;
+    }
+}
@@ -0,0 +1,643 @@
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include "opencv2/core.hpp"
+#include "Decoder.hpp"
+#include "Markers.hpp"
+#include "Transform.hpp"
+#include "Utility.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        int ceilDiv(int a, int b)
+        {
+            return (a + b - 1) / b;
+        }
+    }
+
+    bool Decoder::decode(const char *data, size_t size)
+    {
+        m_error.clear();
+        m_components.clear();
+        m_width = m_height = 0;
+        m_progressive = false;
+        m_restartInterval = 0;
+        for (auto &tables : m_huffmanTables)
+            for (HuffmanDecodingTable &table : tables)
+                table.defined = false;
+        std::fill(&m_QTables[0][0], &m_QTables[0][0] + 4 * 64, 1);
+
+        m_data = reinterpret_cast<const UInt8 *>(data);
+        m_size = size;
+        m_pos = 2;
+        if (size < 2 || m_data[0] != JFIF_BYTE_FF || m_data[1] != JFIF_SOI)
+            return fail("the stream does not start with an SOI marker");
+
+        bool scanDecoded = false;
+        while (true)
+        {
+            if (m_pos + 2 > m_size)
+                return fail("unexpected end of the stream");
+            if (m_data[m_pos] != JFIF_BYTE_FF)
+                return fail("expected a marker");
+            Marker marker = m_data[m_pos + 1];
+            m_pos += 2;
+            if (marker == JFIF_BYTE_FF)
+            {
+                // fill byte before a marker
+                m_pos--;
+                continue;
+            }
+            if (marker == JFIF_EOI)
+                break;
+
+            if (m_pos + 2 > m_size)
+                return fail("unexpected end of the stream");
+            size_t length = (m_data[m_pos] << 8) | m_data[m_pos + 1];
+            if (length < 2 || m_pos + length > m_size)
+                return fail("truncated segment");
+            const UInt8 *segment = m_data + m_pos + 2;
+            m_pos += length;
+
+            bool segmentRead = true;
+            switch (marker)
+            {
+            case JFIF_DQT:
+                segmentRead = readDQT(segment, length - 2);
+                break;
+            case JFIF_DHT:
+                segmentRead = readDHT(segment, length - 2);
+                break;
+            case JFIF_SOF0:
+            case JFIF_SOF1:
+            case JFIF_SOF2:
+                m_progressive = marker == JFIF_SOF2;
+                segmentRead = readSOF(segment, length - 2);
+                break;
+            case JFIF_SOF3:
+            case JFIF_SOF5:
+            case JFIF_SOF6:
+            case JFIF_SOF7:
+            case JFIF_SOF9:
+            case JFIF_SOF10:
+            case JFIF_SOF11:
+            case JFIF_SOF13:
+            case JFIF_SOF14:
+            case JFIF_SOF15:
+                return fail("only baseline, extended sequential and progressive Huffman frames are supported");
+            case JFIF_DRI:
+                if (length < 4)
+                    return fail("invalid DRI segment");
+                m_restartInterval = (segment[0] << 8) | segment[1];
+                break;
+            case JFIF_SOS:
+                segmentRead = readScan(segment, length - 2);
+                scanDecoded = true;
+                break;
+            default:
+                // APPn, COM and the other segments are skipped
+                break;
+            }
+            if (!segmentRead)
+                return false;
+        }
+
+        if (!scanDecoded)
+            return fail("the stream has no scan");
+        return true;
+    }
+
+    bool Decoder::fail(const std::string &message)
+    {
+        m_error = message;
+        logFile << "Unable to decode the JPEG stream: " << message << std::endl;
+        return false;
+    }
+
+    bool Decoder::readDQT(const UInt8 *segment, size_t length)
+    {
+        size_t pos = 0;
+        while (pos < length)
+        {
+            int precision = segment[pos] >> 4, tableNo = segment[pos] & 0x0F;
+            size_t tableBytes = precision == 0 ? 64 : 128;
+            if (precision > 1 || tableNo > 3 || pos + 1 + tableBytes > length)
+                return fail("invalid DQT segment");
+            pos++;
+            for (int i = 0; i < 64; ++i)
+            {
+                m_QTables[tableNo][i] = precision == 0 ? segment[pos] : (segment[pos] << 8) | segment[pos + 1];
+                pos += precision == 0 ? 1 : 2;
+            }
+        }
+        return true;
+    }
+
+    bool Decoder::readDHT(const UInt8 *segment, size_t length)
+    {
+        size_t pos = 0;
+        while (pos < length)
+        {
+            int tableClass = segment[pos] >> 4, tableNo = segment[pos] & 0x0F;
+            if (tableClass > 1 || tableNo > 3 || pos + 17 > length)
+                return fail("invalid DHT segment");
+            const UInt8 *counts = segment + pos + 1;
+            int symbolCount = 0;
+            for (int i = 0; i < 16; ++i)
+                symbolCount += counts[i];
+            pos += 17;
+            if (symbolCount > 256 || pos + symbolCount > length)
+                return fail("invalid DHT segment");
+
+            HuffmanDecodingTable &table = m_huffmanTables[tableClass][tableNo];
+            std::memcpy(table.symbols, segment + pos, symbolCount);
+            std::fill(table.lookahead, table.lookahead + (1 << LOOKAHEAD_BITS), 0);
+            pos += symbolCount;
+
+            // canonical codes (ITU-T.81, Annex C): consecutive values within a length,
+            // the first code of the next length is the next value shifted by one bit
+            int code = 0, k = 0;
+            for (int len = 1; len <= 16; ++len)
+            {
+                table.firstIndex[len] = k;
+                table.firstCode[len] = code;
+                for (int i = 0; i < counts[len - 1]; ++i, ++code, ++k)
+                {
+                    if (len > LOOKAHEAD_BITS)
+                        continue;
+                    // every bit pattern starting with the code resolves to it
+                    int shift = LOOKAHEAD_BITS - len;
+                    for (int rest = 0; rest < (1 << shift); ++rest)
+                        table.lookahead[(code << shift) | rest] = (len << 8) | table.symbols[k];
+                }
+                if (code > (1 << len))
+                    return fail("invalid Huffman code lengths");
+                table.maxCode[len] = counts[len - 1] != 0 ? code - 1 : -1;
+                code <<= 1;
+            }
+            table.maxCode[17] = INT_MAX;
+            table.defined = true;
+        }
+        return true;
+    }
+
+    bool Decoder::readSOF(const UInt8 *segment, size_t length)
+    {
+        if (length < 6)
+            return fail("invalid SOF segment");
+        int precision = segment[0];
+        m_height = (segment[1] << 8) | segment[2];
+        m_width = (segment[3] << 8) | segment[4];
+        int compCount = segment[5];
+        if (precision != 8 || m_width == 0 || m_height == 0 || compCount < 1 || compCount > 4 ||
+            length < 6 + 3 * (size_t)compCount)
+            return fail("unsupported frame, only 8-bit samples are supported");
+
+        m_components.assign(compCount, Component());
+        int hMax = 1, vMax = 1;
+        for (int c = 0; c < compCount; ++c)
+        {
+            Component &component = m_components[c];
+            component.id = segment[6 + 3 * c];
+            component.hSampFactor = segment[7 + 3 * c] >> 4;
+            component.vSampFactor = segment[7 + 3 * c] & 0x0F;
+            component.QTableNo = segment[8 + 3 * c];
+            if (component.hSampFactor < 1 || component.hSampFactor > 4 ||
+                component.vSampFactor < 1 || component.vSampFactor > 4 || component.QTableNo > 3)
+                return fail("invalid component in the SOF segment");
+            hMax = std::max(hMax, (int)component.hSampFactor);
+            vMax = std::max(vMax, (int)component.vSampFactor);
+        }
+
+        // the block grid of every component covers whole MCUs of the interleaved scan
+        int MCUsPerLine = ceilDiv(m_width, 8 * hMax), MCUsPerColumn = ceilDiv(m_height, 8 * vMax);
+        for (Component &component : m_components)
+        {
+            component.blocksPerLine = MCUsPerLine * component.hSampFactor;
+            component.blocksPerColumn = MCUsPerColumn * component.vSampFactor;
+            component.coefficients.assign((size_t)component.blocksPerLine * component.blocksPerColumn * 64, 0);
+        }
+        return true;
+    }
+
+    bool Decoder::readScan(const UInt8 *segment, size_t length)
+    {
+        if (m_components.empty())
+            return fail("scan before the frame header");
+        int scanCompCount = length > 0 ? segment[0] : 0;
+        if (scanCompCount < 1 || scanCompCount > 4 || length != 4 + 2 * (size_t)scanCompCount)
+            return fail("invalid SOS segment");
+
+        const UInt8 *spectral = segment + 1 + 2 * scanCompCount;
+        m_spectralStart = spectral[0];
+        m_spectralEnd = spectral[1];
+        m_approximationHigh = spectral[2] >> 4;
+        m_approximationLow = spectral[2] & 0x0F;
+
+        // the block decoder of the scan (ITU-T.81, G.1.2), and the tables it uses
+        bool (Decoder::*decodeScanBlock)(const HuffmanDecodingTable &, const HuffmanDecodingTable &, int &, Int16 *);
+        bool useDCTable = true, useACTable = true;
+        if (!m_progressive)
+        {
+            if (m_spectralStart != 0 || m_spectralEnd != 63 || spectral[2] != 0)
+                return fail("a sequential scan must code all 64 coefficients");
+            decodeScanBlock = &Decoder::decodeBlock;
+        }
+        else
+        {
+            bool DCScan = m_spectralStart == 0;
+            if ((DCScan && m_spectralEnd != 0) || m_spectralStart > m_spectralEnd || m_spectralEnd > 63 ||
+                (!DCScan && scanCompCount != 1) || m_approximationHigh > 13 || m_approximationLow > 13)
+                return fail("invalid progressive scan parameters");
+            bool refine = m_approximationHigh != 0;
+            if (DCScan)
+                decodeScanBlock = refine ? &Decoder::decodeDCRefine : &Decoder::decodeDCFirst;
+            else
+                decodeScanBlock = refine ? &Decoder::decodeACRefine : &Decoder::decodeACFirst;
+            useDCTable = DCScan && !refine;
+            useACTable = !DCScan;
+        }
+
+        std::vector<Component *> scanComps;
+        std::vector<const HuffmanDecodingTable *> DCTables, ACTables;
+        for (int i = 0; i < scanCompCount; ++i)
+        {
+            UInt8 id = segment[1 + 2 * i];
+            int DCTableNo = segment[2 + 2 * i] >> 4, ACTableNo = segment[2 + 2 * i] & 0x0F;
+            auto found = std::find_if(m_components.begin(), m_components.end(),
+                                      [&](const Component &component) { return component.id == id; });
+            if (found == m_components.end() || DCTableNo > 3 || ACTableNo > 3 ||
+                (useDCTable && !m_huffmanTables[0][DCTableNo].defined) ||
+                (useACTable && !m_huffmanTables[1][ACTableNo].defined))
+                return fail("invalid component or table in the SOS segment");
+            scanComps.push_back(&*found);
+            DCTables.push_back(&m_huffmanTables[0][DCTableNo]);
+            ACTables.push_back(&m_huffmanTables[1][ACTableNo]);
+        }
+
+        int hMax = 1, vMax = 1;
+        for (const Component &component : m_components)
+        {
+            hMax = std::max(hMax, (int)component.hSampFactor);
+            vMax = std::max(vMax, (int)component.vSampFactor);
+        }
+
+        m_bitBuffer = 0;
+        m_bitCount = 0;
+        m_EOBRun = 0;
+        std::vector<int> DCPredictions(scanCompCount, 0);
+        int restartCount = 0;
+
+        if (scanCompCount == 1)
+        {
+            // a single-component scan covers the blocks of the component only, not whole MCUs
+            Component &component = *scanComps[0];
+            int blocksX = ceilDiv(ceilDiv(m_width * component.hSampFactor, hMax), 8);
+            int blocksY = ceilDiv(ceilDiv(m_height * component.vSampFactor, vMax), 8);
+            size_t blockCount = (size_t)blocksX * blocksY;
+            for (size_t n = 0; n < blockCount; ++n)
+            {
+                if (m_restartInterval != 0 && n != 0 && n % m_restartInterval == 0)
+                {
+                    if (!readRestartMarker(restartCount++ & 7))
+                        return false;
+                    DCPredictions[0] = 0;
+                    m_EOBRun = 0;
+                }
+                Int16 *block = component.block(n % blocksX, n / blocksX);
+                if (!(this->*decodeScanBlock)(*DCTables[0], *ACTables[0], DCPredictions[0], block))
+                    return fail("invalid Huffman code in the scan");
+            }
+        }
+        else
+        {
+            int MCUsPerLine = ceilDiv(m_width, 8 * hMax), MCUsPerColumn = ceilDiv(m_height, 8 * vMax);
+            size_t MCUCount = (size_t)MCUsPerLine * MCUsPerColumn;
+            for (size_t n = 0; n < MCUCount; ++n)
+            {
+                if (m_restartInterval != 0 && n != 0 && n % m_restartInterval == 0)
+                {
+                    if (!readRestartMarker(restartCount++ & 7))
+                        return false;
+                    std::fill(DCPredictions.begin(), DCPredictions.end(), 0);
+                    m_EOBRun = 0;
+                }
+                int MCUX = n % MCUsPerLine, MCUY = n / MCUsPerLine;
+                for (int i = 0; i < scanCompCount; ++i)
+                {
+                    Component &component = *scanComps[i];
+                    for (int v = 0; v < component.vSampFactor; ++v)
+                        for (int h = 0; h < component.hSampFactor; ++h)
+                        {
+                            Int16 *block = component.block(MCUX * component.hSampFactor + h,
+                                                           MCUY * component.vSampFactor + v);
+                            if (!(this->*decodeScanBlock)(*DCTables[i], *ACTables[i], DCPredictions[i], block))
+                                return fail("invalid Huffman code in the scan");
+                        }
+                }
+            }
+        }
+
+        // step over the padding bits to the marker following the scan
+        m_bitBuffer = 0;
+        m_bitCount = 0;
+        while (m_pos + 1 < m_size &&
+               !(m_data[m_pos] == JFIF_BYTE_FF && m_data[m_pos + 1] != 0x00 &&
+                 (m_data[m_pos + 1] & 0xF8) != JFIF_RST0))
+            m_pos++;
+        return true;
+    }
+
+    void Decoder::fillBits()
+    {
+        while (m_bitCount <= 56)
+        {
+            UInt8 byte = 0;
+            if (m_pos < m_size)
+            {
+                byte = m_data[m_pos];
+                if (byte != JFIF_BYTE_FF)
+                    m_pos++;
+                else if (m_pos + 1 < m_size && m_data[m_pos + 1] == 0x00)
+                    m_pos += 2; // stuffed zero byte
+                else
+                    byte = 0; // a marker ends the segment, it is left to the caller
+            }
+            m_bitBuffer |= (UInt64)byte << (56 - m_bitCount);
+            m_bitCount += 8;
+        }
+    }
+
+    bool Decoder::readRestartMarker(int expected)
+    {
+        // the bits left in the register pad the last byte of the interval
+        m_bitBuffer = 0;
+        m_bitCount = 0;
+        while (m_pos + 1 < m_size && m_data[m_pos] == JFIF_BYTE_FF && m_data[m_pos + 1] == JFIF_BYTE_FF)
+            m_pos++;
+        if (m_pos + 2 > m_size || m_data[m_pos] != JFIF_BYTE_FF || m_data[m_pos + 1] != JFIF_RST0 + expected)
+            return fail("missing restart marker");
+        m_pos += 2;
+        return true;
+    }
+
+    int Decoder::decodeHuffman(const HuffmanDecodingTable &table)
+    {
+        if (m_bitCount < 16)
+            fillBits();
+
+        // fast path: one lookup for the codes of at most LOOKAHEAD_BITS bits
+        UInt16 entry = table.lookahead[m_bitBuffer >> (64 - LOOKAHEAD_BITS)];
+        if (entry != 0)
+        {
+            int len = entry >> 8;
+            m_bitBuffer <<= len;
+            m_bitCount -= len;
+            return entry & 0xFF;
+        }
+
+        for (int len = LOOKAHEAD_BITS + 1; len <= 16; ++len)
+        {
+            Int32 code = (Int32)(m_bitBuffer >> (64 - len));
+            if (code <= table.maxCode[len])
+            {
+                m_bitBuffer <<= len;
+                m_bitCount -= len;
+                return table.symbols[table.firstIndex[len] + code - table.firstCode[len]];
+            }
+        }
+        return -1;
+    }
+
+    int Decoder::readBits(int count)
+    {
+        if (count == 0)
+            return 0;
+        if (m_bitCount < count)
+            fillBits();
+        int value = (int)(m_bitBuffer >> (64 - count));
+        m_bitBuffer <<= count;
+        m_bitCount -= count;
+        return value;
+    }
+
+    int Decoder::receiveExtend(int category)
+    {
+        if (category == 0)
+            return 0;
+        int value = readBits(category);
+
+        // values below 2^(category - 1) are negative (one's complement of the magnitude)
+        return value < (1 << (category - 1)) ? value - (1 << category) + 1 : value;
+    }
+
+    bool Decoder::decodeBlock(const HuffmanDecodingTable &DCTable, const HuffmanDecodingTable &ACTable,
+                              int &DCPrediction, Int16 *block)
+    {
+        int category = decodeHuffman(DCTable);
+        if (category < 0 || category > 16)
+            return false;
+        DCPrediction += receiveExtend(category);
+        block[0] = DCPrediction;
+
+        for (int k = 1; k < 64;)
+        {
+            int RRRRSSSS = decodeHuffman(ACTable);
+            if (RRRRSSSS < 0)
+                return false;
+            int run = RRRRSSSS >> 4, size = RRRRSSSS & 0x0F;
+            if (size == 0)
+            {
+                if (run != 15)
+                    break; // EOB
+                k += 16;   // ZRL
+                continue;
+            }
+            k += run;
+            if (k > 63)
+                return false;
+            block[k++] = receiveExtend(size);
+        }
+        return true;
+    }
+
+    bool Decoder::decodeDCFirst(const HuffmanDecodingTable &DCTable, const HuffmanDecodingTable &,
+                                int &DCPrediction, Int16 *block)
+    {
+        int category = decodeHuffman(DCTable);
+        if (category < 0 || category > 16)
+            return false;
+        DCPrediction += receiveExtend(category);
+        block[0] = DCPrediction * (1 << m_approximationLow);
+        return true;
+    }
+
+    bool Decoder::decodeDCRefine(const HuffmanDecodingTable &, const HuffmanDecodingTable &, int &, Int16 *block)
+    {
+        if (readBits(1))
+            block[0] |= 1 << m_approximationLow;
+        return true;
+    }
+
+    bool Decoder::decodeACFirst(const HuffmanDecodingTable &, const HuffmanDecodingTable &ACTable,
+                                int &, Int16 *block)
+    {
+        // the block is inside an end-of-band run, its band stays zero
+        if (m_EOBRun > 0)
+        {
+            m_EOBRun--;
+            return true;
+        }
+
+        for (int k = m_spectralStart; k <= m_spectralEnd;)
+        {
+            int RRRRSSSS = decodeHuffman(ACTable);
+            if (RRRRSSSS < 0)
+                return false;
+            int run = RRRRSSSS >> 4, size = RRRRSSSS & 0x0F;
+            if (size == 0)
+            {
+                if (run == 15)
+                {
+                    k += 16; // ZRL
+                    continue;
+                }
+                // EOBn: this block and the next 2^n - 1 + (n bits) blocks end here
+                m_EOBRun = (1 << run) - 1 + readBits(run);
+                break;
+            }
+            k += run;
+            if (k > m_spectralEnd)
+                return false;
+            block[k++] = receiveExtend(size) * (1 << m_approximationLow);
+        }
+        return true;
+    }
+
+    bool Decoder::decodeACRefine(const HuffmanDecodingTable &, const HuffmanDecodingTable &ACTable,
+                                 int &, Int16 *block)
+    {
+        int positive = 1 << m_approximationLow, negative = -1 * (1 << m_approximationLow);
+
+        // a coefficient that is already nonzero gets a correction bit whenever it is passed
+        auto refine = [&](Int16 &coefficient) {
+            if (readBits(1) && (coefficient & positive) == 0)
+                coefficient += coefficient >= 0 ? positive : negative;
+        };
+
+        int k = m_spectralStart;
+        if (m_EOBRun == 0)
+        {
+            for (; k <= m_spectralEnd; ++k)
+            {
+                int RRRRSSSS = decodeHuffman(ACTable);
+                if (RRRRSSSS < 0)
+                    return false;
+                int run = RRRRSSSS >> 4, size = RRRRSSSS & 0x0F, value = 0;
+                if (size != 0)
+                {
+                    // a new coefficient is always of magnitude 1, its sign follows
+                    if (size != 1)
+                        return false;
+                    value = readBits(1) ? positive : negative;
+                }
+                else if (run != 15)
+                {
+                    // EOBn, the rest of the band of this block is refined below
+                    m_EOBRun = (1 << run) + readBits(run);
+                    break;
+                }
+
+                // skip run zero coefficients, refining the nonzero ones on the way
+                for (; k <= m_spectralEnd; ++k)
+                {
+                    if (block[k] != 0)
+                        refine(block[k]);
+                    else if (--run < 0)
+                        break;
+                }
+                if (value != 0)
+                {
+                    if (k > m_spectralEnd)
+                        return false;
+                    block[k] = value;
+                }
+            }
+        }
+
+        if (m_EOBRun > 0)
+        {
+            for (; k <= m_spectralEnd; ++k)
+                if (block[k] != 0)
+                    refine(block[k]);
+            m_EOBRun--;
+        }
+        return true;
+    }
+
+    cv::Mat Decoder::toImage() const
+    {
+        if (m_components.empty())
+            return cv::Mat();
+
+        int hMax = 1, vMax = 1;
+        for (const Component &component : m_components)
+        {
+            hMax = std::max(hMax, (int)component.hSampFactor);
+            vMax = std::max(vMax, (int)component.vSampFactor);
+        }
+
+        // dequantize and inverse transform every block into a plane per component
+        std::vector<cv::Mat> planes;
+        float coefficients[64], samples[64];
+        for (const Component &component : m_components)
+        {
+            cv::Mat plane(component.blocksPerColumn * 8, component.blocksPerLine * 8, CV_8UC1);
+            const UInt16 *QTable = m_QTables[component.QTableNo];
+            for (int by = 0; by < component.blocksPerColumn; ++by)
+                for (int bx = 0; bx < component.blocksPerLine; ++bx)
+                {
+                    const Int16 *block = component.block(bx, by);
+                    for (int k = 0; k < 64; ++k)
+                    {
+                        std::pair<int, int> coord = zzOrderToMatIndices(k);
+                        coefficients[coord.first * 8 + coord.second] = (float)block[k] * QTable[k];
+                    }
+                    cv::Mat DCTBlock(8, 8, CV_32F, coefficients), sampleBlock(8, 8, CV_32F, samples);
+                    cv::idct(DCTBlock, sampleBlock);
+                    for (int y = 0; y < 8; ++y)
+                        for (int x = 0; x < 8; ++x)
+                            plane.at<UInt8>(by * 8 + y, bx * 8 + x) = cv::saturate_cast<UInt8>(samples[y * 8 + x] + 128.0f);
+                }
+            planes.push_back(plane);
+        }
+
+        // upsample by replication and convert YCbCr to BGR (JFIF, page 3)
+        cv::Mat image(m_height, m_width, CV_8UC3);
+        for (int y = 0; y < m_height; ++y)
+            for (int x = 0; x < m_width; ++x)
+            {
+                float values[3];
+                for (size_t c = 0; c < 3; ++c)
+                {
+                    const Component &component = m_components[std::min(c, m_components.size() - 1)];
+                    const cv::Mat &plane = planes[std::min(c, planes.size() - 1)];
+                    values[c] = plane.at<UInt8>(y * component.vSampFactor / vMax, x * component.hSampFactor / hMax);
+                }
+                cv::Vec3b &bgr = image.at<cv::Vec3b>(y, x);
+                if (m_components.size() < 3)
+                {
+                    bgr[0] = bgr[1] = bgr[2] = (UInt8)values[0];
+                    continue;
+                }
+                float Y = values[0], Cb = values[1] - 128.0f, Cr = values[2] - 128.0f;
+                bgr[2] = cv::saturate_cast<UInt8>(Y + 1.402f * Cr);
+                bgr[1] = cv::saturate_cast<UInt8>(Y - 0.344136f * Cb - 0.714136f * Cr);
+                bgr[0] = cv::saturate_cast<UInt8>(Y + 1.772f * Cb);
+            }
+        return image;
+    }
+}
@@ -0,0 +1,377 @@
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "opencv2/imgcodecs.hpp"
+#include "EncodeServer.hpp"
+#include "Encoder.hpp"
+#include "OutputSink.hpp"
+#include "Utility.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        /// largest accepted payload (a 16384 x 16384 BGR image)
+        const size_t MAX_PAYLOAD_SIZE = (size_t)16384 * 16384 * 3;
+
+        bool readFully(int fd, void *data, size_t size)
+        {
+            char *bytes = static_cast<char *>(data);
+            while (size > 0)
+            {
+                ssize_t count = ::recv(fd, bytes, size, 0);
+                if (count <= 0)
+                    return false;
+                bytes += count;
+                size -= count;
+            }
+            return true;
+        }
+
+        bool writeFully(int fd, const void *data, size_t size)
+        {
+            const char *bytes = static_cast<const char *>(data);
+            while (size > 0)
+            {
+                ssize_t count = ::send(fd, bytes, size, MSG_NOSIGNAL);
+                if (count <= 0)
+                    return false;
+                bytes += count;
+                size -= count;
+            }
+            return true;
+        }
+
+        bool sendResponse(int fd, UInt32 status, const char *payload, size_t size)
+        {
+            ResponseHeader header;
+            header.status = status;
+            header.payloadSize = size;
+            return writeFully(fd, &header, sizeof(header)) && writeFully(fd, payload, size);
+        }
+
+        bool makeSocketAddress(const std::string &path, sockaddr_un &address)
+        {
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+                return false;
+            std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+            return true;
+        }
+    }
+
+    EncodeServer::EncodeServer(unsigned threads) : m_threads(threads)
+    {
+        if (m_threads == 0)
+            m_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        // the encoder contexts are built once, not per request
+        for (unsigned k = 0; k < m_threads; ++k)
+            m_encoders.emplace_back(new Encoder());
+    }
+
+    EncodeServer::~EncodeServer()
+    {
+        if (m_listenFd >= 0)
+        {
+            ::close(m_listenFd);
+            ::unlink(m_socketPath.c_str());
+        }
+    }
+
+    bool EncodeServer::open(const std::string &socketPath)
+    {
+        sockaddr_un address;
+        if (!makeSocketAddress(socketPath, address))
+        {
+            logFile << "Socket path too long: \'" + socketPath + "\'" << std::endl;
+            return false;
+        }
+
+        m_listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        ::unlink(socketPath.c_str());
+        if (m_listenFd < 0 || ::bind(m_listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(m_listenFd, 64) != 0)
+        {
+            logFile << "Unable to listen on socket: \'" + socketPath + "\' (" << std::strerror(errno) << ")" << std::endl;
+            if (m_listenFd >= 0)
+                ::close(m_listenFd);
+            m_listenFd = -1;
+            return false;
+        }
+
+        m_socketPath = socketPath;
+        logFile << "Listening on \'" + socketPath + "\' with " << m_threads << " workers" << std::endl;
+        return true;
+    }
+
+    void EncodeServer::serve(const std::atomic<bool> &stop)
+    {
+        m_startTime = std::chrono::steady_clock::now();
+        m_stopping = false;
+
+        std::vector<std::thread> workers;
+        for (unsigned k = 0; k < m_threads; ++k)
+            workers.emplace_back(&EncodeServer::worker, this, std::ref(*m_encoders[k]));
+
+        // accept connections until stopped, wake up regularly to check the flag and log the statistics
+        auto lastReport = std::chrono::steady_clock::now();
+        size_t reportedRequests = 0;
+        while (!stop && m_listenFd >= 0)
+        {
+            pollfd listenPoll{m_listenFd, POLLIN, 0};
+            if (::poll(&listenPoll, 1, 200) > 0)
+            {
+                int fd = ::accept(m_listenFd, nullptr, nullptr);
+                if (fd >= 0)
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_connections.push_back(fd);
+                    std::lock_guard<std::mutex> statsLock(m_statsMutex);
+                    m_stats.queueDepth = m_connections.size();
+                    m_stats.maxQueueDepth = std::max(m_stats.maxQueueDepth, m_stats.queueDepth);
+                }
+                m_connectionCond.notify_one();
+            }
+
+            if (std::chrono::steady_clock::now() - lastReport > std::chrono::seconds(10))
+            {
+                Stats current = stats();
+                if (current.requests != reportedRequests)
+                    logFile << statsString() << std::endl;
+                reportedRequests = current.requests;
+                lastReport = std::chrono::steady_clock::now();
+            }
+        }
+
+        // wake up the workers, including those waiting on an idle connection
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            for (int fd : m_activeConnections)
+                ::shutdown(fd, SHUT_RDWR);
+            for (int fd : m_connections)
+                ::close(fd);
+            m_connections.clear();
+        }
+        m_connectionCond.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+
+        logFile << statsString() << std::endl;
+        ::close(m_listenFd);
+        ::unlink(m_socketPath.c_str());
+        m_listenFd = -1;
+    }
+
+    void EncodeServer::worker(Encoder &encoder)
+    {
+        MemorySink output;
+        // the messages of every request are dropped, the log file only gets the server statistics
+        std::ostringstream log;
+        encoder.setLogStream(&log);
+
+        while (true)
+        {
+            int fd;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_connectionCond.wait(lock, [&] { return m_stopping || !m_connections.empty(); });
+                if (m_stopping)
+                    break;
+                fd = m_connections.front();
+                m_connections.pop_front();
+                m_activeConnections.insert(fd);
+                std::lock_guard<std::mutex> statsLock(m_statsMutex);
+                m_stats.queueDepth = m_connections.size();
+            }
+
+            while (handleRequest(fd, encoder, output))
+                log.str("");
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_activeConnections.erase(fd);
+            }
+            ::close(fd);
+        }
+
+        encoder.setLogStream(nullptr);
+    }
+
+    bool EncodeServer::handleRequest(int fd, Encoder &encoder, MemorySink &output)
+    {
+        RequestHeader header;
+        if (!readFully(fd, &header, sizeof(header)))
+            return false;
+        auto start = std::chrono::steady_clock::now();
+
+        if (header.magic != SERVER_MAGIC || header.payloadSize > MAX_PAYLOAD_SIZE)
+        {
+            const char message[] = "invalid request";
+            sendResponse(fd, 1, message, sizeof(message) - 1);
+            recordRequest(false, 0, 0);
+            return false;
+        }
+
+        std::vector<char> payload(header.payloadSize);
+        if (!readFully(fd, payload.data(), payload.size()))
+            return false;
+
+        if (header.type == SERVER_STATS)
+        {
+            std::string text = statsString();
+            return sendResponse(fd, 0, text.data(), text.size());
+        }
+
+        cv::Mat image;
+        std::string error;
+        if (header.type == RAW_PIXELS)
+        {
+            if ((size_t)header.width * header.height * 3 != payload.size() || payload.empty())
+                error = "the payload size does not match the image size";
+            else
+                image = cv::Mat(header.height, header.width, CV_8UC3, payload.data());
+        }
+        else if (header.type == FILE_PATH)
+        {
+            image = cv::imread(std::string(payload.begin(), payload.end()), cv::IMREAD_COLOR);
+            if (image.empty())
+                error = "cannot read the image file";
+        }
+        else
+        {
+            error = "unknown request type";
+        }
+
+        if (error.empty())
+        {
+            encoder.setQuality(std::min(std::max((int)header.quality, 1), 100));
+            encoder.setThumbnailEnabled(header.flags & REQUEST_THUMBNAIL);
+            output.reset();
+            if (encoder.encodeFrame(image, output) != Encoder::ResultCode::ENCODE_DONE)
+                error = "encoding failed";
+        }
+
+        bool sent = error.empty() ? sendResponse(fd, 0, output.data(), output.size())
+                                  : sendResponse(fd, 1, error.data(), error.size());
+        double latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        recordRequest(error.empty() && sent, error.empty() ? output.size() : 0, latency);
+        return sent;
+    }
+
+    void EncodeServer::recordRequest(bool succeeded, size_t bytesSent, double latency)
+    {
+        std::lock_guard<std::mutex> lock(m_statsMutex);
+        m_stats.requests++;
+        if (!succeeded)
+            m_stats.failedRequests++;
+        m_stats.bytesSent += bytesSent;
+        m_stats.totalLatency += latency;
+        m_stats.maxLatency = std::max(m_stats.maxLatency, latency);
+    }
+
+    EncodeServer::Stats EncodeServer::stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_statsMutex);
+        Stats current = m_stats;
+        current.uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_startTime).count();
+        return current;
+    }
+
+    std::string EncodeServer::statsString() const
+    {
+        Stats current = stats();
+        std::ostringstream text;
+        text << "Requests: " << current.requests << " (" << current.failedRequests << " failed)"
+             << ", mean latency: " << (current.requests ? 1000.0 * current.totalLatency / current.requests : 0.0) << " ms"
+             << ", max latency: " << 1000.0 * current.maxLatency << " ms"
+             << ", queue depth: " << current.queueDepth << " (max " << current.maxQueueDepth << ")"
+             << ", throughput: " << (current.uptime > 0 ? current.requests / current.uptime : 0.0) << " requests/s, "
+             << (current.uptime > 0 ? current.bytesSent / current.uptime : 0.0) << " bytes/s"
+             << ", uptime: " << current.uptime << " s";
+        return text.str();
+    }
+
+    EncodeClient::~EncodeClient()
+    {
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    bool EncodeClient::connect(const std::string &socketPath)
+    {
+        sockaddr_un address;
+        if (!makeSocketAddress(socketPath, address))
+            return false;
+
+        m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_fd < 0 || ::connect(m_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            if (m_fd >= 0)
+                ::close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    bool EncodeClient::encodeImage(const cv::Mat &image, int quality, bool embedThumbnail, std::vector<char> &jpeg)
+    {
+        if (image.empty() || image.type() != CV_8UC3)
+            return false;
+
+        // the rows are sent back to back
+        cv::Mat pixels = image.isContinuous() ? image : image.clone();
+        RequestHeader header;
+        header.type = RAW_PIXELS;
+        header.quality = quality;
+        header.flags = embedThumbnail ? REQUEST_THUMBNAIL : 0;
+        header.width = pixels.cols;
+        header.height = pixels.rows;
+        header.payloadSize = pixels.rows * pixels.cols * 3;
+        return request(header, reinterpret_cast<const char *>(pixels.data), jpeg);
+    }
+
+    bool EncodeClient::encodeFile(const std::string &path, int quality, bool embedThumbnail, std::vector<char> &jpeg)
+    {
+        RequestHeader header;
+        header.type = FILE_PATH;
+        header.quality = quality;
+        header.flags = embedThumbnail ? REQUEST_THUMBNAIL : 0;
+        header.payloadSize = path.size();
+        return request(header, path.data(), jpeg);
+    }
+
+    bool EncodeClient::stats(std::string &text)
+    {
+        RequestHeader header;
+        header.type = SERVER_STATS;
+        std::vector<char> response;
+        bool succeeded = request(header, nullptr, response);
+        text.assign(response.begin(), response.end());
+        return succeeded;
+    }
+
+    bool EncodeClient::request(const RequestHeader &header, const char *payload, std::vector<char> &response)
+    {
+        ResponseHeader responseHeader;
+        if (m_fd < 0 || !writeFully(m_fd, &header, sizeof(header)) ||
+            !writeFully(m_fd, payload, header.payloadSize) ||
+            !readFully(m_fd, &responseHeader, sizeof(responseHeader)))
+            return false;
+
+        response.resize(responseHeader.payloadSize);
+        if (!readFully(m_fd, response.data(), response.size()))
+            return false;
+        return responseHeader.status == 0;
+    }
+}
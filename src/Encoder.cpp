@@ -1,18 +1,27 @@
 #include <arpa/inet.h> // htons
+#include <algorithm>
+#include <cmath>
 #include <iomanip>
+#include <limits>
 #include <iostream>
 #include <sstream>
 #include <filesystem>
 #include <vector>
 #include <bitset>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #include "opencv2/highgui.hpp"
 #include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
 #include "Encoder.hpp"
 #include "Markers.hpp"
 #include "Utility.hpp"
 #include "Transform.hpp"
+#include "Arena.hpp"
 
 namespace cppeg
 {
@@ -31,37 +40,43 @@ namespace cppeg
             m_QTables[chronminQTableId].push_back((UInt16)defaultCriominQTable[x][y]);
         }
 
-        // initialize Huffman tables
-        constructDefaultHuffmanTables();
+        // initialize Huffman tables and code mappers, the default ones are the first set of the library
+        m_huffmanCoding = &huffmanCodingTables()[0];
 
-        // initialize Huffman code mappers
-        constructDefaultHuffmanCodeMapper();
-
-        logFile << "Created \'Encoder object\'." << std::endl;
+        log() << "Created \'Encoder object\'." << std::endl;
     }
 
     Encoder::~Encoder()
     {
-        if (m_imageFile.is_open())
+        if (m_imageFile.isOpen())
             close();
-        logFile << "Destroyed \'Encoder object\'." << std::endl;
+        log() << "Destroyed \'Encoder object\'." << std::endl;
     }
 
     void Encoder::close()
     {
         m_imageFile.close();
-        logFile << "Closed image file: \'" + m_filename + "\'" << std::endl;
+        log() << "Closed image file: \'" + m_filename + "\'" << std::endl;
     }
 
-    bool Encoder::open(const std::string &iFilename, std::string oFilename)
+    bool Encoder::openImage(const std::string &iFilename)
     {
-
         m_image = cv::imread(iFilename, cv::IMREAD_COLOR);
         if (m_image.empty())
         {
-            logFile << "Cannot read the input image file: \'" + iFilename + "\'" << std::endl;
+            log() << "Cannot read the input image file: \'" + iFilename + "\'" << std::endl;
             return false;
         }
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
+        return true;
+    }
+
+    bool Encoder::open(const std::string &iFilename, std::string oFilename)
+    {
+
+        if (!openImage(iFilename))
+            return false;
 
         if (oFilename == "")
         {
@@ -71,31 +86,931 @@ namespace cppeg
 
         std::cout << "Output file path: \'" << oFilename << "\'" << std::endl;
 
-        m_imageFile.open(oFilename, std::ios::out | std::ios::binary);
-
-        if (!m_imageFile.is_open() || !m_imageFile.good())
+        if (!m_imageFile.open(oFilename))
         {
-            logFile << "Unable to open output image: \'" + oFilename + "\'" << std::endl;
+            log() << "Unable to open output image: \'" + oFilename + "\'" << std::endl;
             return false;
         }
 
-        logFile << "Opened JPEG image: \'" + oFilename + "\'" << std::endl;
+        log() << "Opened JPEG image: \'" + oFilename + "\'" << std::endl;
 
         m_filename = oFilename;
+        m_output = &m_imageFile;
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
         return true;
     }
 
     Encoder::ResultCode Encoder::encodeImageFile()
     {
 
-        if (!m_imageFile.is_open() || !m_imageFile.good())
+        if (!m_imageFile.isOpen() || !m_imageFile.good())
+        {
+            log() << "Unable scan image file: \'" + m_filename + "\'" << std::endl;
+            return ResultCode::ERROR;
+        }
+
+        m_output = &m_imageFile;
+        writeJPEGStream();
+        m_output = nullptr;
+
+        ResultCode status = m_imageFile.close() ? ResultCode::ENCODE_DONE : ResultCode::ERROR;
+
+        return status;
+    }
+
+    Encoder::ResultCode Encoder::encodeFrame(const cv::Mat &frame, std::ostream &output)
+    {
+        StreamSink sink(output);
+        return encodeFrame(frame, sink);
+    }
+
+    Encoder::ResultCode Encoder::encodeFrame(const cv::Mat &frame, OutputSink &output)
+    {
+        if (frame.empty() || frame.type() != CV_8UC3 || !output.good())
+        {
+            log() << "Unable to encode frame: expected a non-empty 8-bit BGR image" << std::endl;
+            return ResultCode::ERROR;
+        }
+
+        // the frame is only referenced, its pixels are never copied
+        m_image = frame;
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
+        m_output = &output;
+        writeJPEGStream();
+        m_output->flush();
+        m_output = nullptr;
+
+        return output.good() ? ResultCode::ENCODE_DONE : ResultCode::ERROR;
+    }
+
+    Encoder::ResultCode Encoder::encodeFrameIncremental(const cv::Mat &frame,
+                                                        std::ostream &output,
+                                                        const std::vector<cv::Rect> &dirtyRects)
+    {
+        StreamSink sink(output);
+        return encodeFrameIncremental(frame, sink, dirtyRects);
+    }
+
+    Encoder::ResultCode Encoder::encodeFrameIncremental(const cv::Mat &frame,
+                                                        OutputSink &output,
+                                                        const std::vector<cv::Rect> &dirtyRects)
+    {
+        if (frame.empty() || frame.type() != CV_8UC3 || !output.good())
+        {
+            log() << "Unable to encode frame: expected a non-empty 8-bit BGR image" << std::endl;
+            return ResultCode::ERROR;
+        }
+
+        m_image = frame;
+        m_imageIsYCrCb = false;
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
+        prepareMCUGrid();
+        selectHuffmanTables();
+
+        CoefficientStore &store = m_coefficientStore;
+        size_t MCUCount = (size_t)m_hBlockNum * m_vBlockNum;
+        bool reuseStore = store.valid && store.width == frame.cols && store.height == frame.rows;
+        if (!reuseStore)
+        {
+            store.width = frame.cols;
+            store.height = frame.rows;
+            store.blockHashes.assign(MCUCount, 0);
+            store.coefficients.resize(MCUCount * 3 * 64);
+            store.nonzeroMasks.resize(MCUCount * 3);
+            store.squaredErrors.resize(MCUCount * 3);
+            store.DCCoefficients.resize(MCUCount * 3);
+        }
+
+        // MCUs to transform when the dirty regions are given
+        std::vector<UInt8> dirtyBlocks;
+        if (reuseStore && !dirtyRects.empty())
+        {
+            dirtyBlocks.assign(MCUCount, 0);
+            for (const cv::Rect &rect : dirtyRects)
+            {
+                cv::Rect clipped = rect & cv::Rect(0, 0, frame.cols, frame.rows);
+                if (clipped.empty())
+                    continue;
+                for (int j = clipped.y / 8; j <= (clipped.y + clipped.height - 1) / 8; ++j)
+                    for (int i = clipped.x / 8; i <= (clipped.x + clipped.width - 1) / 8; ++i)
+                        dirtyBlocks[(size_t)j * m_hBlockNum + i] = 1;
+            }
+        }
+
+        size_t changedMCUs = 0;
+        ArenaStats arenaBefore = threadArena().stats();
+        float coefficients[3 * 64];
+        for (int j = 0; j < m_vBlockNum; ++j)
+        {
+            threadArena().reset();
+            for (int i = 0; i < m_hBlockNum; ++i)
+            {
+                size_t n = (size_t)j * m_hBlockNum + i;
+                if (!dirtyBlocks.empty() && !dirtyBlocks[n])
+                    continue;
+
+                cv::Mat MCUblock = MCUBlock(i, j);
+                UInt64 hash = BlockCache::hashBlock(MCUblock, false);
+                if (reuseStore && store.blockHashes[n] == hash)
+                    continue;
+
+                UInt8 flatChannels = m_rlc.MCUToDCTCoefficients(MCUblock, coefficients);
+                std::fill(&store.squaredErrors[n * 3], &store.squaredErrors[n * 3] + 3, 0.0);
+                m_rlc.quantizeMCU(coefficients, &store.coefficients[n * 3 * 64], &store.nonzeroMasks[n * 3], flatChannels,
+                                  &store.squaredErrors[n * 3]);
+                for (int c = 0; c < 3; ++c)
+                    store.DCCoefficients[n * 3 + c] = coefficients[c * 64];
+                store.blockHashes[n] = hash;
+                changedMCUs++;
+            }
+        }
+        store.valid = true;
+
+        // the thumbnail is filled from the store, as the DC image is rebuilt by every other encode
+        if (!m_DCImage.empty())
+            for (int j = 0; j < m_vBlockNum; ++j)
+                for (int i = 0; i < m_hBlockNum; ++i)
+                    collectDCTerm(i, j, &store.DCCoefficients[((size_t)j * m_hBlockNum + i) * 3], 1);
+
+        // entropy coding of the whole scan from the kept coefficients
+        beginScan();
+        m_stats.changedMCUs = changedMCUs;
+        for (size_t n = 0; n < MCUCount; ++n)
+        {
+            m_rlc.quantizedMCUToRLC(&store.coefficients[n * 3 * 64], &store.nonzeroMasks[n * 3],
+                                    m_runLengthCode, m_curDCValues, m_prevDCValues);
+            RLCToBitString(m_runLengthCode, m_scanData);
+            m_prevDCValues = m_curDCValues;
+            m_stats.MCUCount++;
+            for (int c = 0; c < 3; ++c)
+                m_stats.squaredErrors[c] += store.squaredErrors[n * 3 + c];
+        }
+        addArenaStats(arenaBefore);
+
+        m_output = &output;
+        writeHeaderSegments();
+        writeScanBits();
+        m_output->flush();
+        m_output = nullptr;
+
+        return output.good() ? ResultCode::ENCODE_DONE : ResultCode::ERROR;
+    }
+
+    size_t Encoder::measureFrame(const cv::Mat &frame)
+    {
+        if (frame.empty() || frame.type() != CV_8UC3)
+        {
+            log() << "Unable to measure frame: expected a non-empty 8-bit BGR image" << std::endl;
+            return 0;
+        }
+
+        m_image = frame;
+        m_imageIsYCrCb = false;
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
+        prepareMCUGrid();
+        selectHuffmanTables();
+
+        // same coefficient pipeline as encodeScan(), but the codes only go through the meter
+        ScanMeter meter;
+        float MCUCoefficients[3 * 64];
+        beginScan();
+        ArenaStats arenaBefore = threadArena().stats();
+        for (int j = 0; j < m_vBlockNum; ++j)
+        {
+            threadArena().reset();
+            for (int i = 0; i < m_hBlockNum; ++i)
+            {
+                cv::Mat MCUblock = MCUBlock(i, j);
+                UInt8 flatChannels = m_rlc.MCUToDCTCoefficients(MCUblock, MCUCoefficients);
+                collectDCTerm(i, j, MCUCoefficients);
+                m_rlc.DCTCoefficientsToRLC(MCUCoefficients, m_runLengthCode, m_curDCValues, m_prevDCValues, flatChannels,
+                                           m_stats.squaredErrors);
+                RLCToMeter(m_runLengthCode, meter);
+                m_prevDCValues = m_curDCValues;
+                m_stats.MCUCount++;
+                m_stats.flatBlocks += (flatChannels & 1) + ((flatChannels >> 1) & 1) + ((flatChannels >> 2) & 1);
+            }
+        }
+        addArenaStats(arenaBefore);
+
+        // the headers (a few hundred bytes, or the thumbnail) are built in memory
+        MemorySink headerSink;
+        m_output = &headerSink;
+        writeHeaderSegments();
+        m_output = nullptr;
+
+        size_t totalBytes = headerSink.size() + meter.finish() + 2; // EOI marker
+        log() << "Measured size: " << totalBytes << " bytes" << std::endl;
+        return totalBytes;
+    }
+
+    void Encoder::addHuffmanStatistics(const cv::Mat &frame, HuffmanStatistics &statistics)
+    {
+        if (frame.empty() || frame.type() != CV_8UC3)
+        {
+            log() << "Unable to count the Huffman symbols: expected a non-empty 8-bit BGR image" << std::endl;
+            return;
+        }
+
+        m_image = frame;
+        m_imageIsYCrCb = false;
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
+        prepareMCUGrid();
+        sampleHuffmanStatistics(statistics, m_vBlockNum, 1);
+    }
+
+    Encoder::ResultCode Encoder::encodeImageFileToSize(size_t targetBytes)
+    {
+        if (!m_imageFile.isOpen() || !m_imageFile.good())
+        {
+            log() << "Unable scan image file: \'" + m_filename + "\'" << std::endl;
+            return ResultCode::ERROR;
+        }
+
+        log() << "Searching the quality for a target size of " << targetBytes << " bytes..." << std::endl;
+
+        // the DCT coefficients do not depend on the quality, compute them only once
+        computeDCTCoefficients();
+
+        // the headers do not depend on the quality either (8-bit tables), so the
+        // size of the file is the header size plus the size of the scan data
+        MemorySink headerSink;
+        m_output = &headerSink;
+        writeHeaderSegments();
+        size_t headerBytes = headerSink.size() + 2; // EOI marker
+
+        // binary search the highest quality whose size fits, the measured
+        // sizes are exact (byte stuffing included) so no candidate is encoded
+        int lowQuality = 1, highQuality = 100, bestQuality = 1;
+        while (lowQuality <= highQuality)
+        {
+            int quality = (lowQuality + highQuality) / 2;
+            setQuality(quality);
+            // the size of the DHT segment does not depend on the table set (every set codes every symbol)
+            selectHuffmanTables();
+            size_t measuredBytes = headerBytes + countScanBytes();
+            log() << "Quality " << quality << ": " << measuredBytes << " bytes" << std::endl;
+            if (measuredBytes <= targetBytes)
+            {
+                bestQuality = quality;
+                lowQuality = quality + 1;
+            }
+            else
+            {
+                highQuality = quality - 1;
+            }
+        }
+
+        setQuality(bestQuality);
+        m_output = &m_imageFile;
+        writeJPEGStream();
+        m_output = nullptr;
+        size_t writtenBytes = m_imageFile.size();
+        m_imageFile.close();
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
+
+        log() << "Chose quality " << m_quality << ": " << writtenBytes << " bytes" << std::endl;
+        if (writtenBytes > targetBytes)
+        {
+            log() << "Unable to reach the target size even with the lowest quality" << std::endl;
+            return ResultCode::ENCODE_INCOMPLETE;
+        }
+        return ResultCode::ENCODE_DONE;
+    }
+
+    std::vector<Encoder::ResultCode> Encoder::encodeImageVariants(const std::vector<Variant> &variants)
+    {
+        std::vector<ResultCode> results(variants.size(), ResultCode::ERROR);
+        if (m_image.empty() || variants.empty())
+        {
+            log() << "No image opened or no variant requested, unable to encode variants" << std::endl;
+            return results;
+        }
+
+        log() << "Encoding " << variants.size() << " variants with a shared DCT pass..." << std::endl;
+
+        // one encoder per variant holds the tables and the scan data of that variant
+        std::vector<std::unique_ptr<Encoder>> encoders;
+        for (const Variant &variant : variants)
+        {
+            encoders.emplace_back(new Encoder());
+            encoders.back()->m_image = m_image;
+            encoders.back()->prepareMCUGrid();
+            encoders.back()->setQuality(variant.quality);
+            encoders.back()->beginScan();
+        }
+
+        prepareMCUGrid();
+        int hBlockNum = m_hBlockNum, vBlockNum = m_vBlockNum;
+        size_t stripeSize = (size_t)hBlockNum * 3 * 64;
+
+        // the DCT coefficients of a row of MCUs (a stripe) are computed once on
+        // this thread and shared by the variant workers through a small ring of
+        // stripes, so the image is traversed only once with bounded memory
+        const int ringSize = 4;
+        std::vector<std::vector<float>> stripes(ringSize, std::vector<float>(stripeSize));
+        std::vector<std::vector<UInt8>> stripeFlatChannels(ringSize, std::vector<UInt8>(hBlockNum));
+        std::mutex mutex;
+        std::condition_variable stripeCond;
+        int readyStripes = 0;
+        std::vector<int> doneStripes(variants.size(), 0);
+
+        auto variantWorker = [&](size_t v) {
+            Encoder &encoder = *encoders[v];
+            Arena &arena = threadArena();
+            ArenaStats arenaBefore = arena.stats();
+            for (int j = 0; j < vBlockNum; ++j)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    stripeCond.wait(lock, [&] { return readyStripes > j; });
+                }
+                arena.reset();
+                const float *coefficients = stripes[j % ringSize].data();
+                const UInt8 *flatChannels = stripeFlatChannels[j % ringSize].data();
+                for (int i = 0; i < hBlockNum; ++i)
+                {
+                    encoder.encodeMCUCoefficients(coefficients + (size_t)i * 3 * 64, flatChannels[i]);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    doneStripes[v] = j + 1;
+                }
+                stripeCond.notify_all();
+            }
+            encoder.addArenaStats(arenaBefore);
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t v = 0; v < variants.size(); ++v)
+            workers.emplace_back(variantWorker, v);
+
+        for (int j = 0; j < vBlockNum; ++j)
+        {
+            {
+                // wait until every variant released the stripe that is overwritten
+                std::unique_lock<std::mutex> lock(mutex);
+                stripeCond.wait(lock, [&] {
+                    return *std::min_element(doneStripes.begin(), doneStripes.end()) > j - ringSize;
+                });
+            }
+            threadArena().reset();
+            float *coefficients = stripes[j % ringSize].data();
+            UInt8 *flatChannels = stripeFlatChannels[j % ringSize].data();
+            for (int i = 0; i < hBlockNum; ++i)
+            {
+                cv::Mat MCUblock = MCUBlock(i, j);
+                flatChannels[i] = m_rlc.MCUToDCTCoefficients(MCUblock, coefficients + (size_t)i * 3 * 64, m_imageIsYCrCb);
+                collectDCTerm(i, j, coefficients + (size_t)i * 3 * 64);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                readyStripes = j + 1;
+            }
+            stripeCond.notify_all();
+        }
+
+        for (std::thread &worker : workers)
+            worker.join();
+
+        // write the variants, only the headers and the bit packing are left
+        for (size_t v = 0; v < variants.size(); ++v)
+        {
+            Encoder &encoder = *encoders[v];
+            encoder.m_embedThumbnail = m_embedThumbnail;
+            encoder.m_DCImage = m_DCImage;
+            if (encoder.writeJPEGFile(variants[v].filename))
+                results[v] = ResultCode::ENCODE_DONE;
+        }
+
+        return results;
+    }
+
+    std::vector<Encoder::ResultCode> Encoder::encodeImageLadder(const std::vector<LadderLevel> &levels)
+    {
+        std::vector<ResultCode> results(levels.size(), ResultCode::ERROR);
+        if (m_image.empty() || levels.empty())
+        {
+            log() << "No image opened or no level requested, unable to encode the ladder" << std::endl;
+            return results;
+        }
+
+        prepareMCUGrid();
+        UInt8 MCUsize = 8;
+        int hBlcokNum = m_hBlockNum, vBlockNum = m_vBlockNum;
+
+        // a YCrCb plane per downscaled level, each MCU contributes a block of 8 / scaleDenom pixels
+        bool encodeFullLevel = false;
+        std::vector<cv::Mat> planes(levels.size());
+        for (size_t l = 0; l < levels.size(); ++l)
+        {
+            int denom = levels[l].scaleDenom;
+            if (denom != 1 && denom != 2 && denom != 4 && denom != 8)
+            {
+                log() << "Unsupported ladder scale 1/" << denom << std::endl;
+                continue;
+            }
+            if (denom == 1)
+                encodeFullLevel = true;
+            else
+                planes[l].create(vBlockNum * MCUsize / denom, hBlcokNum * MCUsize / denom, CV_8UC3);
+        }
+
+        log() << "Encoding a resolution ladder of " << levels.size() << " levels in one pass..." << std::endl;
+
+        // the single traversal of the source image
+        float coefficients[3 * 64];
+        float samples[16];
+        beginScan();
+        ArenaStats arenaBefore = threadArena().stats();
+        for (int j = 0; j < vBlockNum; ++j)
+        {
+            threadArena().reset();
+            for (int i = 0; i < hBlcokNum; ++i)
+            {
+                cv::Mat MCUblock = MCUBlock(i, j);
+                m_rlc.MCUToDCTCoefficients(MCUblock, coefficients, m_imageIsYCrCb);
+                collectDCTerm(i, j, coefficients);
+                if (encodeFullLevel)
+                    encodeMCUCoefficients(coefficients);
+
+                for (size_t l = 0; l < levels.size(); ++l)
+                {
+                    if (planes[l].empty())
+                        continue;
+                    int size = MCUsize / levels[l].scaleDenom;
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        scaledInverseDCT(coefficients + c * 64, size, samples);
+
+                        // coefficients are in Y, Cb, Cr order and planes in Y, Cr, Cb order
+                        int channel = c == 0 ? 0 : 3 - c;
+                        for (int y = 0; y < size; ++y)
+                            for (int x = 0; x < size; ++x)
+                                planes[l].at<cv::Vec3b>(j * size + y, i * size + x)[channel] =
+                                    cv::saturate_cast<UInt8>(samples[y * size + x] + 128.0f);
+                    }
+                }
+            }
+        }
+        addArenaStats(arenaBefore);
+
+        for (size_t l = 0; l < levels.size(); ++l)
+        {
+            int denom = levels[l].scaleDenom;
+            if (denom == 1)
+            {
+                if (writeJPEGFile(levels[l].filename))
+                    results[l] = ResultCode::ENCODE_DONE;
+                continue;
+            }
+            if (planes[l].empty())
+                continue;
+
+            // the smaller levels are encoded from their YCrCb planes, cropped to the
+            // downscaled image size, with the same quality as the full resolution
+            int width = (m_image.cols + denom - 1) / denom, height = (m_image.rows + denom - 1) / denom;
+            Encoder encoder;
+            encoder.m_image = planes[l](cv::Rect(0, 0, width, height));
+            encoder.m_imageIsYCrCb = true;
+            encoder.m_embedThumbnail = m_embedThumbnail;
+            encoder.setQuality(m_quality);
+            encoder.encodeScan();
+            if (encoder.writeJPEGFile(levels[l].filename))
+                results[l] = ResultCode::ENCODE_DONE;
+        }
+
+        return results;
+    }
+
+    bool Encoder::writeJPEGFile(const std::string &filename)
+    {
+        if (!m_imageFile.open(filename))
+        {
+            log() << "Unable to open output image: \'" + filename + "\'" << std::endl;
+            return false;
+        }
+        m_filename = filename;
+        m_output = &m_imageFile;
+        writeHeaderSegments();
+        writeScanBits();
+        m_output = nullptr;
+        bool written = m_imageFile.close();
+        log() << "Closed image file: \'" + m_filename + "\'" << std::endl;
+        return written;
+    }
+
+    void Encoder::setThumbnailEnabled(bool enabled)
+    {
+        m_embedThumbnail = enabled;
+    }
+
+    void Encoder::setBlockCacheSize(size_t entries)
+    {
+        m_blockCache.setCapacity(entries);
+    }
+
+    void Encoder::setComponentScans(bool enabled)
+    {
+        m_componentScans = enabled;
+    }
+
+    void Encoder::setPrunedDCT(bool enabled)
+    {
+        m_prunedDCT = enabled;
+    }
+
+    void Encoder::setHuffmanTableSelection(bool enabled)
+    {
+        m_selectHuffmanTables = enabled;
+        if (!enabled)
+            useHuffmanTableSet(0);
+    }
+
+    void Encoder::setKeepQuantizedCoefficients(bool enabled)
+    {
+        m_keepQuantizedCoefficients = enabled;
+    }
+
+    const std::vector<Int16> &Encoder::quantizedCoefficients() const
+    {
+        return m_quantizedCoefficients;
+    }
+
+    bool Encoder::saveQuantizedCoefficients(const std::string &filename)
+    {
+        if (m_quantizedCoefficients.empty())
+        {
+            log() << "No quantized coefficients kept, unable to write '" + filename + "'" << std::endl;
+            return false;
+        }
+        return CoefficientFile::write(filename, m_frameWidth, m_frameHeight, m_quality, m_QTables, m_quantizedCoefficients);
+    }
+
+    Encoder::ResultCode Encoder::encodeCoefficientFile(const CoefficientFile &file, OutputSink &output)
+    {
+        if (!file.isOpen() || !output.good())
+        {
+            log() << "Unable to encode coefficients: no coefficient file opened" << std::endl;
+            return ResultCode::ERROR;
+        }
+
+        const CoefficientFile::Header &header = file.header();
+        m_image.release();
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
+        setFrameSize(header.width, header.height);
+
+        // the tables the coefficients were quantized with
+        for (int t = 0; t < 2; ++t)
+            m_QTables[t].assign(header.QTables[t], header.QTables[t] + 64);
+        m_quality = header.quality;
+        m_rlc.setQTables(m_QTables);
+        m_blockCache.clear();
+        m_coefficientStore.valid = false;
+        m_headerCache.valid = false;
+
+        // the scans are coded before anything is written, so an invalid file writes nothing
+        beginScan();
+        if (m_componentScans)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                m_componentScanData[c].clear();
+                if (!encodeStoredCoefficients(file, c, m_componentScanData[c]))
+                    return ResultCode::ERROR;
+                packScanBits(m_componentScanData[c], m_componentScanBytes[c]);
+            }
+            m_output = &output;
+            writeHeaderSegments(false);
+            writeComponentScans();
+        }
+        else
+        {
+            if (!encodeStoredCoefficients(file, -1, m_scanData))
+                return ResultCode::ERROR;
+            m_output = &output;
+            writeHeaderSegments();
+            writeScanBits();
+        }
+        m_output->flush();
+        m_output = nullptr;
+
+        return output.good() ? ResultCode::ENCODE_DONE : ResultCode::ERROR;
+    }
+
+    bool Encoder::encodeStoredCoefficients(const CoefficientFile &file, int component, std::string &scanData)
+    {
+        int first = component < 0 ? 0 : component, count = component < 0 ? 3 : 1;
+        const HuffmanCodeMapper *DCMappers[3], *ACMappers[3];
+        for (int k = 0; k < count; ++k)
+        {
+            int tableNo = first + k == 0 ? HT_Y : HT_CbCr;
+            DCMappers[k] = &m_huffmanCoding->codeMappers[HT_DC][tableNo];
+            ACMappers[k] = &m_huffmanCoding->codeMappers[HT_AC][tableNo];
+        }
+
+        ChannelRLC runLengthCode;
+        runLengthCode.reserve(80);
+        int prevDCValues[3] = {0, 0, 0};
+        for (int j = 0; j < m_vBlockNum; ++j)
+        {
+            for (int i = 0; i < m_hBlockNum; ++i)
+            {
+                const Int16 *MCU = file.MCU(i, j);
+                for (int k = 0; k < count; ++k)
+                {
+                    int c = first + k;
+                    const Int16 *block = MCU + c * 64;
+                    // the file is not trusted: a value without a Huffman code would leave the tables
+                    if (!RLC::isBaselineBlock(block))
+                    {
+                        log() << "Unable to encode coefficients: block (" << i << ", " << j << ") of component " << c
+                              << " is out of the range of a baseline scan" << std::endl;
+                        return false;
+                    }
+                    m_rlc.zzorderDataToRLC(block[0] - prevDCValues[k], block, RLC::nonzeroACMask(block), runLengthCode);
+                    prevDCValues[k] = block[0];
+                    singleRLCToBitString(runLengthCode, *DCMappers[k], *ACMappers[k], scanData);
+                    // the dequantized DC term is enough for the thumbnail
+                    collectDCTerm(i, j, c, (float)block[0] * m_QTables[c == 0 ? luminQTableId : chronminQTableId][0]);
+                }
+            }
+        }
+        m_stats.MCUCount = (size_t)m_hBlockNum * m_vBlockNum;
+        return true;
+    }
+
+    Encoder::ResultCode Encoder::transcode(const Decoder &source, OutputSink &output, bool keepSourceTables)
+    {
+        const std::vector<Decoder::Component> &components = source.components();
+        if ((components.size() != 1 && components.size() != 3) || !output.good())
+        {
+            log() << "Unable to transcode: expected the coefficients of a stream of 1 or 3 components" << std::endl;
+            return ResultCode::ERROR;
+        }
+
+        // a grayscale source has one block per MCU, its chrominance is flat
+        bool grayscale = components.size() == 1;
+        int hMax = 1, vMax = 1;
+        for (int c = 0; c < 3; ++c)
+        {
+            hSampFactors[c] = grayscale ? 1 : components[c].hSampFactor;
+            vSampFactors[c] = grayscale ? 1 : components[c].vSampFactor;
+            hMax = std::max(hMax, (int)hSampFactors[c]);
+            vMax = std::max(vMax, (int)vSampFactors[c]);
+        }
+        m_image.release();
+        m_DCTCoefficients.clear();
+        m_flatChannels.clear();
+        setFrameSize(source.width(), source.height(), 8 * hMax, 8 * vMax);
+
+        if (keepSourceTables)
+        {
+            for (int t = 0; t < (grayscale ? 1 : 2); ++t)
+            {
+                const UInt16 *table = source.QTable(components[t].QTableNo);
+                for (int i = 0; i < 64; ++i)
+                    m_QTables[t][i] = std::min<UInt16>(table[i], 255);
+            }
+            m_rlc.setQTables(m_QTables);
+            m_blockCache.clear();
+            m_coefficientStore.valid = false;
+            m_headerCache.valid = false;
+        }
+
+        TranscodeFrame frame;
+        double squaredErrors[3] = {0.0, 0.0, 0.0};
+        for (int c = 0; c < 3; ++c)
+        {
+            std::vector<Int16> &requantized = m_transcodedCoefficients[c];
+            if (grayscale && c > 0)
+            {
+                requantized.assign((size_t)m_hBlockNum * m_vBlockNum * 64, 0);
+                frame.coefficients[c] = requantized.data();
+                frame.blocksPerLine[c] = m_hBlockNum;
+                continue;
+            }
+
+            const Decoder::Component &component = components[c];
+            const UInt16 *sourceTable = source.QTable(component.QTableNo);
+            const UInt16 *targetTable = m_QTables[c == 0 ? luminQTableId : chronminQTableId].data();
+            frame.blocksPerLine[c] = component.blocksPerLine;
+            if (std::equal(sourceTable, sourceTable + 64, targetTable))
+            {
+                // same table, the coefficients are coded as they are, if the tables have codes for them
+                for (size_t n = 0; n < component.coefficients.size(); n += 64)
+                {
+                    if (!RLC::isBaselineBlock(&component.coefficients[n]))
+                    {
+                        log() << "Unable to transcode: block " << n / 64 << " of component " << c
+                              << " is out of the range of a baseline scan" << std::endl;
+                        std::fill(hSampFactors, hSampFactors + 3, 1);
+                        std::fill(vSampFactors, vSampFactors + 3, 1);
+                        return ResultCode::ERROR;
+                    }
+                }
+                frame.coefficients[c] = component.coefficients.data();
+                continue;
+            }
+            // the error of each sample of the component, whose blocks cover the area of an MCU
+            squaredErrors[c] = requantizeCoefficients(component.coefficients, sourceTable, targetTable, requantized) /
+                               (hSampFactors[c] * vSampFactors[c]);
+            frame.coefficients[c] = requantized.data();
+        }
+
+        // the whole frame is known, so the table set is chosen from the symbols of all of it
+        if (m_selectHuffmanTables)
+        {
+            HuffmanStatistics statistics;
+            encodeTranscodedMCUs(frame, &statistics);
+            useHuffmanTableSet(chooseHuffmanTableSet(statistics));
+        }
+
+        beginScan();
+        std::copy(squaredErrors, squaredErrors + 3, m_stats.squaredErrors);
+        if (!encodeTranscodedMCUs(frame, nullptr))
         {
-            logFile << "Unable scan image file: \'" + m_filename + "\'" << std::endl;
+            std::fill(hSampFactors, hSampFactors + 3, 1);
+            std::fill(vSampFactors, vSampFactors + 3, 1);
             return ResultCode::ERROR;
         }
 
-        logFile << "Started encoding process..." << std::endl;
+        m_output = &output;
+        writeHeaderSegments();
+        writeScanBits();
+        m_output->flush();
+        m_output = nullptr;
+
+        // the other encodes write one block of each component per MCU
+        std::fill(hSampFactors, hSampFactors + 3, 1);
+        std::fill(vSampFactors, vSampFactors + 3, 1);
+
+        return output.good() ? ResultCode::ENCODE_DONE : ResultCode::ERROR;
+    }
+
+    double Encoder::requantizeCoefficients(const std::vector<Int16> &coefficients, const UInt16 *sourceTable,
+                                           const UInt16 *targetTable, std::vector<Int16> &requantized)
+    {
+        requantized.resize(coefficients.size());
+        double squaredError = 0.0;
+        for (size_t n = 0; n < coefficients.size(); n += 64)
+        {
+            const Int16 *block = &coefficients[n];
+            Int16 *output = &requantized[n];
+            for (int k = 0; k < 64; ++k)
+            {
+                if (block[k] == 0)
+                {
+                    output[k] = 0;
+                    continue;
+                }
+                // dequantize, then round to the nearest step of the target table; an equal step keeps
+                // the value, but it is still clamped to the range of a baseline scan
+                UInt64 magnitude = (UInt64)std::abs(block[k]) * sourceTable[k], step = targetTable[k];
+                int level = (int)std::min<UInt64>((2 * magnitude + step) / (2 * step), 1023);
+                output[k] = block[k] < 0 ? -level : level;
+                double error = (double)magnitude - (double)level * step;
+                squaredError += error * error;
+            }
+        }
+        return squaredError;
+    }
+
+    bool Encoder::encodeTranscodedMCUs(const TranscodeFrame &frame, HuffmanStatistics *statistics)
+    {
+        ChannelRLC runLengthCode;
+        runLengthCode.reserve(80);
+        int prevDCValues[3] = {0, 0, 0};
+        for (int j = 0; j < m_vBlockNum; ++j)
+        {
+            for (int i = 0; i < m_hBlockNum; ++i)
+            {
+                bool sampled = (j * m_hBlockNum + i) % HUFFMAN_SAMPLE_STEP == HUFFMAN_SAMPLE_STEP / 2;
+                for (int c = 0; c < 3; ++c)
+                {
+                    int tableNo = c == 0 ? HT_Y : HT_CbCr;
+                    float DCSum = 0.0f;
+                    for (int v = 0; v < vSampFactors[c]; ++v)
+                    {
+                        for (int h = 0; h < hSampFactors[c]; ++h)
+                        {
+                            size_t blockIndex = (size_t)(j * vSampFactors[c] + v) * frame.blocksPerLine[c] +
+                                                i * hSampFactors[c] + h;
+                            const Int16 *block = frame.coefficients[c] + blockIndex * 64;
+                            int DCDifference = block[0] - prevDCValues[c];
+                            prevDCValues[c] = block[0];
+                            DCSum += block[0];
+                            if (statistics != nullptr && !sampled)
+                                continue;
+
+                            m_rlc.zzorderDataToRLC(DCDifference, block, RLC::nonzeroACMask(block), runLengthCode);
+                            if (statistics != nullptr)
+                                statistics->addRLC(runLengthCode, tableNo);
+                            else if (!singleRLCToBitString(runLengthCode, m_huffmanCoding->codeMappers[HT_DC][tableNo],
+                                                           m_huffmanCoding->codeMappers[HT_AC][tableNo], m_scanData))
+                            {
+                                log() << "Unable to transcode: block " << blockIndex << " of component " << c
+                                      << " has a value without a Huffman code" << std::endl;
+                                return false;
+                            }
+                        }
+                    }
+                    // the mean of the dequantized DC terms of the blocks is enough for the thumbnail
+                    if (statistics == nullptr)
+                        collectDCTerm(i, j, c, DCSum / (hSampFactors[c] * vSampFactors[c]) *
+                                                   m_QTables[c == 0 ? luminQTableId : chronminQTableId][0]);
+                }
+            }
+        }
+        if (statistics == nullptr)
+            m_stats.MCUCount = (size_t)m_hBlockNum * m_vBlockNum;
+        return true;
+    }
+
+    void Encoder::setLogStream(std::ostream *log)
+    {
+        m_log = log;
+    }
+
+    std::ostream &Encoder::log()
+    {
+        return m_log != nullptr ? *m_log : logFile;
+    }
+
+    void Encoder::setQuality(int quality)
+    {
+        quality = std::min(std::max(quality, 1), 100);
+        m_quality = quality;
+
+        // scale the suggested tables the same way as the IJG reference encoder
+        int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+        for (int i = 0; i < 64; ++i)
+        {
+            std::pair<int, int> coord = zzOrderToMatIndices(i);
+            int x = coord.first, y = coord.second;
+            int lumin = (defaultLuminQTAble[x][y] * scale + 50) / 100;
+            int chromin = (defaultCriominQTable[x][y] * scale + 50) / 100;
+            m_QTables[luminQTableId][i] = std::min(std::max(lumin, 1), 255);
+            m_QTables[chronminQTableId][i] = std::min(std::max(chromin, 1), 255);
+        }
+        m_rlc.setQTables(m_QTables);
+        m_blockCache.clear();
+        m_coefficientStore.valid = false;
+        m_headerCache.valid = false;
+    }
+
+    void Encoder::writeJPEGStream()
+    {
+        // the scan is encoded before the headers are written, because
+        // the thumbnail of the APP0 segment is built during the scan
+        if (m_componentScans)
+        {
+            encodeComponentScans();
+            writeHeaderSegments(false);
+            writeComponentScans();
+            return;
+        }
+
+        encodeScan();
+
+        writeHeaderSegments();
+
+        writeScanBits();
+    }
+
+    void Encoder::writeHeaderSegments(bool writeSOS)
+    {
+        log() << "Started encoding process..." << std::endl;
+
+        // the thumbnail changes the APP0 segment of every image
+        if (m_embedThumbnail)
+        {
+            writeLeadingSegments();
+            segmentWriterHandler(JFIF_SOF0, &Encoder::writeSOF0Segment);
+            segmentWriterHandler(JFIF_DHT, &Encoder::writeDHTSegment);
+        }
+        else
+        {
+            if (!m_headerCache.valid)
+                cacheHeaderSegments();
+            m_output->write(m_headerCache.leadingSegments.data(), m_headerCache.leadingSegments.size());
+            segmentWriterHandler(JFIF_SOF0, &Encoder::writeSOF0Segment);
+            m_output->write(m_headerCache.DHTSegment.data(), m_headerCache.DHTSegment.size());
+        }
+
+        if (writeSOS)
+            segmentWriterHandler(JFIF_SOS, &Encoder::writeSOSSegment);
+    }
 
+    void Encoder::writeLeadingSegments()
+    {
         // write SOI marker
         writeMarker(JFIF_SOI);
 
@@ -104,134 +1019,232 @@ namespace cppeg
         writeCOMSegment();
 
         writeDQTSegment();
+    }
 
-        segmentWriterHandler(JFIF_SOF0, &Encoder::writeSOF0Segment);
-
+    void Encoder::cacheHeaderSegments()
+    {
+        log() << "Caching the header segments of the tables" << std::endl;
+
+        OutputSink *output = m_output;
+        m_headerCache.leadingSegments.reset();
+        m_output = &m_headerCache.leadingSegments;
+        writeLeadingSegments();
+        m_headerCache.DHTSegment.reset();
+        m_output = &m_headerCache.DHTSegment;
         segmentWriterHandler(JFIF_DHT, &Encoder::writeDHTSegment);
+        m_output = output;
 
-        segmentWriterHandler(JFIF_SOS, &Encoder::writeSOSSegment);
+        m_headerCache.valid = m_headerCache.leadingSegments.good() && m_headerCache.DHTSegment.good();
+    }
 
-        writeScanData();
+    void Encoder::useHuffmanTableSet(int tableSet)
+    {
+        if (tableSet == m_huffmanTableSet)
+            return;
 
-        m_imageFile.close();
-        UInt8 byte;
-        ResultCode status = ResultCode::ENCODE_DONE;
+        log() << "Using the Huffman table set \'" << huffmanTableSets()[tableSet].name << "\'" << std::endl;
+        m_huffmanCoding = &huffmanCodingTables()[tableSet];
+        m_huffmanTableSet = tableSet;
 
-        return status;
+        // the cached blocks and segments hold the codes of the previous tables
+        m_blockCache.clear();
+        m_headerCache.valid = false;
     }
 
-    void Encoder::constructDefaultHuffmanCodeMapper()
+    void Encoder::selectHuffmanTables()
     {
-        logFile << "Constructing default Huffman codes mapper from the deafult table" << std::endl;
+        if (!m_selectHuffmanTables)
+            return;
 
-        logFile << "Luminance DC Huffman table:" << std::endl;
-        m_huffmanCodeMapper[HT_DC][HT_Y] = huffmanTableArraysToHuffmanMapper(defaultBitsDCLuminanceCat, defaultValDCLuminanceCat);
-        logFile << "Luminance AC Huffman table:" << std::endl;
-        m_huffmanCodeMapper[HT_AC][HT_Y] = huffmanTableArraysToHuffmanMapper(defaultBitsACLuminance, defaultValACLuminance);
-        logFile << "Chrominance DC Huffman table:" << std::endl;
-        m_huffmanCodeMapper[HT_DC][HT_CbCr] = huffmanTableArraysToHuffmanMapper(defaultBitsDCChrominanceCat, defaultValDCChrominanceCat);
-        logFile << "Chrominance AC Huffman table:" << std::endl;
-        m_huffmanCodeMapper[HT_AC][HT_CbCr] = huffmanTableArraysToHuffmanMapper(defaultBitsACChrominance, defaultValACChrominance);
+        HuffmanStatistics statistics;
+        sampleHuffmanStatistics(statistics, HUFFMAN_SAMPLE_STRIPES, HUFFMAN_SAMPLE_STEP);
+        useHuffmanTableSet(chooseHuffmanTableSet(statistics));
     }
 
-    void Encoder::constructDefaultHuffmanTables()
+    void Encoder::sampleHuffmanStatistics(HuffmanStatistics &statistics, int stripeCount, int step)
     {
-        logFile << "Constructing default Huffman tables from the default table" << std::endl;
+        bool useCachedCoefficients = !m_DCTCoefficients.empty();
+        auto isSampled = [&](int i) { return i % step == step / 2; };
+
+        float MCUCoefficients[3 * 64];
+        Int16 zzorderData[3 * 64];
+        UInt64 nonzeroMasks[3];
+        ChannelRLC runLengthCode;
+        // DC values of the last transformed MCU, and its index in the scan
+        int prevDCValues[3] = {0, 0, 0};
+        size_t prevMCU = (size_t)-1;
+        for (int j = 0; j < std::min(stripeCount, m_vBlockNum); ++j)
+        {
+            threadArena().reset();
+            for (int i = 0; i < m_hBlockNum; ++i)
+            {
+                // an MCU preceding a sampled MCU only gives the prediction of its DC
+                if (!isSampled(i) && !isSampled((i + 1) % m_hBlockNum))
+                    continue;
+
+                size_t n = (size_t)j * m_hBlockNum + i;
+                const float *coefficients = MCUCoefficients;
+                UInt8 flatChannels;
+                if (useCachedCoefficients)
+                {
+                    coefficients = &m_DCTCoefficients[n * 3 * 64];
+                    flatChannels = m_flatChannels[n];
+                }
+                else
+                {
+                    flatChannels = m_rlc.MCUToDCTCoefficients(MCUBlock(i, j), MCUCoefficients, m_imageIsYCrCb);
+                }
+                m_rlc.quantizeMCU(coefficients, zzorderData, nonzeroMasks, flatChannels);
 
-        m_huffmanTable[HT_DC][HT_Y] = huffmanTableArraysToHuffmanTable(defaultBitsDCLuminanceCat, defaultValDCLuminanceCat);
-        m_huffmanTable[HT_AC][HT_Y] = huffmanTableArraysToHuffmanTable(defaultBitsACLuminance, defaultValACLuminance);
-        m_huffmanTable[HT_DC][HT_CbCr] = huffmanTableArraysToHuffmanTable(defaultBitsDCChrominanceCat, defaultValDCChrominanceCat);
-        m_huffmanTable[HT_AC][HT_CbCr] = huffmanTableArraysToHuffmanTable(defaultBitsACChrominance, defaultValACChrominance);
+                bool predicted = prevMCU + 1 == n;
+                for (int c = 0; c < 3; ++c)
+                {
+                    const Int16 *block = zzorderData + c * 64;
+                    int tableNo = c == 0 ? HT_Y : HT_CbCr;
+                    if (isSampled(i) && predicted)
+                    {
+                        m_rlc.zzorderDataToRLC(block[0] - prevDCValues[c], block, nonzeroMasks[c], runLengthCode);
+                        statistics.addRLC(runLengthCode, tableNo);
+                    }
+                    prevDCValues[c] = block[0];
+                }
+                prevMCU = n;
+            }
+        }
     }
 
-    std::string Encoder::RLCToBitString(const RLCContainer &RLC)
+    void Encoder::RLCToBitString(const RLCContainer &RLC, std::string &bitString)
     {
 #ifndef NDEBUG
         assert(RLC.size() == 3);
 #endif
 
-        std::string bitString;
-
-        bitString += singleRLCToBitString(RLC[0], m_huffmanCodeMapper[HT_DC][HT_Y], m_huffmanCodeMapper[HT_AC][HT_Y]);
-        bitString += singleRLCToBitString(RLC[1], m_huffmanCodeMapper[HT_DC][HT_CbCr], m_huffmanCodeMapper[HT_AC][HT_CbCr]);
-        bitString += singleRLCToBitString(RLC[2], m_huffmanCodeMapper[HT_DC][HT_CbCr], m_huffmanCodeMapper[HT_AC][HT_CbCr]);
-        return bitString;
+        singleRLCToBitString(RLC[0], m_huffmanCoding->codeMappers[HT_DC][HT_Y], m_huffmanCoding->codeMappers[HT_AC][HT_Y], bitString);
+        singleRLCToBitString(RLC[1], m_huffmanCoding->codeMappers[HT_DC][HT_CbCr], m_huffmanCoding->codeMappers[HT_AC][HT_CbCr], bitString);
+        singleRLCToBitString(RLC[2], m_huffmanCoding->codeMappers[HT_DC][HT_CbCr], m_huffmanCoding->codeMappers[HT_AC][HT_CbCr], bitString);
     }
 
     void Encoder::writeAPP0Segment()
     {
         // write the string 'JFIF\0'
         static const char JFIF_STRING[5]{'J', 'F', 'I', 'F', '\0'};
-        m_imageFile.write(JFIF_STRING, 5);
+        m_output->write(JFIF_STRING, 5);
 
         // write JFIF version (first byte for major version and second byte for minor version)
         static const UInt8 majorVersion = 1;
         static const UInt8 minorVersion = 1;
-        m_imageFile << majorVersion;
-        m_imageFile << minorVersion;
+        m_output->put(majorVersion);
+        m_output->put(minorVersion);
 
         // write pixel unit density (00 for no units, 01 for pixels per inch, 02 for pixels per cm)
         static const UInt8 densityByte = 1;
-        m_imageFile << densityByte;
+        m_output->put(densityByte);
 
         // write horizontal and vertical pixel density
         static const UInt16 xDensity = ntohs(72), yDensity = ntohs(72);
-        m_imageFile.write(reinterpret_cast<const char *>(&xDensity), 2);
-        m_imageFile.write(reinterpret_cast<const char *>(&yDensity), 2);
+        m_output->write(&xDensity, 2);
+        m_output->write(&yDensity, 2);
+
+        // write thumbnail information
+        cv::Mat thumbnail;
+        if (m_embedThumbnail && !m_DCImage.empty())
+            thumbnail = DCImageToThumbnail();
+        UInt8 xThumb = thumbnail.cols, yThumb = thumbnail.rows;
+        m_output->put(xThumb);
+        m_output->put(yThumb);
+        for (int y = 0; y < thumbnail.rows; ++y)
+        {
+            // 24-bit RGB pixels
+            m_output->write(thumbnail.ptr(y), thumbnail.cols * 3);
+        }
+        if (!thumbnail.empty())
+            log() << "Thumbnail: " << thumbnail.cols << "x" << thumbnail.rows << std::endl;
+
+        log() << "Finished writing JPEG/JFIF marker segment (APP-0) [OK]" << std::endl;
+    }
+
+    void Encoder::collectDCTerm(int blockX, int blockY, const float *coefficients, int stride)
+    {
+        if (m_DCImage.empty())
+            return;
+
+        // the DC coefficient of the orthonormal 8x8 DCT is 8 times the mean of the
+        // shifted samples, so the DC terms form an exact 1/8 scale image
+        for (int c = 0; c < 3; ++c)
+            collectDCTerm(blockX, blockY, c, coefficients[c * stride]);
+    }
 
-        // TODO: write thummbnail information
-        UInt8 xThumb = 0, yThumb = 0;
-        m_imageFile << xThumb << yThumb;
+    void Encoder::collectDCTerm(int blockX, int blockY, int component, float DCCoefficient)
+    {
+        if (!m_DCImage.empty())
+            m_DCImage.at<cv::Vec3f>(blockY, blockX)[component] = DCTermToSample(DCCoefficient);
+    }
 
-        logFile << "Finished writing JPEG/JFIF marker segment (APP-0) [OK]" << std::endl;
+    cv::Mat Encoder::DCImageToThumbnail()
+    {
+        // the APP0 segment limits the thumbnail to 255x255 pixels and the
+        // payload to 65535 bytes, shrink the 1/8 scale image to fit if needed
+        const int maxThumbPixels = (0xFFFF - 16) / 3;
+        double scale = std::max({1.0, m_DCImage.cols / 255.0, m_DCImage.rows / 255.0,
+                                 std::sqrt((double)m_DCImage.total() / maxThumbPixels)});
+        int thumbWidth = std::max(1, (int)(m_DCImage.cols / scale));
+        int thumbHeight = std::max(1, (int)(m_DCImage.rows / scale));
+        cv::Mat YCbCr = m_DCImage;
+        if (thumbWidth != m_DCImage.cols || thumbHeight != m_DCImage.rows)
+            cv::resize(m_DCImage, YCbCr, cv::Size(thumbWidth, thumbHeight), 0, 0, cv::INTER_AREA);
+
+        // YCbCr to RGB (JFIF, page 3)
+        cv::Mat thumbnail(thumbHeight, thumbWidth, CV_8UC3);
+        for (int y = 0; y < thumbHeight; ++y)
+        {
+            for (int x = 0; x < thumbWidth; ++x)
+            {
+                const cv::Vec3f &pixel = YCbCr.at<cv::Vec3f>(y, x);
+                float Y = pixel[0], Cb = pixel[1] - 128.0f, Cr = pixel[2] - 128.0f;
+                cv::Vec3b &rgb = thumbnail.at<cv::Vec3b>(y, x);
+                rgb[0] = cv::saturate_cast<UInt8>(Y + 1.402f * Cr);
+                rgb[1] = cv::saturate_cast<UInt8>(Y - 0.344136f * Cb - 0.714136f * Cr);
+                rgb[2] = cv::saturate_cast<UInt8>(Y + 1.772f * Cb);
+            }
+        }
+        return thumbnail;
     }
 
     void Encoder::writeCOMSegment()
     {
-        if (!m_imageFile.is_open() || !m_imageFile.good())
+        if (m_output == nullptr || !m_output->good())
         {
-            logFile << "Unable to write image file: \'" + m_filename + "\'" << std::endl;
+            log() << "Unable to write image file: \'" + m_filename + "\'" << std::endl;
             return;
         }
 
-        logFile << "Writing comment segment )..." << std::endl;
-
-        // write APP0 marker
-        std::streampos segmentBeg = m_imageFile.tellp();
-        writeMarker(JFIF_COM);
-
-        // since the length of segment is not determined, we first
-        // record the position and write an arbitrary length into the file
-        UInt16 lenBtye = 0;
-        m_imageFile.write(reinterpret_cast<const char *>(&lenBtye), 2);
+        log() << "Writing comment segment )..." << std::endl;
 
         // write the comment
-        std::string comment("This image was downloaded from WIkipedia and edited using GIMP");
-        m_imageFile.write(comment.c_str(), comment.length());
-
-        writePayloadLength(segmentBeg);
+        static const std::string comment("This image was downloaded from WIkipedia and edited using GIMP");
+        writeSegment(JFIF_COM, comment.c_str(), comment.length());
 
-        logFile << "Finished writing comment segment [OK]" << std::endl;
+        log() << "Finished writing comment segment [OK]" << std::endl;
     }
 
     void Encoder::writeDQTSegment()
     {
-        if (!m_imageFile.is_open() || !m_imageFile.good())
+        if (m_output == nullptr || !m_output->good())
         {
-            logFile << "Unable scan image file: \'" + m_filename + "\'" << std::endl;
+            log() << "Unable scan image file: \'" + m_filename + "\'" << std::endl;
             return;
         }
 
-        logFile << "Writing DQT segments..." << std::endl;
+        log() << "Writing DQT segments..." << std::endl;
 
         // check if precision is valid
         if (luminQTablePrecision < 0 || luminQTablePrecision > 1)
         {
-            logFile << "Invalid precision for luminance quantization table." << std::endl;
+            log() << "Invalid precision for luminance quantization table." << std::endl;
         }
         if (chronminQTablePrecision < 0 || chronminQTablePrecision > 1)
         {
-            logFile << "Invalid precision for chrominance quantization table." << std::endl;
+            log() << "Invalid precision for chrominance quantization table." << std::endl;
         }
 
         // luminance QT
@@ -240,29 +1253,24 @@ namespace cppeg
         // chrominance QT
         writeQTData(chronminQTablePrecision, chronminQTableId, m_QTables[chronminQTableId]);
 
-        logFile << "Finished writing quantization table segment [OK]" << std::endl;
+        log() << "Finished writing quantization table segment [OK]" << std::endl;
     }
 
     void Encoder::writeQTData(UInt8 precision, UInt8 tableId, const std::vector<UInt16> &QTable)
     {
-        // write the marker
-        std::streampos segmentBeg = m_imageFile.tellp();
-        writeMarker(JFIF_DQT);
-
-        // since the length of segment is not determined, we first
-        // record the position and write an arbitrary length into the file
-        UInt16 lenBtye = 0;
-        m_imageFile.write(reinterpret_cast<const char *>(&lenBtye), 2);
+        // the table is assembled in the segment buffer, then written with its length
+        OutputSink *output = m_output;
+        m_segment.reset();
+        m_output = &m_segment;
 
         // write meta data of the table
         UInt8 PqTq; // first four bits: precision, last four bits: number of qauntization tables
-        logFile << "Writing quantization table..." << std::endl;
-        logFile << "Quantization Table Number: " << (int)tableId << std::endl;
-        logFile << "Precision: " << (precision == 0 ? "8-bit" : "16-bit") << std::endl;
+        log() << "Writing quantization table..." << std::endl;
+        log() << "Quantization Table Number: " << (int)tableId << std::endl;
+        log() << "Precision: " << (precision == 0 ? "8-bit" : "16-bit") << std::endl;
         PqTq = (precision == 0) ? 0 : 1 << 4;
         PqTq |= tableId & 0x0F;
-        // m_imageFile.write(reinterpret_cast<const char *>(&PqTq), 1);
-        m_imageFile << PqTq;
+        m_output->put(PqTq);
 
         // write the elements of quantization table
         for (int i = 0; i < 64; ++i)
@@ -271,50 +1279,54 @@ namespace cppeg
             {
                 // precision = 8 bits
                 UInt8 Qi = m_QTables[tableId][i];
-                m_imageFile << Qi;
+                m_output->put(Qi);
             }
             else if (precision == 1)
             {
                 UInt16 Qi = m_QTables[tableId][i];
                 Qi = ntohs(Qi);
-                m_imageFile.write(reinterpret_cast<const char *>(&Qi), 2);
+                m_output->write(&Qi, 2);
             }
             else
             {
-                logFile << "[ FATAL ] Unrecognized precision of quantization table" << std::endl;
+                log() << "[ FATAL ] Unrecognized precision of quantization table" << std::endl;
+                m_output = output;
                 return;
             }
         }
 
-        writePayloadLength(segmentBeg);
+        m_output = output;
+        writeSegment(JFIF_DQT, m_segment.data(), m_segment.size());
     }
 
     void Encoder::writeSOF0Segment()
     {
-        logFile << "Writing SOF-0 segment..." << std::endl;
+        log() << "Writing SOF-0 segment..." << std::endl;
 
         // write image precision, height, row and component counts
         UInt8 framePrecision = 8, compCount = 3;
-        m_imageFile << framePrecision;
-        UInt16 imgHeight = m_image.rows, imgWidth = m_image.cols;
-        logFile << "Image height: " << (int)imgHeight << std::endl;
-        logFile << "Image width: " << (int)imgWidth << std::endl;
+        m_output->put(framePrecision);
+        UInt16 imgHeight = m_frameHeight, imgWidth = m_frameWidth;
+        log() << "Image height: " << (int)imgHeight << std::endl;
+        log() << "Image width: " << (int)imgWidth << std::endl;
         imgHeight = ntohs(imgHeight);
         imgWidth = ntohs(imgWidth);
-        m_imageFile.write(reinterpret_cast<const char *>(&imgHeight), 2);
-        m_imageFile.write(reinterpret_cast<const char *>(&imgWidth), 2);
-        m_imageFile << compCount;
+        m_output->write(&imgHeight, 2);
+        m_output->write(&imgWidth, 2);
+        m_output->put(compCount);
 
         // write the component data
-        static UInt8 compIDs[3] = {1, 2, 3};
-        static UInt8 QTNos[3] = {0, 1, 1};
+        static const UInt8 compIDs[3] = {1, 2, 3};
+        static const UInt8 QTNos[3] = {0, 1, 1};
         for (int i = 0; i < 3; ++i)
         {
             UInt8 sampFactor = (hSampFactors[i] << 4) | (vSampFactors[i] & 0x0F);
-            m_imageFile << compIDs[i] << sampFactor << QTNos[i];
+            m_output->put(compIDs[i]);
+            m_output->put(sampFactor);
+            m_output->put(QTNos[i]);
         }
 
-        logFile << "Finished writing SOF-0 segment [OK]" << std::endl;
+        log() << "Finished writing SOF-0 segment [OK]" << std::endl;
     }
 
     void Encoder::writeDHTData(HuffmanTable huffmanTable, int HTType, int HTNumber)
@@ -323,172 +1335,579 @@ namespace cppeg
         // check the table type and table no.
         if (HTType != HT_DC && HTType != HT_AC)
         {
-            logFile << "The table type should be either 0 (DC) or 1(AC)!" << std::endl;
+            log() << "The table type should be either 0 (DC) or 1(AC)!" << std::endl;
             return;
         }
 
-        logFile << "Writing Huffman table segment..." << std::endl;
+        log() << "Writing Huffman table segment..." << std::endl;
 
         // write the type and id of the Huffman table
-        logFile << "Huffman table type: " << HTType << std::endl;
-        logFile << "Huffman table #: " << HTNumber << std::endl;
+        log() << "Huffman table type: " << HTType << std::endl;
+        log() << "Huffman table #: " << HTNumber << std::endl;
         UInt8 htinfo = (HTType & 0x0f) << 4 | (HTNumber & 0x0f);
-        m_imageFile << htinfo;
+        m_output->put(htinfo);
 
         // write the Huffman table data
-        logFile << "Writing symbols for Huffman table (" << HTType
-                << "," << HTNumber << ")..." << std::endl;
+        log() << "Writing symbols for Huffman table (" << HTType
+              << "," << HTNumber << ")..." << std::endl;
         for (int i = 0; i < 16; ++i)
         {
             UInt8 symbolCount = huffmanTable[i].first;
-            m_imageFile << symbolCount;
+            m_output->put(symbolCount);
         }
         for (int i = 0; i < 16; ++i)
         {
             std::vector<UInt8> symbols = huffmanTable[i].second;
             for (UInt8 symbol : symbols)
             {
-                m_imageFile << symbol;
+                m_output->put(symbol);
             }
         }
 
-        logFile << "Finished writing Huffman table segment..." << std::endl;
+        log() << "Finished writing Huffman table segment..." << std::endl;
     }
 
     void Encoder::writeDHTSegment()
     {
-        writeDHTData(m_huffmanTable[HT_DC][HT_Y], HT_DC, HT_Y);
-        writeDHTData(m_huffmanTable[HT_AC][HT_Y], HT_AC, HT_Y);
-        writeDHTData(m_huffmanTable[HT_DC][HT_CbCr], HT_DC, HT_CbCr);
-        writeDHTData(m_huffmanTable[HT_AC][HT_CbCr], HT_AC, HT_CbCr);
+        writeDHTData(m_huffmanCoding->tables[HT_DC][HT_Y], HT_DC, HT_Y);
+        writeDHTData(m_huffmanCoding->tables[HT_AC][HT_Y], HT_AC, HT_Y);
+        writeDHTData(m_huffmanCoding->tables[HT_DC][HT_CbCr], HT_DC, HT_CbCr);
+        writeDHTData(m_huffmanCoding->tables[HT_AC][HT_CbCr], HT_AC, HT_CbCr);
     }
 
     void Encoder::writeSOSSegment()
     {
-        // write number of components
-        UInt8 compCount = 3;
-        m_imageFile << compCount;
+        // write number of components, 1 in a non-interleaved scan
+        UInt8 compCount = m_scanComponent < 0 ? 3 : 1;
+        m_output->put(compCount);
 
         // write components data
         UInt16 compInfo;
         UInt8 cID, DCTableNum, ACTableNum;
         // Y components
-        compInfo = 1;
-        DCTableNum = HT_Y;
-        ACTableNum = HT_Y;
-        compInfo = (compInfo << 8) | (DCTableNum << 4) | (ACTableNum);
-        compInfo = ntohs(compInfo);
-        m_imageFile.write(reinterpret_cast<const char *>(&compInfo), 2);
+        if (m_scanComponent < 0 || m_scanComponent == 0)
+        {
+            compInfo = 1;
+            DCTableNum = HT_Y;
+            ACTableNum = HT_Y;
+            compInfo = (compInfo << 8) | (DCTableNum << 4) | (ACTableNum);
+            compInfo = ntohs(compInfo);
+            m_output->write(&compInfo, 2);
+        }
         // Cb components
-        compInfo = 2;
-        DCTableNum = HT_CbCr;
-        ACTableNum = HT_CbCr;
-        compInfo = (compInfo << 8) | (DCTableNum << 4) | (ACTableNum);
-        compInfo = ntohs(compInfo);
-        m_imageFile.write(reinterpret_cast<const char *>(&compInfo), 2);
+        if (m_scanComponent < 0 || m_scanComponent == 1)
+        {
+            compInfo = 2;
+            DCTableNum = HT_CbCr;
+            ACTableNum = HT_CbCr;
+            compInfo = (compInfo << 8) | (DCTableNum << 4) | (ACTableNum);
+            compInfo = ntohs(compInfo);
+            m_output->write(&compInfo, 2);
+        }
         // Cr components
-        compInfo = 3;
-        DCTableNum = HT_CbCr;
-        ACTableNum = HT_CbCr;
-        compInfo = (compInfo << 8) | (DCTableNum << 4) | (ACTableNum);
-        compInfo = ntohs(compInfo);
-        m_imageFile.write(reinterpret_cast<const char *>(&compInfo), 2);
+        if (m_scanComponent < 0 || m_scanComponent == 2)
+        {
+            compInfo = 3;
+            DCTableNum = HT_CbCr;
+            ACTableNum = HT_CbCr;
+            compInfo = (compInfo << 8) | (DCTableNum << 4) | (ACTableNum);
+            compInfo = ntohs(compInfo);
+            m_output->write(&compInfo, 2);
+        }
 
         // Ss, Se, Ah and Al (ITU-T81, page 37)
-        m_imageFile << (UInt8)0x00 << (UInt8)0x3f << (UInt8)0x00;
+        m_output->put(0x00);
+        m_output->put(0x3f);
+        m_output->put(0x00);
+    }
+
+    void Encoder::prepareMCUGrid()
+    {
+        setFrameSize(m_image.cols, m_image.rows);
+    }
+
+    void Encoder::setFrameSize(int width, int height, int MCUWidth, int MCUHeight)
+    {
+        m_frameWidth = width;
+        m_frameHeight = height;
+        m_hBlockNum = (width + MCUWidth - 1) / MCUWidth;
+        m_vBlockNum = (height + MCUHeight - 1) / MCUHeight;
+
+        // one pixel of DC terms per MCU for the thumbnail
+        if (m_embedThumbnail)
+            m_DCImage.create(m_vBlockNum, m_hBlockNum, CV_32FC3);
+        else
+            m_DCImage.release();
     }
 
-    void Encoder::writeScanData()
+    cv::Mat Encoder::MCUBlock(int blockX, int blockY)
     {
-        // padding the image
         UInt8 MCUsize = 8;
-        int padRows = m_image.rows % MCUsize ? MCUsize - (m_image.rows % MCUsize) : 0;
-        int padCols = m_image.cols % MCUsize ? MCUsize - (m_image.cols % MCUsize) : 0;
-        cv::Mat padImg;
-        cv::copyMakeBorder(m_image, padImg, 0, padRows, 0, padCols, cv::BORDER_REPLICATE);
+        int x = blockX * MCUsize, y = blockY * MCUsize;
 
-        // compressed image data
-        int hBlcokNum = padImg.cols / MCUsize, vBlockNum = padImg.rows / MCUsize;
-        std::string scanData;
+        // inner blocks are only referenced, no padded copy of the image is made
+        if (x + MCUsize <= m_image.cols && y + MCUsize <= m_image.rows)
+            return m_image(cv::Rect(x, y, MCUsize, MCUsize));
+
+        // blocks crossing the right or bottom border replicate the last column / row
+        cv::Mat block(MCUsize, MCUsize, m_image.type(), threadArena().allocate(MCUsize * MCUsize * m_image.elemSize()));
+        size_t pixelSize = m_image.elemSize();
+        for (int i = 0; i < MCUsize; ++i)
+        {
+            const UInt8 *row = m_image.ptr<UInt8>(std::min(y + i, m_image.rows - 1));
+            for (int j = 0; j < MCUsize; ++j)
+            {
+                const UInt8 *pixel = row + std::min(x + j, m_image.cols - 1) * pixelSize;
+                std::copy(pixel, pixel + pixelSize, block.ptr<UInt8>(i) + j * pixelSize);
+            }
+        }
+        return block;
+    }
+
+    void Encoder::addArenaStats(const ArenaStats &before)
+    {
+        ArenaStats after = threadArena().stats();
+        m_stats.arenaAllocations += after.allocations - before.allocations;
+        m_stats.arenaHeapAllocations += after.heapAllocations - before.heapAllocations;
+        m_stats.arenaPeakBytes = std::max(m_stats.arenaPeakBytes, after.peakBytes);
+        m_stats.heapAllocations += after.threadHeapAllocations - before.threadHeapAllocations;
+    }
+
+    void Encoder::computeDCTCoefficients()
+    {
+        prepareMCUGrid();
+
+        int hBlcokNum = m_hBlockNum, vBlockNum = m_vBlockNum;
+        m_DCTCoefficients.resize((size_t)hBlcokNum * vBlockNum * 3 * 64);
+        m_flatChannels.resize((size_t)hBlcokNum * vBlockNum);
+        float *coefficients = m_DCTCoefficients.data();
+        UInt8 *flatChannels = m_flatChannels.data();
+        for (int j = 0; j < vBlockNum; ++j)
+        {
+            threadArena().reset();
+            for (int i = 0; i < hBlcokNum; ++i)
+            {
+                cv::Mat MCUblock = MCUBlock(i, j);
+                *flatChannels++ = m_rlc.MCUToDCTCoefficients(MCUblock, coefficients, m_imageIsYCrCb);
+                collectDCTerm(i, j, coefficients);
+                coefficients += 3 * 64;
+            }
+        }
+    }
+
+    size_t Encoder::countScanBytes()
+    {
+        ScanMeter meter;
+        size_t MCUCount = m_DCTCoefficients.size() / (3 * 64);
         std::vector<int> prevDCValues{0, 0, 0}, curDCValues{0, 0, 0};
+        for (size_t n = 0; n < MCUCount; ++n)
+        {
+            if (n % m_hBlockNum == 0)
+                threadArena().reset();
+            m_rlc.DCTCoefficientsToRLC(&m_DCTCoefficients[n * 3 * 64], m_runLengthCode, curDCValues, prevDCValues,
+                                       m_flatChannels[n]);
+            RLCToMeter(m_runLengthCode, meter);
+            prevDCValues = curDCValues;
+        }
+        return meter.finish();
+    }
+
+    void Encoder::RLCToMeter(const RLCContainer &RLC, ScanMeter &meter)
+    {
+        meter.putRLC(RLC[0], m_huffmanCoding->codeTables[HT_DC][HT_Y], m_huffmanCoding->codeTables[HT_AC][HT_Y]);
+        meter.putRLC(RLC[1], m_huffmanCoding->codeTables[HT_DC][HT_CbCr], m_huffmanCoding->codeTables[HT_AC][HT_CbCr]);
+        meter.putRLC(RLC[2], m_huffmanCoding->codeTables[HT_DC][HT_CbCr], m_huffmanCoding->codeTables[HT_AC][HT_CbCr]);
+    }
+
+    void Encoder::encodeScan()
+    {
+        bool useCachedCoefficients = !m_DCTCoefficients.empty();
+        bool useBlockCache = m_blockCache.capacity() != 0 && !m_keepQuantizedCoefficients;
+        if (!useCachedCoefficients)
+            prepareMCUGrid();
+        selectHuffmanTables();
+
+        // compressed image data
+        int hBlcokNum = m_hBlockNum, vBlockNum = m_vBlockNum;
+        beginScan();
+        ArenaStats arenaBefore = threadArena().stats();
+        if (!useCachedCoefficients && !useBlockCache)
+        {
+            // the common case: the specialized loop of the current configuration
+            if (m_keepQuantizedCoefficients)
+                m_quantizedCoefficients.assign((size_t)hBlcokNum * vBlockNum * 3 * 64, 0);
+            (this->*selectBlockEncoder(-1))(m_scanData, m_stats);
+            m_stats.MCUCount = (size_t)hBlcokNum * vBlockNum;
+            addArenaStats(arenaBefore);
+            return;
+        }
+
         for (int j = 0; j < vBlockNum; ++j)
         {
+            // the temporaries of the previous stripe are released at once
+            threadArena().reset();
             for (int i = 0; i < hBlcokNum; ++i)
             {
-                cv::Mat MCUblock = padImg(cv::Rect(i * MCUsize, j * MCUsize, MCUsize, MCUsize));
-                RLC rlc;
-                RLCContainer runLengthCode = rlc.MCUtoRLC(MCUblock, curDCValues, prevDCValues);
-                scanData += RLCToBitString(runLengthCode);
-                for (int k = 0; k < 3; ++k)
+                if (useCachedCoefficients)
+                {
+                    size_t n = (size_t)j * hBlcokNum + i;
+                    encodeMCUCoefficients(&m_DCTCoefficients[n * 3 * 64], m_flatChannels[n]);
+                }
+                else
                 {
-                    prevDCValues[k] = curDCValues[k];
+                    encodeMCUCached(i, j, MCUBlock(i, j));
                 }
             }
         }
+        addArenaStats(arenaBefore);
+    }
+
+    Encoder::BlockEncoder Encoder::selectBlockEncoder(int component) const
+    {
+        // a table of the instantiations, indexed by the runtime configuration
+        typedef BlockEncoder (Encoder::*LayoutSelector)() const;
+        static const LayoutSelector interleaved[2][2] = {
+            {&Encoder::selectLayoutBlockEncoder<InterleavedBGRLayout, OpenCVDCT>,
+             &Encoder::selectLayoutBlockEncoder<InterleavedYCrCbLayout, OpenCVDCT>},
+            {&Encoder::selectLayoutBlockEncoder<InterleavedBGRLayout, PrunedDCT>,
+             &Encoder::selectLayoutBlockEncoder<InterleavedYCrCbLayout, PrunedDCT>}};
+        static const LayoutSelector singleComponent[2][3] = {
+            {&Encoder::selectLayoutBlockEncoder<ComponentLayout<0>, OpenCVDCT>,
+             &Encoder::selectLayoutBlockEncoder<ComponentLayout<1>, OpenCVDCT>,
+             &Encoder::selectLayoutBlockEncoder<ComponentLayout<2>, OpenCVDCT>},
+            {&Encoder::selectLayoutBlockEncoder<ComponentLayout<0>, PrunedDCT>,
+             &Encoder::selectLayoutBlockEncoder<ComponentLayout<1>, PrunedDCT>,
+             &Encoder::selectLayoutBlockEncoder<ComponentLayout<2>, PrunedDCT>}};
+
+        // a single component scan reads a YCrCb image (see encodeComponentScans())
+        if (component >= 0)
+            return (this->*singleComponent[m_prunedDCT][component])();
+        return (this->*interleaved[m_prunedDCT][m_imageIsYCrCb])();
+    }
+
+    template <typename Layout, typename DCTEngine>
+    Encoder::BlockEncoder Encoder::selectLayoutBlockEncoder() const
+    {
+        static const BlockEncoder encoders[2][2] = {
+            {&Encoder::encodeBlocks<Layout, false, false, DCTEngine>, &Encoder::encodeBlocks<Layout, false, true, DCTEngine>},
+            {&Encoder::encodeBlocks<Layout, true, false, DCTEngine>, &Encoder::encodeBlocks<Layout, true, true, DCTEngine>}};
+        return encoders[m_keepQuantizedCoefficients][!m_DCImage.empty()];
+    }
+
+    template <typename Layout, bool KeepCoefficients, bool Thumbnail, typename DCTEngine>
+    void Encoder::encodeBlocks(std::string &scanData, EncodeStats &stats)
+    {
+        const int first = Layout::firstComponent, count = Layout::componentCount;
+
+        // the tables of every component are looked up once per scan
+        const HuffmanCodeMapper *DCMappers[count], *ACMappers[count];
+        for (int k = 0; k < count; ++k)
+        {
+            int tableNo = first + k == 0 ? HT_Y : HT_CbCr;
+            DCMappers[k] = &m_huffmanCoding->codeMappers[HT_DC][tableNo];
+            ACMappers[k] = &m_huffmanCoding->codeMappers[HT_AC][tableNo];
+        }
+
+        Arena &arena = threadArena();
+        float coefficients[count * 64], prunedEnergies[count];
+        Int16 blocks[count * 64];
+        int prevDCValues[count] = {};
+        // a block has fewer than 80 codes, so the run-length code is allocated once per scan
+        ChannelRLC runLengthCode;
+        runLengthCode.reserve(80);
+        for (int j = 0; j < m_vBlockNum; ++j)
+        {
+            // the temporaries of the previous stripe are released at once
+            arena.reset();
+            cv::Vec3f *DCTerms = Thumbnail ? m_DCImage.ptr<cv::Vec3f>(j) : nullptr;
+            for (int i = 0; i < m_hBlockNum; ++i)
+            {
+                size_t n = (size_t)j * m_hBlockNum + i;
+                UInt8 flatChannels = m_rlc.layoutToDCTCoefficients<Layout, DCTEngine>(MCUBlock(i, j), coefficients,
+                                                                                       prunedEnergies);
+                for (int k = 0; k < count; ++k)
+                {
+                    int c = first + k;
+                    Int16 *zzorderData = KeepCoefficients ? &m_quantizedCoefficients[(n * 3 + c) * 64] : blocks + k * 64;
+                    UInt64 nonzeroMask = m_rlc.quantizeBlock(c, coefficients + k * 64, zzorderData, (flatChannels >> k) & 1,
+                                                             &stats.squaredErrors[c]);
+                    stats.squaredErrors[c] += prunedEnergies[k];
+                    m_rlc.zzorderDataToRLC(zzorderData[0] - prevDCValues[k], zzorderData, nonzeroMask, runLengthCode);
+                    prevDCValues[k] = zzorderData[0];
+                    singleRLCToBitString(runLengthCode, *DCMappers[k], *ACMappers[k], scanData);
+                    if (Thumbnail)
+                        DCTerms[i][c] = DCTermToSample(coefficients[k * 64]);
+                    stats.flatBlocks += (flatChannels >> k) & 1;
+                }
+            }
+        }
+    }
+
+    void Encoder::beginScan()
+    {
+        m_stats = EncodeStats();
+        m_stats.huffmanTableSet = huffmanTableSets()[m_huffmanTableSet].name;
+        m_scanData.clear();
+        m_quantizedCoefficients.clear();
+        m_prevDCValues.assign(3, 0);
+        m_curDCValues.assign(3, 0);
+    }
 
+    void Encoder::encodeMCUCoefficients(const float *coefficients, UInt8 flatChannels)
+    {
+        if (m_keepQuantizedCoefficients)
+        {
+            size_t offset = m_quantizedCoefficients.size();
+            m_quantizedCoefficients.resize(offset + 3 * 64);
+            UInt64 nonzeroMasks[3];
+            m_rlc.quantizeMCU(coefficients, &m_quantizedCoefficients[offset], nonzeroMasks, flatChannels,
+                              m_stats.squaredErrors);
+            m_rlc.quantizedMCUToRLC(&m_quantizedCoefficients[offset], nonzeroMasks,
+                                    m_runLengthCode, m_curDCValues, m_prevDCValues);
+        }
+        else
+        {
+            m_rlc.DCTCoefficientsToRLC(coefficients, m_runLengthCode, m_curDCValues, m_prevDCValues, flatChannels,
+                                       m_stats.squaredErrors);
+        }
+        RLCToBitString(m_runLengthCode, m_scanData);
+        m_stats.MCUCount++;
+        m_stats.flatBlocks += (flatChannels & 1) + ((flatChannels >> 1) & 1) + ((flatChannels >> 2) & 1);
+        for (int k = 0; k < 3; ++k)
+        {
+            m_prevDCValues[k] = m_curDCValues[k];
+        }
+    }
+
+    void Encoder::encodeMCUCached(int blockX, int blockY, const cv::Mat &MCU)
+    {
+        UInt64 hash = BlockCache::hashBlock(MCU, m_imageIsYCrCb);
+        const BlockCache::Entry *entry = m_blockCache.find(MCU, hash);
+        if (entry != nullptr)
+        {
+            m_stats.blockCacheHits++;
+        }
+        else
+        {
+            m_stats.blockCacheMisses++;
+
+            float coefficients[3 * 64];
+            UInt8 flatChannels = m_rlc.MCUToDCTCoefficients(MCU, coefficients, m_imageIsYCrCb);
+            double squaredErrors[3] = {0.0, 0.0, 0.0};
+            m_rlc.DCTCoefficientsToRLC(coefficients, m_runLengthCode, m_curDCValues, m_prevDCValues, flatChannels,
+                                       squaredErrors);
+            m_stats.flatBlocks += (flatChannels & 1) + ((flatChannels >> 1) & 1) + ((flatChannels >> 2) & 1);
+
+            BlockCache::Entry &newEntry = m_blockCache.insert(MCU, hash);
+            for (int c = 0; c < 3; ++c)
+            {
+                newEntry.squaredErrors[c] = squaredErrors[c];
+                int tableNo = c == 0 ? HT_Y : HT_CbCr;
+                newEntry.DCCoefficients[c] = coefficients[c * 64];
+                newEntry.DCValues[c] = m_curDCValues[c];
+                ACRLCToBitString(m_runLengthCode[c], m_huffmanCoding->codeMappers[HT_AC][tableNo], newEntry.ACBits);
+                newEntry.ACBitsEnd[c] = newEntry.ACBits.size();
+            }
+            entry = &newEntry;
+        }
+
+        // only the DC differences depend on the previous MCU
+        size_t ACBitsBegin = 0;
+        for (int c = 0; c < 3; ++c)
+        {
+            int tableNo = c == 0 ? HT_Y : HT_CbCr;
+            m_curDCValues[c] = entry->DCValues[c];
+            DCValueToBitString(m_curDCValues[c] - m_prevDCValues[c], m_huffmanCoding->codeMappers[HT_DC][tableNo], m_scanData);
+            m_scanData.append(entry->ACBits, ACBitsBegin, entry->ACBitsEnd[c] - ACBitsBegin);
+            ACBitsBegin = entry->ACBitsEnd[c];
+            m_prevDCValues[c] = m_curDCValues[c];
+            m_stats.squaredErrors[c] += entry->squaredErrors[c];
+        }
+        collectDCTerm(blockX, blockY, entry->DCCoefficients, 1);
+        m_stats.MCUCount++;
+    }
+
+    void Encoder::encodeComponentScans()
+    {
+        prepareMCUGrid();
+        selectHuffmanTables();
+        beginScan();
+        if (m_keepQuantizedCoefficients)
+            m_quantizedCoefficients.assign((size_t)m_hBlockNum * m_vBlockNum * 3 * 64, 0);
+
+        // the color conversion is done once for the whole image, so that every
+        // component thread only reads its own channel
+        cv::Mat source = m_image;
+        bool sourceIsYCrCb = m_imageIsYCrCb;
+        if (!m_imageIsYCrCb)
+        {
+            cv::cvtColor(source, m_YCrCbImage, cv::COLOR_BGR2YCrCb);
+            m_image = m_YCrCbImage;
+            m_imageIsYCrCb = true;
+        }
+
+        EncodeStats componentStats[3];
+        std::vector<std::thread> workers;
+        for (int c = 0; c < 3; ++c)
+            workers.emplace_back(&Encoder::encodeComponentScan, this, c, std::ref(componentStats[c]));
+        for (std::thread &worker : workers)
+            worker.join();
+
+        m_image = source;
+        m_imageIsYCrCb = sourceIsYCrCb;
+
+        m_stats.MCUCount = (size_t)m_hBlockNum * m_vBlockNum;
+        for (int c = 0; c < 3; ++c)
+        {
+            m_stats.flatBlocks += componentStats[c].flatBlocks;
+            m_stats.squaredErrors[c] = componentStats[c].squaredErrors[c];
+            m_stats.arenaAllocations += componentStats[c].arenaAllocations;
+            m_stats.arenaHeapAllocations += componentStats[c].arenaHeapAllocations;
+            m_stats.arenaPeakBytes = std::max(m_stats.arenaPeakBytes, componentStats[c].arenaPeakBytes);
+            m_stats.heapAllocations += componentStats[c].heapAllocations;
+        }
+    }
+
+    void Encoder::encodeComponentScan(int component, EncodeStats &stats)
+    {
+        Arena &arena = threadArena();
+        ArenaStats arenaBefore = arena.stats();
+
+        std::string &scanData = m_componentScanData[component];
+        scanData.clear();
+
+        // the blocks of a non-interleaved scan are in raster order (ITU-T81, page 29),
+        // with a single component the DC prediction only spans that component
+        (this->*selectBlockEncoder(component))(scanData, stats);
+        packScanBits(scanData, m_componentScanBytes[component]);
+
+        ArenaStats arenaAfter = arena.stats();
+        stats.arenaAllocations = arenaAfter.allocations - arenaBefore.allocations;
+        stats.arenaHeapAllocations = arenaAfter.heapAllocations - arenaBefore.heapAllocations;
+        stats.arenaPeakBytes = arenaAfter.peakBytes;
+        stats.heapAllocations = arenaAfter.threadHeapAllocations - arenaBefore.threadHeapAllocations;
+    }
+
+    void Encoder::writeComponentScans()
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            m_scanComponent = c;
+            segmentWriterHandler(JFIF_SOS, &Encoder::writeSOSSegment);
+            m_output->write(m_componentScanBytes[c].data(), m_componentScanBytes[c].size());
+            log() << "Number of bytes of the scan of component " << c << ": " << m_componentScanBytes[c].size() << std::endl;
+        }
+        m_scanComponent = -1;
+        writeMarker(JFIF_EOI);
+        logStats();
+    }
+
+    void Encoder::packScanBits(std::string &scanData, std::string &scanBytes)
+    {
         // byte alignment
-        logFile << "Number of bits of compressed image data (before byte stuffing)" << scanData.size() << std::endl;
         scanData += std::string((8 - scanData.size()) % 8, '1');
-        logFile << "Number of bits of compressed image data after alignment (before byte stuffing)" << scanData.size() << std::endl;
 
-        // write the data (and do byte stuffing)
-        size_t totalBytes = 0;
+        // pack the bits and do byte stuffing
+        scanBytes.clear();
         for (size_t i = 0; i < scanData.size(); i += 8)
         {
-            UInt8 byte = std::bitset<8>(scanData.substr(i, 8)).to_ulong();
-            m_imageFile << byte;
-            totalBytes++;
+            UInt8 byte = 0;
+            for (size_t k = i; k < i + 8; ++k)
+                byte = (byte << 1) | (scanData[k] == '1');
+            scanBytes.push_back(byte);
             if (byte == JFIF_BYTE_FF)
-            {
-                m_imageFile << (UInt8)0x00;
-                totalBytes++;
-            }
+                scanBytes.push_back(0x00);
         }
+    }
+
+    void Encoder::writeScanBits()
+    {
+        // byte alignment, then pack the bits (and do byte stuffing) and write the data at once
+        log() << "Number of bits of compressed image data (before byte stuffing)" << m_scanData.size() << std::endl;
+        packScanBits(m_scanData, m_scanBytes);
+        log() << "Number of bits of compressed image data after alignment (before byte stuffing)" << m_scanData.size() << std::endl;
+
+        m_output->write(m_scanBytes.data(), m_scanBytes.size());
         writeMarker(JFIF_EOI);
+        logStats();
+    }
+
+    void Encoder::logStats()
+    {
+        log() << "MCUs encoded: " << m_stats.MCUCount
+              << ", flat blocks: " << m_stats.flatBlocks << " ("
+              << (m_stats.MCUCount ? 100.0 * m_stats.flatBlocks / (3 * m_stats.MCUCount) : 0.0) << "%)"
+              << ", changed MCUs: " << m_stats.changedMCUs
+              << ", block cache hits: " << m_stats.blockCacheHits << ", misses: " << m_stats.blockCacheMisses
+              << ", arena buffers: " << m_stats.arenaAllocations
+              << ", arena heap blocks: " << m_stats.arenaHeapAllocations
+              << ", arena peak: " << m_stats.arenaPeakBytes << " bytes"
+#ifdef CPPEG_COUNT_HEAP_ALLOCATIONS
+              << ", heap allocations: " << m_stats.heapAllocations
+#endif
+              << ", Huffman tables: " << m_stats.huffmanTableSet << std::endl;
+        log() << "PSNR: " << m_stats.PSNR() << " dB (Y: " << m_stats.PSNR(0) << " dB, Cb: " << m_stats.PSNR(1)
+              << " dB, Cr: " << m_stats.PSNR(2) << " dB), MSE: " << m_stats.MSE() << std::endl;
+    }
+
+    const Encoder::EncodeStats &Encoder::stats() const
+    {
+        return m_stats;
+    }
+
+    double Encoder::EncodeStats::MSE(int component) const
+    {
+        if (MCUCount == 0)
+            return 0.0;
+        double samples = 64.0 * MCUCount;
+        if (component >= 0)
+            return squaredErrors[component] / samples;
+        return (squaredErrors[0] + squaredErrors[1] + squaredErrors[2]) / (3 * samples);
+    }
+
+    double Encoder::EncodeStats::PSNR(int component) const
+    {
+        double error = MSE(component);
+        if (error == 0.0)
+            return std::numeric_limits<double>::infinity();
+        return 10.0 * std::log10(255.0 * 255.0 / error);
     }
 
     void Encoder::writeMarker(UInt8 markerType)
     {
-        m_imageFile << JFIF_BYTE_FF;
-        m_imageFile << markerType;
+        m_output->put(JFIF_BYTE_FF);
+        m_output->put(markerType);
     }
 
     void Encoder::segmentWriterHandler(cppeg::Marker marker, void (Encoder::*writer)())
     {
-        if (!m_imageFile.is_open() || !m_imageFile.good())
+        if (m_output == nullptr || !m_output->good())
         {
-            logFile << "Unable to write image file: \'" + m_filename + "\'" << std::endl;
+            log() << "Unable to write image file: \'" + m_filename + "\'" << std::endl;
             return;
         }
 
-        // write marker and record its position
-        std::streampos segmentBeg = m_imageFile.tellp();
-        writeMarker(marker);
-
-        // since the length of segment is not determined, we first
-        // record the position and write an arbitrary length into the file
-        UInt16 lenBtye = 0;
-        m_imageFile.write(reinterpret_cast<const char *>(&lenBtye), 2);
-
-        // write the segment data
+        // the segment data is written into the segment buffer first,
+        // so its length is known before anything reaches the output
+        OutputSink *output = m_output;
+        m_segment.reset();
+        m_output = &m_segment;
         (this->*writer)();
+        m_output = output;
 
-        writePayloadLength(segmentBeg);
+        writeSegment(marker, m_segment.data(), m_segment.size());
     }
 
-    void Encoder::writePayloadLength(std::streampos segmentBeg, bool includeMarker)
+    void Encoder::writeSegment(UInt8 marker, const char *data, size_t size)
     {
-        // write the correct length of segment
-        auto segmentEnd = m_imageFile.tellp();
-        auto lenBtye = segmentEnd - segmentBeg - 2;
-        if (includeMarker)
-            lenBtye += 2;
-        segmentBeg += 2; // skip over marker
-        m_imageFile.seekp(segmentBeg);
-        logFile << "Segment payload: " << lenBtye << " bytes" << std::endl;
+        writeMarker(marker);
+
+        // the length counts itself but not the marker
+        UInt16 lenBtye = size + 2;
+        log() << "Segment payload: " << lenBtye << " bytes" << std::endl;
         lenBtye = ntohs(lenBtye);
-        m_imageFile.write(reinterpret_cast<const char *>(&lenBtye), 2);
-        m_imageFile.seekp(0, m_imageFile.end);
+        m_output->write(&lenBtye, 2);
+        m_output->write(data, size);
     }
 
     HuffmanTable huffmanTableArraysToHuffmanTable(const UInt16 bitsLen[], const UInt16 symbols[])
@@ -0,0 +1,562 @@
+#include <algorithm>
+
+#include "HuffmanLibrary.hpp"
+#include "Encoder.hpp"
+#include "Transform.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        // The tables of the content classes were generated by "cppeg --train-tables <q>"
+        // from photographs, screenshots of user interfaces and rendered text pages
+        // (documents), at a low (25) and a high (90) quality.
+
+        // photo low, trained at quality 25
+        const UInt16 photoLowBitsDCLuminance[17] = {0, 0, 3, 1, 1, 1, 0, 1, 5, 0, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 photoLowValuesDCLuminance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 photoLowBitsDCChrominance[17] = {0, 1, 1, 1, 1, 1, 0, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 photoLowValuesDCChrominance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 photoLowBitsACLuminance[17] = {0, 0, 2, 2, 1, 3, 2, 4, 5, 2, 3, 4, 3, 1, 1, 2, 127};
+        const UInt16 photoLowValuesACLuminance[] = {
+            0x01, 0x02, 0x00, 0x11, 0x03, 0x12, 0x21, 0x31,
+            0x04, 0x41, 0x13, 0x22, 0x51, 0x61, 0x32, 0x52,
+            0x71, 0x81, 0x91, 0x14, 0x42, 0x23, 0x33, 0xa1,
+            0x05, 0x62, 0x72, 0xb1, 0x34, 0x43, 0x53, 0x82,
+            0xc1, 0x24, 0x92, 0xf0, 0x15, 0xd1, 0xf1, 0x73,
+            0xe1, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x16, 0x17,
+            0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29,
+            0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0xa2, 0x3a,
+            0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x54,
+            0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64,
+            0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x74, 0x75,
+            0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85,
+            0x86, 0x87, 0x88, 0x89, 0x8a, 0x93, 0x94, 0x95,
+            0x96, 0x97, 0x98, 0x99, 0x9a, 0xa3, 0xa4, 0xa5,
+            0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+            0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+            0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+            0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+        const UInt16 photoLowBitsACChrominance[17] = {0, 1, 1, 1, 1, 0, 3, 0, 2, 2, 0, 3, 0, 1, 0, 4, 143};
+        const UInt16 photoLowValuesACChrominance[] = {
+            0x00, 0x01, 0x11, 0x02, 0x12, 0x21, 0x31, 0x03,
+            0x41, 0x13, 0x51, 0x22, 0x32, 0x61, 0x71, 0x04,
+            0x05, 0x42, 0x81, 0x06, 0x07, 0x08, 0x09, 0x0a,
+            0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x23,
+            0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x33,
+            0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43,
+            0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x52,
+            0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a,
+            0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+            0x6a, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+            0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+            0x88, 0x89, 0x8a, 0x91, 0x92, 0x93, 0x94, 0x95,
+            0x96, 0x97, 0x98, 0x99, 0x9a, 0xa1, 0xa2, 0xa3,
+            0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb1,
+            0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9,
+            0xba, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+            0xc8, 0xc9, 0xca, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5,
+            0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3,
+            0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf0,
+            0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+
+        // photo high, trained at quality 90
+        const UInt16 photoHighBitsDCLuminance[17] = {0, 0, 1, 4, 3, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 photoHighValuesDCLuminance[] = {
+            0x06, 0x03, 0x04, 0x05, 0x07, 0x01, 0x02, 0x08,
+            0x00, 0x09, 0x0a, 0x0b};
+        const UInt16 photoHighBitsDCChrominance[17] = {0, 0, 1, 5, 1, 1, 1, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 photoHighValuesDCChrominance[] = {
+            0x04, 0x00, 0x02, 0x03, 0x05, 0x06, 0x01, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 photoHighBitsACLuminance[17] = {0, 0, 1, 3, 3, 3, 2, 3, 4, 6, 6, 5, 6, 1, 0, 0, 119};
+        const UInt16 photoHighValuesACLuminance[] = {
+            0x01, 0x02, 0x03, 0x04, 0x00, 0x05, 0x11, 0x06,
+            0x12, 0x21, 0x13, 0x31, 0x07, 0x41, 0x51, 0x14,
+            0x22, 0x61, 0x71, 0x08, 0x15, 0x23, 0x32, 0x81,
+            0x91, 0x16, 0x33, 0x42, 0x52, 0xa1, 0xb1, 0x24,
+            0x62, 0x92, 0xc1, 0xd1, 0x17, 0x34, 0x43, 0x53,
+            0x72, 0x73, 0x93, 0x25, 0x54, 0x63, 0x82, 0xe1,
+            0xf0, 0x35, 0x44, 0x83, 0xa2, 0xb2, 0x18, 0x26,
+            0x36, 0x64, 0xa3, 0xf1, 0x27, 0x45, 0x74, 0xb3,
+            0xc2, 0xd2, 0x09, 0x37, 0x55, 0x75, 0x84, 0x94,
+            0xc3, 0x0a, 0x19, 0x1a, 0x28, 0x29, 0x2a, 0x38,
+            0x39, 0x3a, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x56,
+            0x57, 0x58, 0x59, 0x5a, 0x65, 0x66, 0x67, 0x68,
+            0x69, 0x6a, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x85,
+            0x86, 0x87, 0x88, 0x89, 0x8a, 0x95, 0x96, 0x97,
+            0x98, 0x99, 0x9a, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8,
+            0xa9, 0xaa, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9,
+            0xba, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca,
+            0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+        const UInt16 photoHighBitsACChrominance[17] = {0, 0, 1, 3, 3, 2, 4, 3, 6, 5, 1, 5, 2, 0, 0, 0, 127};
+        const UInt16 photoHighValuesACChrominance[] = {
+            0x01, 0x00, 0x02, 0x03, 0x04, 0x11, 0x12, 0x05,
+            0x21, 0x13, 0x22, 0x31, 0x32, 0x14, 0x41, 0x51,
+            0x06, 0x42, 0x52, 0x61, 0x71, 0x91, 0x15, 0x23,
+            0x33, 0x81, 0xa1, 0x16, 0x24, 0x43, 0x53, 0x62,
+            0xb1, 0x34, 0xc1, 0xf0, 0x72, 0xd1, 0xe1, 0xf1,
+            0x63, 0x92, 0x25, 0x35, 0x82, 0x07, 0x08, 0x09,
+            0x0a, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28,
+            0x29, 0x2a, 0x54, 0x36, 0x37, 0x38, 0x39, 0x3a,
+            0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x55,
+            0x56, 0x57, 0x58, 0x59, 0x5a, 0x64, 0x65, 0x66,
+            0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76,
+            0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86,
+            0x87, 0x88, 0x89, 0x8a, 0x93, 0x94, 0x95, 0x96,
+            0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+            0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+            0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+            0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+            0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+
+        // screen low, trained at quality 25
+        const UInt16 screenLowBitsDCLuminance[17] = {0, 1, 0, 3, 1, 1, 1, 0, 2, 3, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 screenLowValuesDCLuminance[] = {
+            0x00, 0x02, 0x03, 0x04, 0x05, 0x01, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 screenLowBitsDCChrominance[17] = {0, 1, 1, 1, 1, 1, 1, 0, 1, 5, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 screenLowValuesDCChrominance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 screenLowBitsACLuminance[17] = {0, 1, 0, 2, 1, 2, 2, 4, 7, 13, 6, 4, 0, 1, 0, 0, 119};
+        const UInt16 screenLowValuesACLuminance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x11, 0x05, 0x12,
+            0x13, 0x21, 0x31, 0x51, 0x14, 0x22, 0x41, 0x52,
+            0x61, 0x71, 0x91, 0x06, 0x15, 0x32, 0x33, 0x53,
+            0x54, 0x72, 0x81, 0x93, 0xa1, 0xb1, 0xc1, 0xd1,
+            0x34, 0x35, 0x62, 0x73, 0x92, 0xe1, 0x23, 0x42,
+            0xb2, 0xd2, 0x82, 0xa2, 0xf0, 0x16, 0x24, 0x43,
+            0x55, 0xc2, 0xf1, 0x25, 0x36, 0x63, 0x64, 0xa3,
+            0x44, 0x83, 0x26, 0x45, 0x74, 0xd3, 0x46, 0x94,
+            0xb3, 0x07, 0x08, 0x09, 0x0a, 0x17, 0x18, 0x19,
+            0x1a, 0x27, 0x28, 0x29, 0x2a, 0x37, 0x38, 0x39,
+            0x3a, 0x47, 0x48, 0x49, 0x4a, 0x56, 0x57, 0x58,
+            0x59, 0x5a, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+            0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x84, 0x85,
+            0x86, 0x87, 0x88, 0x89, 0x8a, 0x95, 0x96, 0x97,
+            0x98, 0x99, 0x9a, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8,
+            0xa9, 0xaa, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9,
+            0xba, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+            0xca, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+        const UInt16 screenLowBitsACChrominance[17] = {0, 1, 1, 0, 2, 2, 2, 2, 1, 3, 1, 5, 1, 0, 0, 2, 139};
+        const UInt16 screenLowValuesACChrominance[] = {
+            0x00, 0x01, 0x02, 0x11, 0x12, 0x31, 0x21, 0x41,
+            0x03, 0x51, 0x13, 0x22, 0x32, 0x61, 0x42, 0x04,
+            0x14, 0x71, 0x91, 0xa1, 0xf0, 0x52, 0x81, 0x23,
+            0x24, 0x33, 0xb1, 0xc1, 0xd1, 0xe1, 0xf1, 0x43,
+            0x62, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x15,
+            0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27,
+            0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38,
+            0x39, 0x3a, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+            0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+            0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+            0x6a, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+            0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+            0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+            0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+            0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+            0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+            0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+            0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+
+        // screen high, trained at quality 90
+        const UInt16 screenHighBitsDCLuminance[17] = {0, 1, 0, 1, 4, 3, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 screenHighValuesDCLuminance[] = {
+            0x00, 0x07, 0x05, 0x06, 0x08, 0x09, 0x01, 0x03,
+            0x04, 0x02, 0x0a, 0x0b};
+        const UInt16 screenHighBitsDCChrominance[17] = {0, 1, 0, 2, 3, 1, 1, 1, 0, 3, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 screenHighValuesDCChrominance[] = {
+            0x00, 0x03, 0x04, 0x01, 0x02, 0x05, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 screenHighBitsACLuminance[17] = {0, 0, 1, 3, 3, 2, 2, 3, 7, 8, 14, 20, 10, 0, 2, 0, 87};
+        const UInt16 screenHighValuesACLuminance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+            0x11, 0x12, 0x21, 0x08, 0x13, 0x31, 0x09, 0x14,
+            0x15, 0x16, 0x22, 0x41, 0xd1, 0x32, 0x51, 0x54,
+            0x55, 0x61, 0x92, 0x93, 0xd2, 0x17, 0x18, 0x23,
+            0x52, 0x53, 0x57, 0x71, 0x81, 0x91, 0x96, 0xa2,
+            0xa3, 0xb3, 0xd4, 0x34, 0x35, 0x36, 0x37, 0x38,
+            0x42, 0x56, 0x72, 0x74, 0x75, 0x76, 0x83, 0x94,
+            0x95, 0xa1, 0xa4, 0xb1, 0xb2, 0xb4, 0xd3, 0x24,
+            0x33, 0x58, 0x62, 0x64, 0x73, 0x82, 0xb5, 0xc1,
+            0xd5, 0xe1, 0x19, 0x63, 0x65, 0x25, 0x26, 0x43,
+            0x85, 0x97, 0xa5, 0xc3, 0x28, 0x39, 0x77, 0x84,
+            0xa7, 0xc2, 0xc4, 0xf0, 0x27, 0x44, 0x46, 0x66,
+            0x67, 0x86, 0xb6, 0x47, 0xa6, 0xe2, 0xe3, 0xf1,
+            0x45, 0xe4, 0x29, 0x87, 0xc5, 0xc6, 0xd6, 0x0a,
+            0x1a, 0x2a, 0x3a, 0x48, 0x49, 0x4a, 0x59, 0x5a,
+            0x68, 0x69, 0x6a, 0x78, 0x79, 0x7a, 0x88, 0x89,
+            0x8a, 0x98, 0x99, 0x9a, 0xa8, 0xa9, 0xaa, 0xb7,
+            0xb8, 0xb9, 0xba, 0xc7, 0xc8, 0xc9, 0xca, 0xd7,
+            0xd8, 0xd9, 0xda, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+        const UInt16 screenHighBitsACChrominance[17] = {0, 1, 0, 1, 3, 2, 2, 6, 6, 6, 7, 4, 4, 1, 0, 0, 119};
+        const UInt16 screenHighValuesACChrominance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x21, 0x12,
+            0x31, 0x05, 0x13, 0x41, 0x51, 0x61, 0x71, 0x22,
+            0x81, 0x91, 0xa1, 0xb1, 0xd1, 0x06, 0x14, 0x15,
+            0x32, 0xc1, 0xf0, 0x23, 0x33, 0x34, 0x52, 0x53,
+            0x72, 0xe1, 0x42, 0x92, 0xb2, 0xf1, 0x07, 0x16,
+            0x35, 0x62, 0x82, 0xa2, 0xc2, 0xd2, 0x24, 0x54,
+            0x17, 0x25, 0x43, 0x55, 0x63, 0xd3, 0x36, 0x44,
+            0x73, 0x94, 0xe2, 0x27, 0x64, 0x83, 0x93, 0xa3,
+            0xb3, 0x45, 0x74, 0xa4, 0x56, 0x65, 0xc3, 0x08,
+            0x09, 0x0a, 0x18, 0x19, 0x1a, 0x26, 0x28, 0x29,
+            0x2a, 0x37, 0x38, 0x39, 0x3a, 0x46, 0x47, 0x48,
+            0x49, 0x4a, 0x57, 0x58, 0x59, 0x5a, 0x66, 0x67,
+            0x68, 0x69, 0x6a, 0x75, 0x76, 0x77, 0x78, 0x79,
+            0x7a, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a,
+            0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa5, 0xa6,
+            0xa7, 0xa8, 0xa9, 0xaa, 0xb4, 0xb5, 0xb6, 0xb7,
+            0xb8, 0xb9, 0xba, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8,
+            0xc9, 0xca, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9,
+            0xda, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+
+        // document low, trained at quality 25
+        const UInt16 documentLowBitsDCLuminance[17] = {0, 1, 0, 3, 1, 1, 1, 0, 2, 3, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 documentLowValuesDCLuminance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 documentLowBitsDCChrominance[17] = {0, 1, 1, 1, 1, 1, 0, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 documentLowValuesDCChrominance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 documentLowBitsACLuminance[17] = {0, 0, 2, 2, 1, 3, 2, 4, 5, 2, 5, 1, 1, 1, 0, 2, 131};
+        const UInt16 documentLowValuesACLuminance[] = {
+            0x01, 0x02, 0x00, 0x03, 0x11, 0x04, 0x12, 0x21,
+            0x13, 0x31, 0x22, 0x41, 0x51, 0x61, 0x05, 0x14,
+            0x32, 0x71, 0x81, 0x91, 0xa1, 0x23, 0x52, 0xb1,
+            0xc1, 0xd1, 0x15, 0x42, 0x24, 0x33, 0x62, 0xf0,
+            0xe1, 0x06, 0x34, 0x43, 0x72, 0x82, 0xa2, 0xc2,
+            0xf1, 0x35, 0x53, 0x73, 0x92, 0xb2, 0xd2, 0x16,
+            0x25, 0x74, 0x36, 0x44, 0x83, 0x54, 0x63, 0x07,
+            0x45, 0x75, 0x93, 0x08, 0x09, 0x0a, 0x17, 0x18,
+            0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x37,
+            0x38, 0x39, 0x3a, 0x46, 0x47, 0x48, 0x49, 0x4a,
+            0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x64, 0x65,
+            0x66, 0x67, 0x68, 0x69, 0x6a, 0x76, 0x77, 0x78,
+            0x79, 0x7a, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+            0x8a, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+            0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa,
+            0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+            0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca,
+            0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+        const UInt16 documentLowBitsACChrominance[17] = {0, 1, 1, 1, 0, 2, 2, 1, 1, 2, 1, 0, 2, 83, 65, 0, 0};
+        const UInt16 documentLowValuesACChrominance[] = {
+            0x00, 0x01, 0x11, 0x12, 0x31, 0x02, 0x21, 0x41,
+            0x51, 0x32, 0x42, 0x22, 0x61, 0x71, 0x03, 0x04,
+            0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x13, 0x14,
+            0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x23, 0x24,
+            0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x33, 0x34,
+            0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+            0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x52, 0x53,
+            0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x62,
+            0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+            0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+            0x7a, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+            0x88, 0x89, 0x8a, 0x91, 0x92, 0x93, 0x94, 0x95,
+            0x96, 0x97, 0x98, 0x99, 0x9a, 0xa1, 0xa2, 0xa3,
+            0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb1,
+            0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9,
+            0xba, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+            0xc8, 0xc9, 0xca, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5,
+            0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3,
+            0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf0,
+            0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+
+        // document high, trained at quality 90
+        const UInt16 documentHighBitsDCLuminance[17] = {0, 1, 0, 2, 2, 3, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 documentHighValuesDCLuminance[] = {
+            0x00, 0x05, 0x06, 0x04, 0x07, 0x01, 0x02, 0x03,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 documentHighBitsDCChrominance[17] = {0, 1, 0, 2, 3, 1, 1, 0, 3, 1, 0, 0, 0, 0, 0, 0, 0};
+        const UInt16 documentHighValuesDCChrominance[] = {
+            0x00, 0x02, 0x04, 0x01, 0x03, 0x05, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b};
+        const UInt16 documentHighBitsACLuminance[17] = {0, 0, 1, 4, 2, 2, 1, 3, 3, 2, 4, 1, 5, 1, 0, 2, 131};
+        const UInt16 documentHighValuesACLuminance[] = {
+            0x01, 0x02, 0x03, 0x04, 0x05, 0x00, 0x06, 0x11,
+            0x12, 0x07, 0x08, 0x13, 0x21, 0x14, 0x22, 0x31,
+            0x15, 0x41, 0x16, 0x23, 0x32, 0x51, 0x61, 0x17,
+            0x24, 0x33, 0x42, 0x52, 0x71, 0x92, 0x09, 0x34,
+            0x53, 0x55, 0x72, 0x81, 0x91, 0xd1, 0x18, 0x25,
+            0x62, 0x93, 0xb1, 0x35, 0x43, 0x82, 0xa1, 0xb2,
+            0x26, 0x38, 0x73, 0x74, 0x76, 0xb3, 0xc1, 0xc2,
+            0x19, 0x27, 0x36, 0x63, 0x75, 0x95, 0xb4, 0xb5,
+            0xf0, 0x37, 0x39, 0x44, 0x54, 0x56, 0x77, 0xa2,
+            0xd3, 0x57, 0x83, 0x96, 0xa5, 0xc3, 0xd4, 0x28,
+            0x64, 0xa3, 0xc4, 0x0a, 0x1a, 0x29, 0x2a, 0x3a,
+            0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x58, 0x59,
+            0x5a, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x78,
+            0x79, 0x7a, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+            0x8a, 0x94, 0x97, 0x98, 0x99, 0x9a, 0xa4, 0xa6,
+            0xa7, 0xa8, 0xa9, 0xaa, 0xb6, 0xb7, 0xb8, 0xb9,
+            0xba, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+            0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+            0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+            0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+        const UInt16 documentHighBitsACChrominance[17] = {0, 1, 0, 2, 0, 3, 4, 6, 8, 4, 4, 2, 1, 5, 3, 4, 115};
+        const UInt16 documentHighValuesACChrominance[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x11, 0x12, 0x21,
+            0x31, 0x51, 0x13, 0x14, 0x41, 0x52, 0x53, 0x91,
+            0x05, 0x15, 0x32, 0x61, 0x71, 0x81, 0xb1, 0xd1,
+            0x22, 0xa1, 0xc1, 0xf0, 0x33, 0x34, 0x42, 0x72,
+            0x23, 0xe1, 0x82, 0x35, 0x43, 0xb2, 0xd2, 0xf1,
+            0x24, 0x62, 0xc2, 0x06, 0x07, 0x08, 0xa2, 0x09,
+            0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26,
+            0x27, 0x28, 0x29, 0x2a, 0x36, 0x37, 0x38, 0x39,
+            0x3a, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a,
+            0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63,
+            0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73,
+            0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+            0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92,
+            0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+            0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa,
+            0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+            0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca,
+            0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+            0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+            0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+            0xf9, 0xfa};
+
+        /// code length of every symbol of every table of a set, 0 for the symbols without a code
+        struct CodeLengths
+        {
+            UInt8 lengths[2][2][256] = {};
+        };
+
+        const std::vector<CodeLengths> &codeLengthsOfSets()
+        {
+            static const std::vector<CodeLengths> codeLengths = [] {
+                std::vector<CodeLengths> sets(huffmanTableSets().size());
+                for (size_t s = 0; s < sets.size(); ++s)
+                    for (int type = HT_DC; type <= HT_AC; ++type)
+                        for (int tableNo = HT_Y; tableNo <= HT_CbCr; ++tableNo)
+                        {
+                            const HuffmanTableSet &set = huffmanTableSets()[s];
+                            int k = 0;
+                            for (int length = 1; length <= 16; ++length)
+                                for (int i = 0; i < set.bits[type][tableNo][length]; ++i)
+                                    sets[s].lengths[type][tableNo][set.values[type][tableNo][k++]] = length;
+                        }
+                return sets;
+            }();
+            return codeLengths;
+        }
+
+        /// the symbols a baseline scan may code with a table of the given type
+        bool isValidSymbol(int tableType, int symbol)
+        {
+            if (tableType == HT_DC)
+                return symbol <= 11;
+            int size = symbol & 0x0f;
+            // EOB and ZRL, or a run of 0 to 15 zeros followed by a value of 1 to 10 bits
+            return symbol == 0x00 || symbol == 0xf0 || (size >= 1 && size <= 10);
+        }
+    }
+
+    void HuffmanStatistics::addRLC(const ChannelRLC &runLengthCode, int tableNo)
+    {
+        addDCDifference(runLengthCode[0].second, tableNo);
+        for (size_t i = 1; i < runLengthCode.size(); ++i)
+        {
+            UInt8 RRRR = runLengthCode[i].first & 0x0f, SSSS = getValueCategory(runLengthCode[i].second) & 0x0f;
+            counts[HT_AC][tableNo][(RRRR << 4) | SSSS]++;
+        }
+    }
+
+    void HuffmanStatistics::addDCDifference(int difference, int tableNo)
+    {
+        counts[HT_DC][tableNo][getValueCategory(difference)]++;
+    }
+
+    UInt64 HuffmanStatistics::blockCount() const
+    {
+        UInt64 blocks = 0;
+        for (int tableNo = HT_Y; tableNo <= HT_CbCr; ++tableNo)
+            for (int symbol = 0; symbol < 256; ++symbol)
+                blocks += counts[HT_DC][tableNo][symbol];
+        return blocks;
+    }
+
+    const std::vector<HuffmanTableSet> &huffmanTableSets()
+    {
+        static const std::vector<HuffmanTableSet> sets = {
+            {"default",
+             {{defaultBitsDCLuminanceCat, defaultBitsDCChrominanceCat}, {defaultBitsACLuminance, defaultBitsACChrominance}},
+             {{defaultValDCLuminanceCat, defaultValDCChrominanceCat}, {defaultValACLuminance, defaultValACChrominance}}},
+            {"photo-low",
+             {{photoLowBitsDCLuminance, photoLowBitsDCChrominance}, {photoLowBitsACLuminance, photoLowBitsACChrominance}},
+             {{photoLowValuesDCLuminance, photoLowValuesDCChrominance}, {photoLowValuesACLuminance, photoLowValuesACChrominance}}},
+            {"photo-high",
+             {{photoHighBitsDCLuminance, photoHighBitsDCChrominance}, {photoHighBitsACLuminance, photoHighBitsACChrominance}},
+             {{photoHighValuesDCLuminance, photoHighValuesDCChrominance}, {photoHighValuesACLuminance, photoHighValuesACChrominance}}},
+            {"screen-low",
+             {{screenLowBitsDCLuminance, screenLowBitsDCChrominance}, {screenLowBitsACLuminance, screenLowBitsACChrominance}},
+             {{screenLowValuesDCLuminance, screenLowValuesDCChrominance}, {screenLowValuesACLuminance, screenLowValuesACChrominance}}},
+            {"screen-high",
+             {{screenHighBitsDCLuminance, screenHighBitsDCChrominance}, {screenHighBitsACLuminance, screenHighBitsACChrominance}},
+             {{screenHighValuesDCLuminance, screenHighValuesDCChrominance}, {screenHighValuesACLuminance, screenHighValuesACChrominance}}},
+            {"document-low",
+             {{documentLowBitsDCLuminance, documentLowBitsDCChrominance}, {documentLowBitsACLuminance, documentLowBitsACChrominance}},
+             {{documentLowValuesDCLuminance, documentLowValuesDCChrominance}, {documentLowValuesACLuminance, documentLowValuesACChrominance}}},
+            {"document-high",
+             {{documentHighBitsDCLuminance, documentHighBitsDCChrominance}, {documentHighBitsACLuminance, documentHighBitsACChrominance}},
+             {{documentHighValuesDCLuminance, documentHighValuesDCChrominance}, {documentHighValuesACLuminance, documentHighValuesACChrominance}}},
+        };
+        return sets;
+    }
+
+    const std::vector<HuffmanCodingTables> &huffmanCodingTables()
+    {
+        static const std::vector<HuffmanCodingTables> codingTables = [] {
+            std::vector<HuffmanCodingTables> codingTables(huffmanTableSets().size());
+            for (size_t s = 0; s < codingTables.size(); ++s)
+            {
+                const HuffmanTableSet &set = huffmanTableSets()[s];
+                HuffmanCodingTables &coding = codingTables[s];
+                for (int type = HT_DC; type <= HT_AC; ++type)
+                    for (int tableNo = HT_Y; tableNo <= HT_CbCr; ++tableNo)
+                    {
+                        coding.tables[type][tableNo] = huffmanTableArraysToHuffmanTable(set.bits[type][tableNo], set.values[type][tableNo]);
+                        coding.codeMappers[type][tableNo] = huffmanTableArraysToHuffmanMapper(set.bits[type][tableNo], set.values[type][tableNo]);
+                        coding.codeTables[type][tableNo] = huffmanMapperToCodeTable(coding.codeMappers[type][tableNo]);
+                    }
+            }
+            return codingTables;
+        }();
+        return codingTables;
+    }
+
+    UInt64 huffmanCodeBits(const HuffmanStatistics &statistics, int tableSet)
+    {
+        const CodeLengths &codeLengths = codeLengthsOfSets()[tableSet];
+        UInt64 bits = 0;
+        for (int type = HT_DC; type <= HT_AC; ++type)
+            for (int tableNo = HT_Y; tableNo <= HT_CbCr; ++tableNo)
+                for (int symbol = 0; symbol < 256; ++symbol)
+                    bits += (UInt64)statistics.counts[type][tableNo][symbol] * codeLengths.lengths[type][tableNo][symbol];
+        return bits;
+    }
+
+    int chooseHuffmanTableSet(const HuffmanStatistics &statistics)
+    {
+        // the first set wins the ties, so the default set is kept unless another one is smaller
+        int bestSet = 0;
+        UInt64 bestBits = huffmanCodeBits(statistics, 0);
+        for (int s = 1; s < (int)huffmanTableSets().size(); ++s)
+        {
+            UInt64 bits = huffmanCodeBits(statistics, s);
+            if (bits < bestBits)
+            {
+                bestSet = s;
+                bestBits = bits;
+            }
+        }
+        return bestSet;
+    }
+
+    void huffmanTableFromCounts(const UInt32 counts[256], int tableType, UInt16 bits[17], std::vector<UInt16> &values)
+    {
+        // every valid symbol counts at least once so that it gets a code, and the
+        // reserved symbol 256 takes the all 1 bits code away from the real symbols
+        UInt64 frequencies[257];
+        for (int symbol = 0; symbol < 256; ++symbol)
+            frequencies[symbol] = isValidSymbol(tableType, symbol) ? (UInt64)counts[symbol] + 1 : 0;
+        frequencies[256] = 1;
+
+        // build the code sizes by merging the two least frequent nodes (figure K.1)
+        int codeSizes[257] = {}, others[257];
+        std::fill(others, others + 257, -1);
+        while (true)
+        {
+            // the least frequent nodes, the largest symbol first on ties
+            int v1 = -1, v2 = -1;
+            for (int v = 0; v <= 256; ++v)
+                if (frequencies[v] != 0 && (v1 < 0 || frequencies[v] <= frequencies[v1]))
+                    v1 = v;
+            for (int v = 0; v <= 256; ++v)
+                if (frequencies[v] != 0 && v != v1 && (v2 < 0 || frequencies[v] <= frequencies[v2]))
+                    v2 = v;
+            if (v2 < 0)
+                break;
+
+            frequencies[v1] += frequencies[v2];
+            frequencies[v2] = 0;
+            for (codeSizes[v1]++; others[v1] >= 0; codeSizes[v1]++)
+                v1 = others[v1];
+            others[v1] = v2;
+            for (codeSizes[v2]++; others[v2] >= 0; codeSizes[v2]++)
+                v2 = others[v2];
+        }
+
+        // count the codes of each size (figure K.2)
+        int sizeCounts[33] = {};
+        for (int v = 0; v <= 256; ++v)
+            if (codeSizes[v] > 0)
+                sizeCounts[std::min(codeSizes[v], 32)]++;
+
+        // move the codes longer than 16 bits up the tree (figure K.3): a pair of long
+        // codes becomes one code a level higher and the prefix of a shorter code splits
+        for (int i = 32; i > 16; --i)
+        {
+            while (sizeCounts[i] > 0)
+            {
+                int j = i - 2;
+                while (sizeCounts[j] == 0)
+                    --j;
+                sizeCounts[i] -= 2;
+                sizeCounts[i - 1]++;
+                sizeCounts[j + 1] += 2;
+                sizeCounts[j]--;
+            }
+        }
+
+        // the reserved symbol has one of the longest codes, drop it
+        int longest = 16;
+        while (sizeCounts[longest] == 0)
+            --longest;
+        sizeCounts[longest]--;
+
+        bits[0] = 0;
+        for (int i = 1; i <= 16; ++i)
+            bits[i] = sizeCounts[i];
+
+        // the symbols by code size (figure K.4); the sizes above 16 were only
+        // limited by count, so the symbols keep their order of code size
+        values.clear();
+        for (int size = 1; size <= 32; ++size)
+            for (int symbol = 0; symbol < 256; ++symbol)
+                if (codeSizes[symbol] == size)
+                    values.push_back(symbol);
+    }
+}
@@ -53,23 +53,25 @@ namespace cppeg
 
         // Node is the left child of its parent, then the parent's
         // right child is its right level order node.
-        if (node->parent != nullptr && node->parent->lChild == node)
-            return node->parent->rChild;
+        NodePtr parent = node->parent.lock();
+        if (parent != nullptr && parent->lChild == node)
+            return parent->rChild;
 
         // Else node is the right child of its parent, then traverse
         // back the tree and find its right level order node
         int count = 0;
         NodePtr nptr = node;
-        while (nptr->parent != nullptr && nptr->parent->rChild == nptr)
+        while (parent != nullptr && parent->rChild == nptr)
         {
-            nptr = nptr->parent;
+            nptr = parent;
+            parent = nptr->parent.lock();
             count++;
         }
 
-        if (nptr->parent == nullptr)
+        if (parent == nullptr)
             return nullptr;
 
-        nptr = nptr->parent->rChild;
+        nptr = parent->rChild;
 
         int i = 1;
         while (count > 0)
@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "MJPEGStream.hpp"
+#include "Utility.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        void writeFourCC(std::ostream &out, const char *fourCC)
+        {
+            out.write(fourCC, 4);
+        }
+
+        void writeLE16(std::ostream &out, UInt16 value)
+        {
+            const char bytes[2] = {char(value & 0xFF), char(value >> 8)};
+            out.write(bytes, 2);
+        }
+
+        void writeLE32(std::ostream &out, UInt32 value)
+        {
+            const char bytes[4] = {char(value & 0xFF), char((value >> 8) & 0xFF),
+                                   char((value >> 16) & 0xFF), char(value >> 24)};
+            out.write(bytes, 4);
+        }
+
+        void patchLE32(std::ostream &out, std::streampos pos, UInt32 value)
+        {
+            std::streampos end = out.tellp();
+            out.seekp(pos);
+            writeLE32(out, value);
+            out.seekp(end);
+        }
+
+        // fixed offsets of the fields patched at the end of the stream,
+        // the header layout written by writeAVIHeaders() never changes
+        const std::streampos RIFF_SIZE_POS = 4;
+        const std::streampos AVIH_TOTAL_FRAMES_POS = 48;
+        const std::streampos AVIH_SUGGESTED_BUFFER_POS = 60;
+        const std::streampos STRH_LENGTH_POS = 140;
+        const std::streampos STRH_SUGGESTED_BUFFER_POS = 144;
+
+        const UInt32 AVIF_HASINDEX = 0x10;
+        const UInt32 AVIIF_KEYFRAME = 0x10;
+
+        /// the path of the n-th file of a stream: "out.avi", "out_1.avi", ...
+        std::string AVIFilePath(const std::string &path, size_t n)
+        {
+            if (n == 0)
+                return path;
+            size_t extBeg = path.find_last_of('.');
+            if (extBeg == std::string::npos || path.find('/', extBeg) != std::string::npos)
+                extBeg = path.size();
+            return path.substr(0, extBeg) + "_" + std::to_string(n) + path.substr(extBeg);
+        }
+    }
+
+    MJPEGStreamEncoder::MJPEGStreamEncoder()
+    {
+        logFile << "Created \'MJPEGStreamEncoder object\'." << std::endl;
+    }
+
+    MJPEGStreamEncoder::~MJPEGStreamEncoder()
+    {
+        close();
+    }
+
+    bool MJPEGStreamEncoder::open(const std::string &oPath, OutputMode mode, int width, int height, int fps)
+    {
+        if (width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF || fps <= 0)
+        {
+            logFile << "Invalid stream geometry: " << width << "x" << height << " @ " << fps << " fps" << std::endl;
+            return false;
+        }
+
+        close();
+
+        m_path = oPath;
+        m_mode = mode;
+        m_width = width;
+        m_height = height;
+        m_fps = fps;
+        m_frameCount = 0;
+        m_maxFrameSize = 0;
+        m_AVIFileCount = 0;
+
+        if (m_mode == AVI_CONTAINER && !openAVIFile())
+            return false;
+
+        logFile << "Opened MJPEG stream: \'" + m_path + "\'" << std::endl;
+        return true;
+    }
+
+    bool MJPEGStreamEncoder::encodeFrame(const UInt8 *pixels, size_t stride)
+    {
+        if (pixels == nullptr)
+            return false;
+
+        // wrap the caller's pixels in a matrix header, no copy is made
+        cv::Mat frame(m_height, m_width, CV_8UC3, const_cast<UInt8 *>(pixels), stride);
+        return encodeFrame(frame);
+    }
+
+    bool MJPEGStreamEncoder::encodeFrame(const cv::Mat &frame)
+    {
+        if (frame.rows != m_height || frame.cols != m_width)
+        {
+            logFile << "Frame size does not match the stream size" << std::endl;
+            return false;
+        }
+        if (m_mode == AVI_CONTAINER && !m_aviFile.is_open())
+            return false;
+
+        // rewind the frame buffer, its storage is kept from the previous frame
+        m_frameBuffer.reset();
+
+        if (m_encoder.encodeFrame(frame, m_frameBuffer) != Encoder::ResultCode::ENCODE_DONE)
+            return false;
+
+        const char *jpeg = m_frameBuffer.data();
+        size_t frameSize = m_frameBuffer.size();
+
+        if (m_mode == AVI_CONTAINER)
+        {
+            if (!writeAVIFrame(jpeg, frameSize))
+            {
+                logFile << "Unable to write frame " << m_frameCount << " to the AVI stream: \'" + m_path + "\'" << std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            std::ostringstream framePath;
+            framePath << m_path << "_" << std::setw(6) << std::setfill('0') << m_frameCount << ".jpg";
+            std::ofstream frameFile(framePath.str(), std::ios::out | std::ios::binary);
+            frameFile.write(jpeg, frameSize);
+            if (!frameFile.good())
+            {
+                logFile << "Unable to write frame file: \'" + framePath.str() + "\'" << std::endl;
+                return false;
+            }
+        }
+
+        m_frameCount++;
+        return true;
+    }
+
+    void MJPEGStreamEncoder::close()
+    {
+        if (m_aviFile.is_open())
+        {
+            if (!finalizeAVI())
+                logFile << "Unable to finalize the AVI stream: \'" + m_path + "\'" << std::endl;
+            m_aviFile.close();
+            logFile << "Closed MJPEG stream: \'" + m_path + "\' (" << m_frameCount << " frames in " << m_AVIFileCount
+                    << " files)" << std::endl;
+        }
+    }
+
+    bool MJPEGStreamEncoder::openAVIFile()
+    {
+        std::string path = AVIFilePath(m_path, m_AVIFileCount);
+        m_aviFile.open(path, std::ios::out | std::ios::binary);
+        if (!m_aviFile.is_open() || !m_aviFile.good())
+        {
+            logFile << "Unable to open output stream: \'" + path + "\'" << std::endl;
+            return false;
+        }
+        m_AVIFileCount++;
+        m_aviIndex.clear();
+        m_maxFrameSize = 0;
+        writeAVIHeaders();
+        return m_aviFile.good();
+    }
+
+    void MJPEGStreamEncoder::writeAVIHeaders()
+    {
+        std::ostream &out = m_aviFile;
+
+        // RIFF header, the size is patched when the stream is closed
+        writeFourCC(out, "RIFF");
+        writeLE32(out, 0);
+        writeFourCC(out, "AVI ");
+
+        // header list: main AVI header + one video stream
+        writeFourCC(out, "LIST");
+        writeLE32(out, 192);
+        writeFourCC(out, "hdrl");
+
+        writeFourCC(out, "avih");
+        writeLE32(out, 56);
+        writeLE32(out, 1000000 / m_fps); // microseconds per frame
+        writeLE32(out, 0);               // max bytes per second
+        writeLE32(out, 0);               // padding granularity
+        writeLE32(out, AVIF_HASINDEX);   // flags
+        writeLE32(out, 0);               // total frames (patched)
+        writeLE32(out, 0);               // initial frames
+        writeLE32(out, 1);               // number of streams
+        writeLE32(out, 0);               // suggested buffer size (patched)
+        writeLE32(out, m_width);
+        writeLE32(out, m_height);
+        for (int i = 0; i < 4; ++i)
+            writeLE32(out, 0); // reserved
+
+        writeFourCC(out, "LIST");
+        writeLE32(out, 116);
+        writeFourCC(out, "strl");
+
+        writeFourCC(out, "strh");
+        writeLE32(out, 56);
+        writeFourCC(out, "vids");
+        writeFourCC(out, "MJPG");
+        writeLE32(out, 0);          // flags
+        writeLE16(out, 0);          // priority
+        writeLE16(out, 0);          // language
+        writeLE32(out, 0);          // initial frames
+        writeLE32(out, 1);          // scale
+        writeLE32(out, m_fps);      // rate (rate / scale = frames per second)
+        writeLE32(out, 0);          // start
+        writeLE32(out, 0);          // length in frames (patched)
+        writeLE32(out, 0);          // suggested buffer size (patched)
+        writeLE32(out, 0xFFFFFFFF); // quality
+        writeLE32(out, 0);          // sample size
+        writeLE16(out, 0);          // frame rectangle
+        writeLE16(out, 0);
+        writeLE16(out, m_width);
+        writeLE16(out, m_height);
+
+        // BITMAPINFOHEADER of the MJPEG stream
+        writeFourCC(out, "strf");
+        writeLE32(out, 40);
+        writeLE32(out, 40);
+        writeLE32(out, m_width);
+        writeLE32(out, m_height);
+        writeLE16(out, 1);  // planes
+        writeLE16(out, 24); // bit count
+        writeFourCC(out, "MJPG");
+        writeLE32(out, m_width * m_height * 3);
+        writeLE32(out, 0);
+        writeLE32(out, 0);
+        writeLE32(out, 0);
+        writeLE32(out, 0);
+
+        // frame data list, the size is patched when the stream is closed
+        m_moviListBeg = out.tellp();
+        writeFourCC(out, "LIST");
+        writeLE32(out, 0);
+        writeFourCC(out, "movi");
+    }
+
+    bool MJPEGStreamEncoder::writeAVIFrame(const char *jpeg, size_t size)
+    {
+        // the file with this chunk, the index entries of its frames and the 'idx1' header
+        // must stay within the limit, so the 32-bit sizes and offsets never wrap
+        auto fileSizeWithFrame = [&]() {
+            return (UInt64)m_aviFile.tellp() + 8 + size + size % 2 + 16 * (m_aviIndex.size() + 1) + 8;
+        };
+        if (!m_aviIndex.empty() && fileSizeWithFrame() > m_maxAVIFileSize)
+        {
+            bool finalized = finalizeAVI();
+            m_aviFile.close();
+            if (!finalized || !openAVIFile())
+                return false;
+            logFile << "Continued the MJPEG stream in \'" + AVIFilePath(m_path, m_AVIFileCount - 1) + "\'" << std::endl;
+        }
+        if (fileSizeWithFrame() > m_maxAVIFileSize)
+        {
+            logFile << "The frame of " << size << " bytes does not fit in an AVI file" << std::endl;
+            return false;
+        }
+
+        // chunk offsets in the index are relative to the 'movi' identifier
+        UInt32 offset = (UInt32)(m_aviFile.tellp() - m_moviListBeg - 8);
+        m_aviIndex.push_back(std::make_pair(offset, (UInt32)size));
+
+        writeFourCC(m_aviFile, "00dc");
+        writeLE32(m_aviFile, size);
+        m_aviFile.write(jpeg, size);
+
+        // chunks are aligned to even sizes
+        if (size % 2)
+            m_aviFile.put(0);
+
+        m_maxFrameSize = std::max(m_maxFrameSize, (UInt32)size);
+        return m_aviFile.good();
+    }
+
+    bool MJPEGStreamEncoder::finalizeAVI()
+    {
+        std::ostream &out = m_aviFile;
+
+        std::streampos moviEnd = out.tellp();
+        patchLE32(out, m_moviListBeg + std::streamoff(4), (UInt32)(moviEnd - m_moviListBeg - 8));
+
+        // legacy index, one entry per frame
+        writeFourCC(out, "idx1");
+        writeLE32(out, m_aviIndex.size() * 16);
+        for (const auto &entry : m_aviIndex)
+        {
+            writeFourCC(out, "00dc");
+            writeLE32(out, AVIIF_KEYFRAME);
+            writeLE32(out, entry.first);
+            writeLE32(out, entry.second);
+        }
+
+        std::streampos fileEnd = out.tellp();
+        patchLE32(out, RIFF_SIZE_POS, (UInt32)(fileEnd - std::streampos(8)));
+        patchLE32(out, AVIH_TOTAL_FRAMES_POS, m_aviIndex.size());
+        patchLE32(out, AVIH_SUGGESTED_BUFFER_POS, m_maxFrameSize);
+        patchLE32(out, STRH_LENGTH_POS, m_aviIndex.size());
+        patchLE32(out, STRH_SUGGESTED_BUFFER_POS, m_maxFrameSize);
+        out.flush();
+        return out.good();
+    }
+}
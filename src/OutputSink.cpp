@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "OutputSink.hpp"
+#include "Utility.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        const size_t PAGE_SIZE = 4096;
+
+        size_t roundUpToPage(size_t size)
+        {
+            return (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+        }
+    }
+
+    bool MemorySink::write(const void *data, size_t size)
+    {
+        const char *bytes = static_cast<const char *>(data);
+        m_data.insert(m_data.end(), bytes, bytes + size);
+        m_size += size;
+        return true;
+    }
+
+    void MemorySink::reset()
+    {
+        m_data.clear();
+        m_size = 0;
+        m_good = true;
+    }
+
+    FixedMemorySink::FixedMemorySink(char *data, size_t capacity) : m_data(data), m_capacity(capacity)
+    {
+    }
+
+    bool FixedMemorySink::write(const void *data, size_t size)
+    {
+        if (!m_good || size > m_capacity - m_size)
+            return m_good = false;
+        std::memcpy(m_data + m_size, data, size);
+        m_size += size;
+        return true;
+    }
+
+    FdSink::FdSink(int fd, bool ownsFd) : m_fd(fd), m_ownsFd(ownsFd)
+    {
+        m_buffer = static_cast<char *>(std::aligned_alloc(PAGE_SIZE, BUFFER_SIZE));
+        if (m_buffer == nullptr)
+            m_good = false;
+    }
+
+    FdSink::~FdSink()
+    {
+        close();
+        std::free(m_buffer);
+    }
+
+    void FdSink::reset(int fd, bool ownsFd)
+    {
+        m_fd = fd;
+        m_ownsFd = ownsFd;
+        m_buffered = 0;
+        m_size = 0;
+        m_writeCalls = 0;
+        m_good = m_buffer != nullptr;
+    }
+
+    bool FdSink::write(const void *data, size_t size)
+    {
+        if (!m_good || m_fd < 0)
+            return m_good = false;
+
+        const char *bytes = static_cast<const char *>(data);
+        m_size += size;
+
+        // fill the buffer first, so the bytes keep their order
+        if (m_buffered > 0 || size < BUFFER_SIZE)
+        {
+            size_t count = std::min(size, BUFFER_SIZE - m_buffered);
+            std::memcpy(m_buffer + m_buffered, bytes, count);
+            m_buffered += count;
+            bytes += count;
+            size -= count;
+            if (m_buffered < BUFFER_SIZE)
+                return true;
+            if (!flush())
+                return false;
+        }
+
+        // a large remainder is written directly, a small one starts the next buffer
+        if (size >= BUFFER_SIZE)
+            return writeFully(bytes, size);
+        std::memcpy(m_buffer, bytes, size);
+        m_buffered = size;
+        return true;
+    }
+
+    bool FdSink::flush()
+    {
+        if (m_buffered == 0)
+            return m_good;
+        bool written = writeFully(m_buffer, m_buffered);
+        m_buffered = 0;
+        return written;
+    }
+
+    bool FdSink::close()
+    {
+        if (m_fd < 0)
+            return m_good;
+        flush();
+        if (m_ownsFd && ::close(m_fd) != 0)
+            m_good = false;
+        m_fd = -1;
+        return m_good;
+    }
+
+    bool FdSink::writeFully(const char *data, size_t size)
+    {
+        while (size > 0 && m_good)
+        {
+            ssize_t count = ::write(m_fd, data, size);
+            m_writeCalls++;
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+            {
+                logFile << "Unable to write the output: " << std::strerror(errno) << std::endl;
+                m_good = false;
+                break;
+            }
+            data += count;
+            size -= count;
+        }
+        return m_good;
+    }
+
+    bool FileSink::open(const std::string &filename)
+    {
+        close();
+        int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            logFile << "Unable to open output file: \'" + filename + "\'" << std::endl;
+            return false;
+        }
+        reset(fd, true);
+        return m_good;
+    }
+
+    MmapFileSink::~MmapFileSink()
+    {
+        close();
+    }
+
+    bool MmapFileSink::open(const std::string &filename, size_t capacity)
+    {
+        close();
+        m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+        {
+            logFile << "Unable to open output file: \'" + filename + "\'" << std::endl;
+            return false;
+        }
+        m_size = 0;
+        m_good = true;
+        return reserve(std::max(capacity, PAGE_SIZE));
+    }
+
+    bool MmapFileSink::reserve(size_t capacity)
+    {
+        capacity = roundUpToPage(capacity);
+        if (::ftruncate(m_fd, capacity) != 0)
+        {
+            logFile << "Unable to resize the output file to " << capacity << " bytes" << std::endl;
+            return m_good = false;
+        }
+
+        void *mapping = m_mapping == nullptr
+                            ? ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0)
+                            : ::mremap(m_mapping, m_capacity, capacity, MREMAP_MAYMOVE);
+        if (mapping == MAP_FAILED)
+        {
+            logFile << "Unable to map the output file: " << std::strerror(errno) << std::endl;
+            return m_good = false;
+        }
+        m_mapping = static_cast<char *>(mapping);
+        m_capacity = capacity;
+        return true;
+    }
+
+    bool MmapFileSink::write(const void *data, size_t size)
+    {
+        if (!m_good || m_mapping == nullptr)
+            return m_good = false;
+        // grow geometrically when the estimate was too small
+        if (m_size + size > m_capacity && !reserve(std::max(m_size + size, m_capacity * 2)))
+            return false;
+        std::memcpy(m_mapping + m_size, data, size);
+        m_size += size;
+        return true;
+    }
+
+    bool MmapFileSink::close()
+    {
+        if (m_fd < 0)
+            return m_good;
+        if (m_mapping != nullptr)
+            ::munmap(m_mapping, m_capacity);
+        if (::ftruncate(m_fd, m_size) != 0 || ::close(m_fd) != 0)
+            m_good = false;
+        m_mapping = nullptr;
+        m_capacity = 0;
+        m_fd = -1;
+        return m_good;
+    }
+
+    StreamSink::StreamSink(std::ostream &stream) : m_stream(stream)
+    {
+        m_good = stream.good();
+    }
+
+    bool StreamSink::write(const void *data, size_t size)
+    {
+        m_stream.write(static_cast<const char *>(data), size);
+        m_size += size;
+        return m_good = m_stream.good();
+    }
+
+    bool StreamSink::flush()
+    {
+        m_stream.flush();
+        return m_good = m_stream.good();
+    }
+}
@@ -8,23 +8,102 @@
 #include "Types.hpp"
 #include "RLC.hpp"
 #include "Encoder.hpp"
+#include "Transform.hpp"
+#include "Arena.hpp"
 
 namespace cppeg
 {
-    cv::Mat RLC::QTables = cv::Mat::zeros(8, 8, CV_32FC3);
+    namespace
+    {
+        /// raster index of each zig-zag index
+        const std::array<UInt8, 64> &zzorderToRaster()
+        {
+            static const std::array<UInt8, 64> table = [] {
+                std::array<UInt8, 64> indices;
+                for (int i = 0; i < 64; ++i)
+                {
+                    std::pair<const int, const int> matIdx = zzOrderToMatIndices(i);
+                    indices[i] = matIdx.first * 8 + matIdx.second;
+                }
+                return indices;
+            }();
+            return table;
+        }
+
+        /// index of the lowest set bit, mask must not be 0
+        inline int countTrailingZeros(UInt64 mask)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_ctzll(mask);
+#else
+            int count = 0;
+            while (!(mask & 1))
+            {
+                mask >>= 1;
+                count++;
+            }
+            return count;
+#endif
+        }
+
+        /// number of set bits
+        inline int countSetBits(UInt64 mask)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_popcountll(mask);
+#else
+            int count = 0;
+            for (; mask; mask &= mask - 1)
+                count++;
+            return count;
+#endif
+        }
+
+        /// index of Y, Cb and Cr in a YCrCb pixel
+        const int YCrCbChannels[3] = {0, 2, 1};
+    }
 
     RLC::RLC()
     {
         // use the default quantization tables
-        for (int i = 0; i < 8; ++i)
+        std::array<float, 64> zzLumin, zzChromin;
+        for (int i = 0; i < 64; ++i)
         {
-            for (int j = 0; j < 8; ++j)
-            {
-                QTables.at<cv::Vec3f>(i, j)[0] = defaultLuminQTAble[i][j];
-                QTables.at<cv::Vec3f>(i, j)[1] = defaultCriominQTable[i][j];
-                QTables.at<cv::Vec3f>(i, j)[2] = defaultCriominQTable[i][j];
-            }
+            std::pair<const int, const int> matIdx = zzOrderToMatIndices(i);
+            zzLumin[i] = defaultLuminQTAble[matIdx.first][matIdx.second];
+            zzChromin[i] = defaultCriominQTable[matIdx.first][matIdx.second];
         }
+        setZzQReciprocals(0, zzLumin);
+        setZzQReciprocals(1, zzChromin);
+        setZzQReciprocals(2, zzChromin);
+    }
+
+    RLC::RLC(const std::vector<std::vector<UInt16>> &QTables)
+    {
+        setQTables(QTables);
+    }
+
+    void RLC::setQTables(const std::vector<std::vector<UInt16>> &zzQTables)
+    {
+        assert(zzQTables.size() >= 2);
+
+        // the tables are given in zig-zag order, the order they are used in
+        setZzQReciprocals(0, zzQTables[0]);
+        setZzQReciprocals(1, zzQTables[1]);
+        setZzQReciprocals(2, zzQTables[1]);
+    }
+
+    template <typename T>
+    void RLC::setZzQReciprocals(int channel, const T &zzQTable)
+    {
+        float zzSteps[64];
+        for (int i = 0; i < 64; ++i)
+        {
+            zzQReciprocals[channel][i] = 1.0f / zzQTable[i];
+            zzQSquares[channel][i] = (float)zzQTable[i] * zzQTable[i];
+            zzSteps[i] = zzQTable[i];
+        }
+        PrunedDCT::computeCornerLimits(zzSteps, prunedCornerLimits[channel]);
     }
 
     void RLC::setHSampFactors(int sampFactorY, int sampFactorCb, int sampFactorCr)
@@ -45,110 +124,265 @@ namespace cppeg
                                std::vector<int> &curDCValues,
                                const std::vector<int> &prevDCValues)
     {
-        // output run-length codes
+        float coefficients[3 * 64];
+        MCUToDCTCoefficients(MCU, coefficients);
         RLCContainer outputRLC;
+        DCTCoefficientsToRLC(coefficients, outputRLC, curDCValues, prevDCValues);
+        return outputRLC;
+    }
+
+    UInt8 RLC::MCUToDCTCoefficients(const cv::Mat &MCU, float *coefficients, bool isYCrCb)
+    {
+        if (isYCrCb)
+            return layoutToDCTCoefficients<InterleavedYCrCbLayout, OpenCVDCT>(MCU, coefficients);
+        return layoutToDCTCoefficients<InterleavedBGRLayout, OpenCVDCT>(MCU, coefficients);
+    }
+
+    bool RLC::channelToDCTCoefficients(const cv::Mat &YCrCbMCU, int channel, float *coefficients)
+    {
+        switch (channel)
+        {
+        case 0:
+            return layoutToDCTCoefficients<ComponentLayout<0>, OpenCVDCT>(YCrCbMCU, coefficients);
+        case 1:
+            return layoutToDCTCoefficients<ComponentLayout<1>, OpenCVDCT>(YCrCbMCU, coefficients);
+        default:
+            return layoutToDCTCoefficients<ComponentLayout<2>, OpenCVDCT>(YCrCbMCU, coefficients);
+        }
+    }
+
+    template <typename Layout, typename DCTEngine>
+    UInt8 RLC::layoutToDCTCoefficients(const cv::Mat &MCU, float *coefficients, float *prunedEnergies)
+    {
+        const int first = Layout::firstComponent, count = Layout::componentCount;
+        Arena &arena = threadArena();
 
         // convert color space: RGB to YCbCr
-        cv::Mat fpMCU(8, 8, CV_32FC3);
-        cv::cvtColor(MCU, fpMCU, cv::COLOR_BGR2YCrCb);
-
-        // perform forward DCT for each channel
-        std::vector<cv::Mat> channels(3), QTableArr(3);
-        cv::split(fpMCU, channels);
-        std::iter_swap(channels.begin() + 1, channels.begin() + 2); // CrCb to CbCr
-        cv::split(QTables, QTableArr);
-        for (int c = 0; c < 3; ++c)
+        cv::Mat YCrCbMCU = MCU;
+        if (Layout::convertColor)
         {
-            channels[c] = MCUTransform(channels[c], QTableArr[c]);
-            if (prevDCValues.size() != 0)
+            YCrCbMCU = cv::Mat(8, 8, CV_8UC3, arena.allocate<UInt8>(8 * 8 * 3));
+            cv::cvtColor(MCU, YCrCbMCU, cv::COLOR_BGR2YCrCb);
+        }
+
+        // split the channels, in CbCr instead of CrCb order
+        float *samples = arena.allocate<float>(count * 64);
+        for (int i = 0; i < 8; ++i)
+        {
+            const UInt8 *row = YCrCbMCU.ptr<UInt8>(i);
+            for (int j = 0; j < 8; ++j)
             {
-                curDCValues[c] = channels[c].at<float>(0, 0);
-                channels[c].at<float>(0, 0) -= prevDCValues[c];
+                for (int k = 0; k < count; ++k)
+                {
+                    samples[k * 64 + i * 8 + j] = row[j * 3 + YCrCbChannels[first + k]];
+                }
             }
-            std::vector<int> zzorderMCUData = MCUToZzorder(channels[c]);
-            outputRLC.push_back(zzorderDataToRLC(zzorderMCUData));
         }
 
-        return outputRLC;
+        // perform forward DCT for each channel, except the uniform ones
+        UInt8 flatChannels = 0;
+        for (int k = 0; k < count; ++k)
+        {
+            float prunedEnergy;
+            if (blockToDCTCoefficients<DCTEngine>(samples + k * 64, coefficients + k * 64, first + k, prunedEnergy))
+                flatChannels |= 1 << k;
+            if (prunedEnergies != nullptr)
+                prunedEnergies[k] = prunedEnergy;
+        }
+        return flatChannels;
+    }
+
+    template UInt8 RLC::layoutToDCTCoefficients<InterleavedBGRLayout, OpenCVDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<InterleavedYCrCbLayout, OpenCVDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<ComponentLayout<0>, OpenCVDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<ComponentLayout<1>, OpenCVDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<ComponentLayout<2>, OpenCVDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<InterleavedBGRLayout, PrunedDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<InterleavedYCrCbLayout, PrunedDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<ComponentLayout<0>, PrunedDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<ComponentLayout<1>, PrunedDCT>(const cv::Mat &, float *, float *);
+    template UInt8 RLC::layoutToDCTCoefficients<ComponentLayout<2>, PrunedDCT>(const cv::Mat &, float *, float *);
+
+    template <typename DCTEngine>
+    bool RLC::blockToDCTCoefficients(float *samples, float *coefficients, int channel, float &prunedEnergy)
+    {
+        float minValue = samples[0], maxValue = samples[0];
+        for (int i = 1; i < 64; ++i)
+        {
+            minValue = std::min(minValue, samples[i]);
+            maxValue = std::max(maxValue, samples[i]);
+        }
+
+        if (minValue == maxValue)
+        {
+            // the orthonormal DCT of a constant block is 8 x the shifted value at DC
+            std::fill(coefficients, coefficients + 64, 0.0f);
+            coefficients[0] = (samples[0] - 128.0f) * 8.0f;
+            prunedEnergy = 0.0f;
+            return true;
+        }
+        prunedEnergy = MCUTransform<DCTEngine>(samples, coefficients, channel);
+        return false;
     }
 
-    cv::Mat RLC::MCUTransform(const cv::Mat &MCU, const cv::Mat &QTable)
+    void RLC::DCTCoefficientsToRLC(const float *coefficients,
+                                   RLCContainer &outputRLC,
+                                   std::vector<int> &curDCValues,
+                                   const std::vector<int> &prevDCValues,
+                                   UInt8 flatChannels,
+                                   double *squaredErrors)
     {
-        assert(MCU.rows == 8 && MCU.cols == 8);
+        Int16 *zzorderMCUData = threadArena().allocate<Int16>(3 * 64);
+        UInt64 nonzeroMasks[3];
+        quantizeMCU(coefficients, zzorderMCUData, nonzeroMasks, flatChannels, squaredErrors);
+        quantizedMCUToRLC(zzorderMCUData, nonzeroMasks, outputRLC, curDCValues, prevDCValues);
+    }
 
-        // create a block to excute float point operation
-        cv::Mat fpMCU;
-        MCU.convertTo(fpMCU, CV_32F);
+    void RLC::quantizeMCU(const float *coefficients, Int16 *zzorderData, UInt64 *nonzeroMasks, UInt8 flatChannels,
+                          double *squaredErrors)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            nonzeroMasks[c] = quantizeBlock(c, coefficients + c * 64, zzorderData + c * 64, flatChannels & (1 << c),
+                                            squaredErrors != nullptr ? squaredErrors + c : nullptr);
+        }
+    }
 
-        // sfhit the pixel value by -128
-        fpMCU -= cv::Scalar::all(128);
+    UInt64 RLC::quantizeBlock(int channel, const float *coefficients, Int16 *zzorderData, bool flat,
+                              double *squaredError)
+    {
+        if (flat)
+        {
+            // DC only, EOB follows
+            std::fill(zzorderData + 1, zzorderData + 64, 0);
+            float scaled = coefficients[0] * zzQReciprocals[channel][0];
+            zzorderData[0] = (Int16)roundf(scaled);
+            // the AC coefficients of a flat block are exactly zero
+            if (squaredError != nullptr)
+                *squaredError += (scaled - zzorderData[0]) * (scaled - zzorderData[0]) * zzQSquares[channel][0];
+            return 0;
+        }
 
-        // perform forward DCT
-        cv::dct(fpMCU, fpMCU);
+        // the DC term is always coded, only the AC bits are kept
+        return quantizeToZzorder(coefficients, zzQReciprocals[channel], zzorderData, zzQSquares[channel], squaredError) &
+               ~(UInt64)1;
+    }
 
-        // quantization
-        cv::divide(fpMCU, QTable, fpMCU);
-        for (int i = 0; i < 8; ++i)
+    void RLC::quantizedMCUToRLC(const Int16 *zzorderData,
+                                const UInt64 *nonzeroMasks,
+                                RLCContainer &outputRLC,
+                                std::vector<int> &curDCValues,
+                                const std::vector<int> &prevDCValues)
+    {
+        outputRLC.resize(3);
+        for (int c = 0; c < 3; ++c)
         {
-            for (int j = 0; j < 8; ++j)
+            const Int16 *block = zzorderData + c * 64;
+            int DCValue = block[0];
+            if (prevDCValues.size() != 0)
             {
-                fpMCU.at<float>(i, j) = roundf(fpMCU.at<float>(i, j));
+                curDCValues[c] = block[0];
+                DCValue -= prevDCValues[c];
             }
+            zzorderDataToRLC(DCValue, block, nonzeroMasks[c], outputRLC[c]);
         }
-        return fpMCU;
     }
 
-    std::vector<int> RLC::MCUToZzorder(cv::Mat MCU)
+    template <typename DCTEngine>
+    float RLC::MCUTransform(float *samples, float *coefficients, int channel)
     {
-        std::vector<int> runLenCode;
+        // sfhit the pixel value by -128
         for (int i = 0; i < 64; ++i)
         {
-            std::pair<const int, const int> matIdx = zzOrderToMatIndices(i);
-            runLenCode.push_back(MCU.at<float>(matIdx.first, matIdx.second));
+            samples[i] -= 128.0f;
+        }
+
+        // perform forward DCT, a pruned one needs the limits of the quantization table of the channel
+        if constexpr (DCTEngine::usesCornerLimits)
+            return DCTEngine::forward(samples, coefficients, prunedCornerLimits[channel]);
+        else
+        {
+            DCTEngine::forward(samples, coefficients);
+            return 0.0f;
         }
-        return runLenCode;
     }
 
-    ChannelRLC RLC::zzorderDataToRLC(std::vector<int> zzorderData)
+    UInt64 RLC::quantizeToZzorder(const float *DCTBlock, const float *zzReciprocals, Int16 *zzorderData,
+                                  const float *zzQSquares, double *squaredError)
     {
-        ChannelRLC outputRLC;
-
-        // DC component
-        outputRLC.push_back(std::make_pair(0, zzorderData[0]));
-
-        // AC components (ITU-T81, page 92)
-        int k = 0, zeroCount = 0;
-        while (k != 63)
+        const std::array<UInt8, 64> &rasterIndex = zzorderToRaster();
+        UInt64 nonzeroMask = 0;
+        if (squaredError == nullptr)
         {
-            k++;
-            if (zzorderData[k] == 0)
+            for (int i = 0; i < 64; ++i)
             {
-                if (k == 63)
-                {
-                    outputRLC.push_back(std::make_pair(0, 0));
-                    break;
-                }
-                else
-                {
-                    zeroCount++;
-                    continue;
-                }
+                Int16 value = (Int16)roundf(DCTBlock[rasterIndex[i]] * zzReciprocals[i]);
+                zzorderData[i] = value;
+                nonzeroMask |= (UInt64)(value != 0) << i;
             }
-            else
+            return nonzeroMask;
+        }
+
+        // the rounding error of a scaled coefficient times the step is the error of the coefficient
+        float error = 0.0f;
+        for (int i = 0; i < 64; ++i)
+        {
+            float scaled = DCTBlock[rasterIndex[i]] * zzReciprocals[i];
+            Int16 value = (Int16)roundf(scaled);
+            zzorderData[i] = value;
+            nonzeroMask |= (UInt64)(value != 0) << i;
+            error += (scaled - value) * (scaled - value) * zzQSquares[i];
+        }
+        *squaredError += error;
+        return nonzeroMask;
+    }
+
+    UInt64 RLC::nonzeroACMask(const Int16 *zzorderData)
+    {
+        UInt64 nonzeroMask = 0;
+        for (int i = 1; i < 64; ++i)
+        {
+            nonzeroMask |= (UInt64)(zzorderData[i] != 0) << i;
+        }
+        return nonzeroMask;
+    }
+
+    bool RLC::isBaselineBlock(const Int16 *zzorderData)
+    {
+        if (zzorderData[0] < -1024 || zzorderData[0] > 1023)
+            return false;
+        for (int i = 1; i < 64; ++i)
+        {
+            if (zzorderData[i] < -1023 || zzorderData[i] > 1023)
+                return false;
+        }
+        return true;
+    }
+
+    void RLC::zzorderDataToRLC(int DCValue, const Int16 *zzorderData, UInt64 nonzeroMask, ChannelRLC &outputRLC)
+    {
+        outputRLC.clear();
+        outputRLC.reserve(countSetBits(nonzeroMask) + 2);
+
+        // DC component
+        outputRLC.push_back(std::make_pair(0, DCValue));
+        // AC components (ITU-T81, page 92), jumping from a nonzero coefficient to the next
+        int last = 0;
+        for (; nonzeroMask; nonzeroMask &= nonzeroMask - 1)
+        {
+            int k = countTrailingZeros(nonzeroMask);
+            int zeroCount = k - last - 1;
+            // a run longer than 15 zeros is split with ZRL codes (15, 0)
+            while (zeroCount > 15)
             {
-                if (zeroCount > 15)
-                {
-                    outputRLC.push_back(std::make_pair(15, 0));
-                    zeroCount -= 16;
-                }
-                else
-                {
-                    outputRLC.push_back(std::make_pair(zeroCount, zzorderData[k]));
-                    zeroCount = 0;
-                }
+                outputRLC.push_back(std::make_pair(15, 0));
+                zeroCount -= 16;
             }
+            outputRLC.push_back(std::make_pair(zeroCount, zzorderData[k]));
+            last = k;
         }
-
-        return outputRLC;
+        // EOB unless the last coefficient is nonzero
+        if (last != 63)
+            outputRLC.push_back(std::make_pair(0, 0));
     }
 }
\ No newline at end of file
@@ -0,0 +1,274 @@
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "SharedFrameRing.hpp"
+#include "Utility.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        const UInt32 RING_MAGIC = 0x474E5243; // "CRNG"
+
+        /// the end of the stream is the top bit of the published counter, so that the
+        /// consumer sleeping on the counter is woken by it; the counters wrap at 2^31
+        const UInt32 END_OF_STREAM = 0x80000000u;
+        const UInt32 COUNTER_MASK = 0x7FFFFFFFu;
+
+        const size_t PAGE_SIZE = 4096;
+
+        size_t roundUpToPage(size_t size)
+        {
+            return (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+        }
+
+        /// sleep while *word == expected
+        ///
+        /// @return false on timeout
+        bool futexWait(std::atomic<UInt32> *word, UInt32 expected, int timeoutMs)
+        {
+            timespec timeout{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+            long result = ::syscall(SYS_futex, reinterpret_cast<UInt32 *>(word), FUTEX_WAIT, expected,
+                                    timeoutMs >= 0 ? &timeout : nullptr, nullptr, 0);
+            return result == 0 || errno != ETIMEDOUT;
+        }
+
+        void futexWake(std::atomic<UInt32> *word)
+        {
+            ::syscall(SYS_futex, reinterpret_cast<UInt32 *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    /// the header at the start of the shared memory object
+    struct SharedFrameRing::RingHeader
+    {
+        UInt32 magic;
+        UInt32 slotCount;
+        UInt64 slotSize;
+
+        /// number of slots published by the producer and the END_OF_STREAM bit, the consumer sleeps on it
+        alignas(64) std::atomic<UInt32> published;
+
+        /// number of slots released by the consumer, the producer sleeps on it
+        alignas(64) std::atomic<UInt32> released;
+    };
+
+    /// the header of a slot, followed by the payload
+    struct SharedFrameRing::SlotHeader
+    {
+        UInt64 sequence;
+        UInt32 format;
+        UInt32 width;
+        UInt32 height;
+        UInt32 stride;
+        UInt64 size;
+        UInt8 reserved[32];
+    };
+
+    static_assert(sizeof(std::atomic<UInt32>) == sizeof(UInt32) && std::atomic<UInt32>::is_always_lock_free,
+                  "the counters must be plain lock-free words to be shared between processes");
+
+    SharedFrameRing::~SharedFrameRing()
+    {
+        close();
+    }
+
+    bool SharedFrameRing::create(const std::string &name, UInt32 slotCount, UInt64 slotSize)
+    {
+        close();
+        // the counters wrap at 2^31, a power of two slot count keeps the slot of a counter in step
+        if (slotCount == 0 || (slotCount & (slotCount - 1)) != 0 || slotCount > COUNTER_MASK || slotSize == 0)
+        {
+            logFile << "Invalid shared frame ring geometry: " << slotCount << " slots of " << slotSize
+                    << " bytes, the slot count must be a power of two" << std::endl;
+            return false;
+        }
+
+        m_slotStride = roundUpToPage(64 + slotSize);
+        m_mappingSize = PAGE_SIZE + (size_t)slotCount * m_slotStride;
+
+        ::shm_unlink(name.c_str());
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 || ::ftruncate(fd, m_mappingSize) != 0)
+        {
+            logFile << "Unable to create shared memory: \'" + name + "\'" << std::endl;
+            if (fd >= 0)
+                ::close(fd);
+            ::shm_unlink(name.c_str());
+            return false;
+        }
+
+        void *mapping = ::mmap(nullptr, m_mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            logFile << "Unable to map shared memory: \'" + name + "\'" << std::endl;
+            ::shm_unlink(name.c_str());
+            return false;
+        }
+
+        m_mapping = static_cast<UInt8 *>(mapping);
+        m_header = new (m_mapping) RingHeader();
+        m_header->slotCount = slotCount;
+        m_header->slotSize = slotSize;
+        m_header->published.store(0);
+        m_header->released.store(0);
+        // the magic is written last, an attaching process checks it
+        std::atomic_thread_fence(std::memory_order_release);
+        m_header->magic = RING_MAGIC;
+
+        m_name = name;
+        m_owner = true;
+        logFile << "Created shared frame ring \'" + name + "\': " << slotCount << " slots of " << slotSize << " bytes" << std::endl;
+        return true;
+    }
+
+    bool SharedFrameRing::attach(const std::string &name)
+    {
+        close();
+
+        int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        struct stat status;
+        if (fd < 0 || ::fstat(fd, &status) != 0 || (size_t)status.st_size < PAGE_SIZE)
+        {
+            logFile << "Unable to open shared memory: \'" + name + "\'" << std::endl;
+            if (fd >= 0)
+                ::close(fd);
+            return false;
+        }
+
+        void *mapping = ::mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            logFile << "Unable to map shared memory: \'" + name + "\'" << std::endl;
+            return false;
+        }
+        m_mapping = static_cast<UInt8 *>(mapping);
+        m_mappingSize = status.st_size;
+        m_header = reinterpret_cast<RingHeader *>(m_mapping);
+
+        m_slotStride = roundUpToPage(64 + m_header->slotSize);
+        UInt32 slotCount = m_header->slotCount;
+        if (m_header->magic != RING_MAGIC || slotCount == 0 || (slotCount & (slotCount - 1)) != 0 ||
+            PAGE_SIZE + (size_t)m_header->slotCount * m_slotStride > m_mappingSize)
+        {
+            logFile << "Invalid shared frame ring: \'" + name + "\'" << std::endl;
+            close();
+            return false;
+        }
+
+        m_name = name;
+        m_owner = false;
+        return true;
+    }
+
+    void SharedFrameRing::close()
+    {
+        if (m_mapping != nullptr)
+            ::munmap(m_mapping, m_mappingSize);
+        if (m_owner)
+            ::shm_unlink(m_name.c_str());
+        m_mapping = nullptr;
+        m_header = nullptr;
+        m_owner = false;
+    }
+
+    UInt64 SharedFrameRing::slotSize() const
+    {
+        return m_header != nullptr ? m_header->slotSize : 0;
+    }
+
+    SharedFrameRing::SlotHeader *SharedFrameRing::slot(UInt32 counter) const
+    {
+        static_assert(sizeof(SlotHeader) == 64, "the payload of a slot starts 64 bytes in");
+        return reinterpret_cast<SlotHeader *>(m_mapping + PAGE_SIZE +
+                                              (size_t)((counter & COUNTER_MASK) % m_header->slotCount) * m_slotStride);
+    }
+
+    bool SharedFrameRing::acquireRead(Frame &frame, int timeoutMs)
+    {
+        UInt32 released = m_header->released.load(std::memory_order_relaxed);
+        while (true)
+        {
+            // the count and the end are read together: a frame published right before the end is still read,
+            // and an end signalled after this load changes the word, so the wait below returns at once
+            UInt32 published = m_header->published.load(std::memory_order_acquire);
+            if ((published & COUNTER_MASK) != released)
+                break;
+            if (published & END_OF_STREAM)
+                return false;
+            if (!futexWait(&m_header->published, published, timeoutMs))
+                return false;
+        }
+
+        SlotHeader *header = slot(released);
+        frame.sequence = header->sequence;
+        frame.format = static_cast<Format>(header->format);
+        frame.width = header->width;
+        frame.height = header->height;
+        frame.stride = header->stride;
+        frame.size = header->size;
+        frame.data = reinterpret_cast<UInt8 *>(header) + 64;
+        return true;
+    }
+
+    void SharedFrameRing::releaseRead()
+    {
+        UInt32 released = m_header->released.load(std::memory_order_relaxed);
+        m_header->released.store((released + 1) & COUNTER_MASK, std::memory_order_release);
+        futexWake(&m_header->released);
+    }
+
+    bool SharedFrameRing::ended() const
+    {
+        return (m_header->published.load(std::memory_order_acquire) & END_OF_STREAM) != 0;
+    }
+
+    UInt8 *SharedFrameRing::acquireWrite(int timeoutMs)
+    {
+        UInt32 published = m_header->published.load(std::memory_order_relaxed) & COUNTER_MASK;
+        while (true)
+        {
+            // only a release frees a slot, and it changes the word the wait below sleeps on
+            UInt32 released = m_header->released.load(std::memory_order_acquire);
+            if (((published - released) & COUNTER_MASK) < m_header->slotCount)
+                break;
+            if (!futexWait(&m_header->released, released, timeoutMs))
+                return nullptr;
+        }
+        return reinterpret_cast<UInt8 *>(slot(published)) + 64;
+    }
+
+    void SharedFrameRing::publish(const Frame &frame)
+    {
+        UInt32 published = m_header->published.load(std::memory_order_relaxed);
+        SlotHeader *header = slot(published);
+        header->sequence = frame.sequence;
+        header->format = frame.format;
+        header->width = frame.width;
+        header->height = frame.height;
+        header->stride = frame.stride;
+        header->size = frame.size;
+
+        m_header->published.store(((published + 1) & COUNTER_MASK) | (published & END_OF_STREAM),
+                                  std::memory_order_release);
+        futexWake(&m_header->published);
+    }
+
+    void SharedFrameRing::endStream()
+    {
+        m_header->published.fetch_or(END_OF_STREAM, std::memory_order_release);
+        futexWake(&m_header->published);
+    }
+}
@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "opencv2/imgproc.hpp"
+#include "TilePyramid.hpp"
+#include "Encoder.hpp"
+#include "Utility.hpp"
+
+namespace cppeg
+{
+    namespace
+    {
+        const UInt32 ARCHIVE_MAGIC = 0x41545043; // "CPTA"
+
+        const UInt32 ARCHIVE_VERSION = 1;
+
+        /// a tile waiting for an encoder thread
+        struct TileTask
+        {
+            int level, column, row;
+        };
+
+        double secondsSince(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        bool makeDirectory(const std::string &path)
+        {
+            return ::mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+        }
+
+        bool entryBefore(const TileArchiveSink::IndexEntry &a, const TileArchiveSink::IndexEntry &b)
+        {
+            if (a.level != b.level)
+                return a.level < b.level;
+            return a.row != b.row ? a.row < b.row : a.column < b.column;
+        }
+    }
+
+    TileLayout::TileLayout(int width, int height, int tileSize, int overlap)
+        : width(width), height(height), tileSize(std::max(tileSize, 1)), overlap(std::max(overlap, 0))
+    {
+        // the top level is the first whose scale 1 / 2^n brings the image down to a pixel
+        int topLevel = 0;
+        while ((1LL << topLevel) < std::max(width, height))
+            ++topLevel;
+        levelCount = topLevel + 1;
+    }
+
+    cv::Size TileLayout::levelSize(int level) const
+    {
+        int shift = levelCount - 1 - level;
+        long long scale = 1LL << shift;
+        return cv::Size((int)((width + scale - 1) >> shift), (int)((height + scale - 1) >> shift));
+    }
+
+    int TileLayout::columns(int level) const
+    {
+        return (levelSize(level).width + tileSize - 1) / tileSize;
+    }
+
+    int TileLayout::rows(int level) const
+    {
+        return (levelSize(level).height + tileSize - 1) / tileSize;
+    }
+
+    size_t TileLayout::tileCount() const
+    {
+        size_t count = 0;
+        for (int level = 0; level < levelCount; ++level)
+            count += (size_t)columns(level) * rows(level);
+        return count;
+    }
+
+    cv::Rect TileLayout::tileRect(int level, int column, int row) const
+    {
+        cv::Size size = levelSize(level);
+        int x = column * tileSize - (column > 0 ? overlap : 0);
+        int y = row * tileSize - (row > 0 ? overlap : 0);
+        int right = std::min((column + 1) * tileSize + overlap, size.width);
+        int bottom = std::min((row + 1) * tileSize + overlap, size.height);
+        return cv::Rect(x, y, right - x, bottom - y);
+    }
+
+    TileDirectorySink::TileDirectorySink(const std::string &baseName)
+        : m_baseName(baseName)
+    {
+    }
+
+    bool TileDirectorySink::begin(const TileLayout &layout)
+    {
+        m_layout = layout;
+
+        // the level directories are created up front, the encoder threads only write files
+        std::string directory = m_baseName + "_files";
+        bool created = makeDirectory(directory);
+        for (int level = 0; created && level < layout.levelCount; ++level)
+            created = makeDirectory(directory + "/" + std::to_string(level));
+        if (!created)
+            logFile << "Unable to create the tile directory: \'" + directory + "\'" << std::endl;
+        return created;
+    }
+
+    bool TileDirectorySink::writeTile(int level, int column, int row, const char *data, size_t size)
+    {
+        std::string filename = m_baseName + "_files/" + std::to_string(level) + "/" +
+                               std::to_string(column) + "_" + std::to_string(row) + ".jpg";
+        // one sink per encoder thread, so its buffer is allocated once
+        thread_local FileSink file;
+        bool written = file.open(filename) && file.write(data, size);
+        return file.close() && written;
+    }
+
+    bool TileDirectorySink::finish()
+    {
+        std::ostringstream descriptor;
+        descriptor << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"jpg\" Overlap=\""
+                   << m_layout.overlap << "\" TileSize=\"" << m_layout.tileSize << "\">\n"
+                   << "  <Size Width=\"" << m_layout.width << "\" Height=\"" << m_layout.height << "\"/>\n"
+                   << "</Image>\n";
+        std::string data = descriptor.str();
+        FileSink file;
+        if (!file.open(m_baseName + ".dzi") || !file.write(data.c_str(), data.size()) || !file.close())
+        {
+            logFile << "Unable to write: \'" + m_baseName + ".dzi\'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    TileArchiveSink::TileArchiveSink(const std::string &filename)
+        : m_filename(filename)
+    {
+    }
+
+    bool TileArchiveSink::begin(const TileLayout &layout)
+    {
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = ARCHIVE_MAGIC;
+        header.version = ARCHIVE_VERSION;
+        header.width = layout.width;
+        header.height = layout.height;
+        header.tileSize = layout.tileSize;
+        header.overlap = layout.overlap;
+        header.levelCount = layout.levelCount;
+        header.tileCount = layout.tileCount();
+
+        m_index.clear();
+        m_index.reserve(header.tileCount);
+        if (!m_file.open(m_filename) || !m_file.write(&header, sizeof(header)))
+        {
+            logFile << "Unable to write tile archive: \'" + m_filename + "\'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool TileArchiveSink::writeTile(int level, int column, int row, const char *data, size_t size)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        IndexEntry entry;
+        entry.level = level;
+        entry.column = column;
+        entry.row = row;
+        entry.size = size;
+        entry.offset = m_file.size();
+        if (!m_file.write(data, size))
+            return false;
+        m_index.push_back(entry);
+        return true;
+    }
+
+    bool TileArchiveSink::finish()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::sort(m_index.begin(), m_index.end(), entryBefore);
+
+        // the index starts on an 8-byte boundary, so a reader can use it in place
+        char padding[8] = {};
+        m_file.write(padding, (8 - m_file.size() % 8) % 8);
+
+        Trailer trailer;
+        std::memset(&trailer, 0, sizeof(trailer));
+        trailer.indexOffset = m_file.size();
+        trailer.entryCount = m_index.size();
+        trailer.magic = ARCHIVE_MAGIC;
+        if (!m_file.write(m_index.data(), m_index.size() * sizeof(IndexEntry)) ||
+            !m_file.write(&trailer, sizeof(trailer)) || !m_file.close())
+        {
+            logFile << "Unable to write tile archive: \'" + m_filename + "\'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    TileArchive::~TileArchive()
+    {
+        close();
+    }
+
+    bool TileArchive::open(const std::string &filename)
+    {
+        close();
+
+        typedef TileArchiveSink::Header Header;
+        typedef TileArchiveSink::IndexEntry IndexEntry;
+        typedef TileArchiveSink::Trailer Trailer;
+
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat status;
+        if (fd < 0 || ::fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(Header) + sizeof(Trailer))
+        {
+            logFile << "Unable to open tile archive: \'" + filename + "\'" << std::endl;
+            if (fd >= 0)
+                ::close(fd);
+            return false;
+        }
+
+        void *mapping = ::mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            logFile << "Unable to map tile archive: \'" + filename + "\'" << std::endl;
+            return false;
+        }
+        m_mapping = static_cast<UInt8 *>(mapping);
+        m_mappingSize = status.st_size;
+        m_header = reinterpret_cast<const Header *>(m_mapping);
+
+        const Trailer &trailer = *reinterpret_cast<const Trailer *>(m_mapping + m_mappingSize - sizeof(Trailer));
+        bool valid = m_header->magic == ARCHIVE_MAGIC && m_header->version == ARCHIVE_VERSION &&
+                     trailer.magic == ARCHIVE_MAGIC && trailer.indexOffset % 8 == 0 &&
+                     trailer.indexOffset >= sizeof(Header) &&
+                     trailer.indexOffset + (UInt64)trailer.entryCount * sizeof(IndexEntry) + sizeof(Trailer) == m_mappingSize;
+        if (valid)
+        {
+            m_entries = reinterpret_cast<const IndexEntry *>(m_mapping + trailer.indexOffset);
+            m_entryCount = trailer.entryCount;
+            for (size_t n = 0; valid && n < m_entryCount; ++n)
+                valid = m_entries[n].offset >= sizeof(Header) && m_entries[n].offset + m_entries[n].size <= trailer.indexOffset &&
+                        (n == 0 || entryBefore(m_entries[n - 1], m_entries[n]));
+        }
+        if (!valid)
+        {
+            logFile << "Invalid tile archive: \'" + filename + "\'" << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void TileArchive::close()
+    {
+        if (m_mapping != nullptr)
+            ::munmap(m_mapping, m_mappingSize);
+        m_mapping = nullptr;
+        m_mappingSize = 0;
+        m_header = nullptr;
+        m_entries = nullptr;
+        m_entryCount = 0;
+    }
+
+    const char *TileArchive::tile(int level, int column, int row, size_t &size) const
+    {
+        TileArchiveSink::IndexEntry key;
+        key.level = level;
+        key.column = column;
+        key.row = row;
+        const TileArchiveSink::IndexEntry *end = m_entries + m_entryCount;
+        const TileArchiveSink::IndexEntry *entry = std::lower_bound(m_entries, end, key, entryBefore);
+        if (entry == end || entryBefore(key, *entry))
+            return nullptr;
+
+        size = entry->size;
+        return reinterpret_cast<const char *>(m_mapping + entry->offset);
+    }
+
+    TilePyramid::TilePyramid(int tileSize, int overlap, unsigned encodeThreads)
+        : m_tileSize(tileSize), m_overlap(overlap), m_encodeThreads(encodeThreads)
+    {
+        if (m_encodeThreads == 0)
+            m_encodeThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    void TilePyramid::setQuality(int quality)
+    {
+        m_quality = quality;
+    }
+
+    TilePyramid::Stats TilePyramid::encode(const cv::Mat &image, TileSink &sink)
+    {
+        Stats stats;
+        auto pyramidStart = std::chrono::steady_clock::now();
+        if (image.empty() || image.type() != CV_8UC3)
+        {
+            logFile << "Unable to build a tile pyramid: expected a non-empty 8-bit BGR image" << std::endl;
+            return stats;
+        }
+
+        TileLayout layout(image.cols, image.rows, m_tileSize, m_overlap);
+        stats.levels = layout.levelCount;
+        if (!sink.begin(layout))
+        {
+            stats.failed = layout.tileCount();
+            return stats;
+        }
+
+        // the tiles in encode order, the top level first, as it is ready first
+        std::vector<TileTask> tasks;
+        tasks.reserve(layout.tileCount());
+        for (int level = layout.levelCount - 1; level >= 0; --level)
+            for (int row = 0; row < layout.rows(level); ++row)
+                for (int column = 0; column < layout.columns(level); ++column)
+                    tasks.push_back({level, column, row});
+
+        // levels[n] is written before readyLevel drops to n and never changes afterwards
+        std::vector<cv::Mat> levels(layout.levelCount);
+        std::mutex levelMutex;
+        std::condition_variable levelReady;
+        int readyLevel = layout.levelCount;
+
+        std::atomic<size_t> nextTask(0), tilesWritten(0), bytesWritten(0);
+        std::mutex failureMutex;
+        std::string failureLog;
+
+        size_t workerCount = std::max<size_t>(1, std::min<size_t>(m_encodeThreads, tasks.size()));
+        std::vector<double> encodeSeconds(workerCount, 0);
+        std::vector<std::thread> workers;
+        for (size_t k = 0; k < workerCount; ++k)
+        {
+            workers.emplace_back([&, k] {
+                Encoder encoder;
+                encoder.setQuality(m_quality);
+                MemorySink output;
+                // the log of a tile is kept only if the tile fails
+                std::ostringstream log;
+                encoder.setLogStream(&log);
+
+                for (size_t n = nextTask++; n < tasks.size(); n = nextTask++)
+                {
+                    const TileTask &task = tasks[n];
+                    {
+                        std::unique_lock<std::mutex> lock(levelMutex);
+                        levelReady.wait(lock, [&] { return readyLevel <= task.level; });
+                    }
+
+                    auto start = std::chrono::steady_clock::now();
+                    output.reset();
+                    log.str("");
+                    cv::Mat tile = levels[task.level](layout.tileRect(task.level, task.column, task.row));
+                    if (encoder.encodeFrame(tile, output) == Encoder::ResultCode::ENCODE_DONE &&
+                        sink.writeTile(task.level, task.column, task.row, output.data(), output.size()))
+                    {
+                        tilesWritten++;
+                        bytesWritten += output.size();
+                    }
+                    else
+                    {
+                        std::lock_guard<std::mutex> lock(failureMutex);
+                        failureLog += log.str() + "Unable to encode or write the tile " + std::to_string(task.column) + "_" +
+                                      std::to_string(task.row) + " of level " + std::to_string(task.level) + "\n";
+                    }
+                    encodeSeconds[k] += secondsSince(start);
+                }
+                encoder.setLogStream(nullptr);
+            });
+        }
+
+        // every level is downsampled once, from the level above it
+        auto downsampleStart = std::chrono::steady_clock::now();
+        for (int level = layout.levelCount - 1; level >= 0; --level)
+        {
+            if (level == layout.levelCount - 1)
+                levels[level] = image;
+            else
+                cv::resize(levels[level + 1], levels[level], layout.levelSize(level), 0, 0, cv::INTER_AREA);
+
+            std::lock_guard<std::mutex> lock(levelMutex);
+            readyLevel = level;
+            levelReady.notify_all();
+        }
+        stats.downsampleSeconds = secondsSince(downsampleStart);
+
+        for (std::thread &worker : workers)
+            worker.join();
+
+        bool finished = sink.finish();
+        logFile << failureLog;
+
+        // the tiles are of no use if the directory descriptor or the archive index is missing
+        stats.tiles = finished ? tilesWritten.load() : 0;
+        stats.failed = tasks.size() - stats.tiles;
+        stats.bytesWritten = bytesWritten;
+        for (double seconds : encodeSeconds)
+            stats.encodeSeconds += seconds;
+        stats.seconds = secondsSince(pyramidStart);
+
+        logFile << "Tile pyramid of " << layout.width << "x" << layout.height << " with " << stats.levels << " levels, "
+                << workerCount << " encoder threads: " << stats.tiles << " tiles encoded, " << stats.failed << " failed, "
+                << stats.bytesWritten << " bytes in " << stats.seconds << " s (downsample " << stats.downsampleSeconds
+                << " s, encode " << stats.encodeSeconds << " s)" << std::endl;
+        return stats;
+    }
+}
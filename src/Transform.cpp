@@ -1,6 +1,9 @@
+#include <algorithm>
+#include <array>
 #include <cmath>
 #include <bitset>
 
+#include "opencv2/core.hpp"
 #include "Transform.hpp"
 
 namespace cppeg
@@ -46,20 +49,148 @@ namespace cppeg
         return matOrder[row][column];
     }
 
+    void OpenCVDCT::forward(const float *samples, float *coefficients)
+    {
+        // the matrices only wrap the buffers
+        const cv::Mat sampleBlock(8, 8, CV_32F, const_cast<float *>(samples));
+        cv::Mat DCTBlock(8, 8, CV_32F, coefficients);
+        cv::dct(sampleBlock, DCTBlock);
+    }
+
+    void PrunedDCT::computeCornerLimits(const float *zzQTable, float *cornerLimits)
+    {
+        for (int t = 0, size = 1; t < 3; ++t, size *= 2)
+        {
+            float minStep = 65535.0f;
+            for (int i = 0; i < 64; ++i)
+            {
+                std::pair<const int, const int> coord = zzOrderToMatIndices(i);
+                if (coord.first >= size || coord.second >= size)
+                    minStep = std::min(minStep, zzQTable[i]);
+            }
+            // a coefficient quantizes to zero below half a step; the float DCT and
+            // the reciprocal of the step may be off by a few units in the last place
+            cornerLimits[t] = (minStep * 0.5f - 0.01f) / 1.001f;
+        }
+    }
+
+    float PrunedDCT::forward(const float *samples, float *coefficients, const float *cornerLimits)
+    {
+        // basis[k][n] = a(k) * cos((2n + 1) * k * pi / 16)
+        static const auto basis = [] {
+            std::array<std::array<float, 8>, 8> table{};
+            for (int k = 0; k < 8; ++k)
+                for (int n = 0; n < 8; ++n)
+                    table[k][n] = (k == 0 ? std::sqrt(1.0 / 8) : std::sqrt(2.0 / 8)) * std::cos((2 * n + 1) * k * M_PI / 16);
+            return table;
+        }();
+
+        float sum = 0.0f;
+        for (int i = 0; i < 64; ++i)
+            sum += samples[i];
+        float mean = sum / 64.0f;
+        float absoluteDeviation = 0.0f, energy = 0.0f;
+        for (int i = 0; i < 64; ++i)
+        {
+            float deviation = samples[i] - mean;
+            absoluteDeviation += std::abs(deviation);
+            energy += deviation * deviation;
+        }
+        float bound = std::min(0.25f * absoluteDeviation, std::sqrt(energy));
+
+        int size = bound < cornerLimits[0] ? 1 : (bound < cornerLimits[1] ? 2 : (bound < cornerLimits[2] ? 4 : 8));
+        if (size == 8)
+        {
+            OpenCVDCT::forward(samples, coefficients);
+            return 0.0f;
+        }
+
+        // the corner by separable products: the rows, then the columns
+        float rows[8 * 4];
+        for (int y = 0; y < 8; ++y)
+            for (int v = 0; v < size; ++v)
+            {
+                float product = 0.0f;
+                for (int x = 0; x < 8; ++x)
+                    product += samples[y * 8 + x] * basis[v][x];
+                rows[y * 4 + v] = product;
+            }
+        float cornerEnergy = 0.0f;
+        for (int u = 0; u < size; ++u)
+            for (int v = 0; v < size; ++v)
+            {
+                float product = 0.0f;
+                for (int y = 0; y < 8; ++y)
+                    product += basis[u][y] * rows[y * 4 + v];
+                coefficients[u * 8 + v] = product;
+                if (u != 0 || v != 0)
+                    cornerEnergy += product * product;
+            }
+        // the orthonormal DC is the sum of the samples divided by 8
+        coefficients[0] = sum / 8.0f;
+
+        // the coefficients outside the corner quantize to zero, their error is the AC energy left
+        for (int u = 0; u < 8; ++u)
+            for (int v = 0; v < 8; ++v)
+                if (u >= size || v >= size)
+                    coefficients[u * 8 + v] = 0.0f;
+        return std::max(energy - cornerEnergy, 0.0f);
+    }
+
+    void scaledInverseDCT(const float *coefficients, const int size, float *samples)
+    {
+        // basis[k][n] = a(k) * cos((2n + 1) * k * pi / (2 * size)) for the sizes 1, 2 and 4
+        static const auto basisTables = [] {
+            std::array<std::array<float, 16>, 3> tables{};
+            for (int t = 0, N = 1; t < 3; ++t, N *= 2)
+                for (int k = 0; k < N; ++k)
+                    for (int n = 0; n < N; ++n)
+                        tables[t][k * N + n] = (k == 0 ? std::sqrt(1.0 / N) : std::sqrt(2.0 / N)) *
+                                               std::cos((2 * n + 1) * k * M_PI / (2 * N));
+            return tables;
+        }();
+        const float *basis = basisTables[size == 1 ? 0 : (size == 2 ? 1 : 2)].data();
+
+        // an orthonormal 8-point DCT gains sqrt(8 / size) per dimension
+        // over a size-point DCT of the downscaled block
+        const float scale = (float)size / 8.0f;
+
+        // inverse DCT of the rows, then of the columns
+        float rows[16];
+        for (int u = 0; u < size; ++u)
+            for (int x = 0; x < size; ++x)
+            {
+                float sum = 0;
+                for (int v = 0; v < size; ++v)
+                    sum += coefficients[u * 8 + v] * basis[v * size + x];
+                rows[u * size + x] = sum * scale;
+            }
+        for (int y = 0; y < size; ++y)
+            for (int x = 0; x < size; ++x)
+            {
+                float sum = 0;
+                for (int u = 0; u < size; ++u)
+                    sum += rows[u * size + x] * basis[u * size + y];
+                samples[y * size + x] = sum;
+            }
+    }
+
     std::string valuetoBitString(const Int16 value)
     {
         if (value == 0x0000)
             return "";
 
-        std::string bitStr;
         Int16 bitsLen = getValueCategory(value);
 
-        std::bitset<16> bits(abs(value));
-        if (value < 0)
-            bits.flip();
+        // negative values are written as the one's complement of their magnitude,
+        // whose low bits are the low bits of (value - 1) in two's complement
+        int bits = value < 0 ? value - 1 : value;
 
-        bitStr = bits.to_string();
-        return bitStr.substr(bitStr.size() - bitsLen, bitsLen);
+        // at most 15 characters, short enough to never allocate
+        char bitStr[16];
+        for (int i = 0; i < bitsLen; ++i)
+            bitStr[i] = (bits >> (bitsLen - 1 - i)) & 1 ? '1' : '0';
+        return std::string(bitStr, bitsLen);
     }
 
     const Int16 getValueCategory(const Int16 value)
@@ -69,28 +200,93 @@ namespace cppeg
         return std::log2(std::abs(value)) + 1;
     }
 
-    std::string singleRLCToBitString(const ChannelRLC &runLengthCode,
-                                     const HuffmanCodeMapper &DCMapper,
-                                     const HuffmanCodeMapper &ACMapper)
+    bool DCValueToBitString(const int amplitude, const HuffmanCodeMapper &DCMapper, std::string &bitString)
+    {
+        UInt8 dcCategory = getValueCategory(amplitude);
+        auto huffmanCode = DCMapper.find(dcCategory);
+        if (huffmanCode == DCMapper.end())
+            return false;
+        bitString += huffmanCode->second;
+        bitString += valuetoBitString(amplitude);
+        return true;
+    }
+
+    bool ACRLCToBitString(const ChannelRLC &runLengthCode, const HuffmanCodeMapper &ACMapper, std::string &bitString)
     {
-        std::string bitString;
-
-        // Luminance part
-        // DC
-        int dcAmplitude = runLengthCode[0].second;
-        UInt8 dcCategory = getValueCategory(dcAmplitude);
-        bitString += DCMapper.find(dcCategory)->second;
-        bitString += valuetoBitString(dcAmplitude);
-        // AC
         for (int i = 1; i < runLengthCode.size(); ++i)
         {
             std::pair code = runLengthCode[i];
             int acAmplitude = code.second;
-            UInt8 RRRR = code.first & 0x0f, SSSS = getValueCategory(acAmplitude) & 0x0f;
-            UInt8 RRRRSSSS = (RRRR << 4) | SSSS;
-            bitString += ACMapper.find(RRRRSSSS)->second; // huffman code of RRRRSSSS
-            bitString += valuetoBitString(acAmplitude);   // additional bits
+            // the size is not masked, so a size above 15 cannot alias another symbol
+            UInt16 RRRR = code.first & 0x0f, SSSS = getValueCategory(acAmplitude);
+            UInt16 RRRRSSSS = (RRRR << 4) | SSSS;
+            auto huffmanCode = ACMapper.find(RRRRSSSS);
+            if (huffmanCode == ACMapper.end())
+                return false;
+            bitString += huffmanCode->second;           // huffman code of RRRRSSSS
+            bitString += valuetoBitString(acAmplitude); // additional bits
+        }
+        return true;
+    }
+
+    bool singleRLCToBitString(const ChannelRLC &runLengthCode,
+                              const HuffmanCodeMapper &DCMapper,
+                              const HuffmanCodeMapper &ACMapper,
+                              std::string &bitString)
+    {
+        return DCValueToBitString(runLengthCode[0].second, DCMapper, bitString) &&
+               ACRLCToBitString(runLengthCode, ACMapper, bitString);
+    }
+
+    HuffmanCodeTable huffmanMapperToCodeTable(const HuffmanCodeMapper &mapper)
+    {
+        HuffmanCodeTable table;
+        for (const auto &entry : mapper)
+        {
+            UInt16 code = 0;
+            for (char bit : entry.second)
+                code = (code << 1) | (bit == '1');
+            table.codes[entry.first & 0xFF] = code;
+            table.lengths[entry.first & 0xFF] = entry.second.size();
+        }
+        return table;
+    }
+
+    void ScanMeter::putBits(UInt32 bits, int length)
+    {
+        m_register = (m_register << length) | (bits & ((1u << length) - 1));
+        m_pendingBits += length;
+        while (m_pendingBits >= 8)
+        {
+            m_pendingBits -= 8;
+            m_bytes++;
+            m_stuffedBytes += ((m_register >> m_pendingBits) & 0xFF) == 0xFF;
+        }
+    }
+
+    void ScanMeter::putRLC(const ChannelRLC &runLengthCode, const HuffmanCodeTable &DCTable, const HuffmanCodeTable &ACTable)
+    {
+        for (size_t i = 0; i < runLengthCode.size(); ++i)
+        {
+            int amplitude = runLengthCode[i].second;
+            int magnitude = amplitude < 0 ? -amplitude : amplitude;
+            int category = 0;
+            while (magnitude >> category)
+                category++;
+
+            // the DC code is indexed by the category, the AC codes by RRRRSSSS
+            const HuffmanCodeTable &table = i == 0 ? DCTable : ACTable;
+            UInt8 symbol = i == 0 ? category : ((runLengthCode[i].first & 0x0f) << 4) | (category & 0x0f);
+            putBits(table.codes[symbol], table.lengths[symbol]);
+            if (category != 0)
+                putBits(amplitude < 0 ? amplitude - 1 : amplitude, category);
         }
-        return bitString;
+    }
+
+    size_t ScanMeter::finish()
+    {
+        if (m_pendingBits > 0)
+            putBits(0xFF, 8 - m_pendingBits);
+        return m_bytes + m_stuffedBytes;
     }
 }
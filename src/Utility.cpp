@@ -1,3 +1,47 @@
+#include <fstream>
+#include <mutex>
+#include <sstream>
+
 #include "Utility.hpp"
 
-std::ofstream logFile("kpeg.log", std::ios::out);
\ No newline at end of file
+namespace
+{
+    /// the log file shared by all threads, only written under its lock
+    std::ofstream &sharedLogFile()
+    {
+        static std::ofstream file("kpeg.log", std::ios::out);
+        return file;
+    }
+
+    std::mutex &sharedLogMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    /// collects the messages of a thread and appends them to the log file on flush
+    class ThreadLogBuffer : public std::stringbuf
+    {
+    public:
+        ~ThreadLogBuffer()
+        {
+            sync();
+        }
+
+    protected:
+        int sync() override
+        {
+            if (str().empty())
+                return 0;
+            std::lock_guard<std::mutex> lock(sharedLogMutex());
+            sharedLogFile() << str();
+            sharedLogFile().flush();
+            str("");
+            return 0;
+        }
+    };
+
+    thread_local ThreadLogBuffer logBuffer;
+}
+
+thread_local std::ostream logFile(&logBuffer);